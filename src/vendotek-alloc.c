@@ -0,0 +1,244 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "vendotek.h"
+
+/*
+ * Memory allocation
+ *
+ * Every library allocation goes through the allocator set by vtk_set_allocator(),
+ * libc malloc by default. Buffers of messages and streams are reused, so once the
+ * first transaction has sized them the library doesn't allocate anymore; per-thread
+ * counters make this verifiable.
+ */
+static void *
+vtk_libc_alloc(void *ctx, size_t size)
+{
+    return malloc(size);
+}
+
+static void *
+vtk_libc_realloc(void *ctx, void *ptr, size_t size)
+{
+    return realloc(ptr, size);
+}
+
+static void
+vtk_libc_free(void *ctx, void *ptr)
+{
+    free(ptr);
+}
+
+static vtk_allocator_t vtk_allocator = {
+    .alloc   = vtk_libc_alloc,
+    .realloc = vtk_libc_realloc,
+    .free    = vtk_libc_free
+};
+
+static __thread vtk_alloc_stat_t vtk_alloc_counters;
+
+int vtk_set_allocator(const vtk_allocator_t *allocator)
+{
+    if (allocator && (! allocator->alloc || ! allocator->realloc || ! allocator->free)) {
+        vtk_loge("Allocator must provide alloc, realloc and free");
+        return -1;
+    }
+    vtk_allocator = allocator ? *allocator : (vtk_allocator_t) {
+        .alloc   = vtk_libc_alloc,
+        .realloc = vtk_libc_realloc,
+        .free    = vtk_libc_free
+    };
+    return 0;
+}
+
+void vtk_alloc_stat(vtk_alloc_stat_t *stat)
+{
+    *stat = vtk_alloc_counters;
+}
+
+void *vtk_mem_alloc(size_t size)
+{
+    void *ptr = vtk_allocator.alloc(vtk_allocator.ctx, size);
+    if (! ptr) {
+        vtk_loge("Out of memory: %lu bytes", size);
+        return NULL;
+    }
+    vtk_alloc_counters.allocs++;
+    vtk_alloc_counters.bytes += size;
+    return ptr;
+}
+
+void *vtk_mem_realloc(void *ptr, size_t size)
+{
+    void *nptr = vtk_allocator.realloc(vtk_allocator.ctx, ptr, size);
+    if (! nptr) {
+        vtk_loge("Out of memory: %lu bytes", size);
+        return NULL;
+    }
+    vtk_alloc_counters.reallocs++;
+    vtk_alloc_counters.bytes += size;
+    return nptr;
+}
+
+void vtk_mem_free(void *ptr)
+{
+    if (ptr) {
+        vtk_allocator.free(vtk_allocator.ctx, ptr);
+        vtk_alloc_counters.frees++;
+    }
+}
+
+char *vtk_mem_strdup(const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char  *dup = vtk_mem_alloc(len);
+    return dup ? memcpy(dup, str, len) : NULL;
+}
+
+/*
+ * Static pool: power of two size classes carved from a caller-provided buffer.
+ * Freed blocks go to the free list of own class and are reused by the next allocation
+ * of that class, so the pool doesn't fragment however long it runs. Larger blocks are
+ * rare one-offs (tables sized by the input), they come from the heap with the same header.
+ */
+#define POOL_MINSHIFT  4
+#define POOL_CLASSES   14          /* 16 bytes .. 128 KB */
+#define POOL_HEAP      POOL_CLASSES
+#define POOL_ALIGN     16
+
+typedef struct pool_blk_s {
+    union {
+        struct pool_blk_s *next;   /* while free */
+        uint32_t           cls;    /* while allocated */
+    };
+    uint8_t                pad[POOL_ALIGN - sizeof(void *)];
+} pool_blk_t;
+
+typedef struct pool_s {
+    char        *base;
+    size_t       size;
+    size_t       used;
+    pool_blk_t  *freelist[POOL_CLASSES];
+    int          lock;
+} pool_t;
+
+static void
+pool_lock(pool_t *pool)
+{
+    while (__atomic_test_and_set(&pool->lock, __ATOMIC_ACQUIRE));
+}
+
+static void
+pool_unlock(pool_t *pool)
+{
+    __atomic_clear(&pool->lock, __ATOMIC_RELEASE);
+}
+
+static int
+pool_class(size_t size)
+{
+    int cls = 0;
+    while ((cls < POOL_CLASSES) && (((size_t)1 << (cls + POOL_MINSHIFT)) < size)) {
+        cls++;
+    }
+    return cls;
+}
+
+static void *
+pool_alloc(void *ctx, size_t size)
+{
+    pool_t *pool = ctx;
+    int     cls  = pool_class(size);
+    if (cls == POOL_HEAP) {
+        pool_blk_t *blk = malloc(sizeof(pool_blk_t) + size);
+        if (! blk) {
+            return NULL;
+        }
+        blk->cls = POOL_HEAP;
+        return blk + 1;
+    }
+    pool_lock(pool);
+
+    pool_blk_t *blk = pool->freelist[cls];
+    if (blk) {
+        pool->freelist[cls] = blk->next;
+    } else {
+        size_t need = sizeof(pool_blk_t) + ((size_t)1 << (cls + POOL_MINSHIFT));
+        if (pool->used + need <= pool->size) {
+            blk = (pool_blk_t *)&pool->base[pool->used];
+            pool->used += need;
+        }
+    }
+    pool_unlock(pool);
+
+    if (! blk) {
+        return NULL;
+    }
+    blk->cls = cls;
+    return blk + 1;
+}
+
+static void
+pool_free(void *ctx, void *ptr)
+{
+    pool_t *pool = ctx;
+    if (! ptr) {
+        return;
+    }
+    pool_blk_t *blk = (pool_blk_t *)ptr - 1;
+    int         cls = blk->cls;
+    if (cls == POOL_HEAP) {
+        free(blk);
+        return;
+    }
+    pool_lock(pool);
+    blk->next = pool->freelist[cls];
+    pool->freelist[cls] = blk;
+    pool_unlock(pool);
+}
+
+static void *
+pool_realloc(void *ctx, void *ptr, size_t size)
+{
+    if (! ptr) {
+        return pool_alloc(ctx, size);
+    }
+    pool_blk_t *blk  = (pool_blk_t *)ptr - 1;
+    if (blk->cls == POOL_HEAP) {
+        pool_blk_t *nblk = realloc(blk, sizeof(pool_blk_t) + size);
+        return nblk ? nblk + 1 : NULL;
+    }
+    size_t      have = (size_t)1 << (blk->cls + POOL_MINSHIFT);
+    if (size <= have) {
+        return ptr;
+    }
+    void *nptr = pool_alloc(ctx, size);
+    if (nptr) {
+        memcpy(nptr, ptr, have);
+        pool_free(ctx, ptr);
+    }
+    return nptr;
+}
+
+int vtk_pool_allocator(vtk_allocator_t *allocator, void *mem, size_t size)
+{
+    /* pool state lives at the head of the buffer, blocks are aligned after it */
+    size_t head = (sizeof(pool_t) + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+    size_t skew = (POOL_ALIGN - ((uintptr_t)mem & (POOL_ALIGN - 1))) & (POOL_ALIGN - 1);
+    if (size < skew + head + sizeof(pool_blk_t) + ((size_t)1 << POOL_MINSHIFT)) {
+        vtk_loge("Pool buffer is too small: %lu bytes", size);
+        return -1;
+    }
+    pool_t *pool = (pool_t *)((char *)mem + skew);
+    *pool = (pool_t) {
+        .base = (char *)pool + head,
+        .size = size - skew - head
+    };
+    *allocator = (vtk_allocator_t) {
+        .alloc   = pool_alloc,
+        .realloc = pool_realloc,
+        .free    = pool_free,
+        .ctx     = pool
+    };
+    return 0;
+}
@@ -0,0 +1,132 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "vendotek.h"
+
+/*
+ * Buffer pool
+ *
+ * One allocation carved into equal buffers, free ones are kept on a stack of indices.
+ * Buffers are drawn for a frame and returned right after it, so a pool of a few buffers
+ * per busy connection serves any number of idle ones. Gets and puts may come from any
+ * thread, the stack is guarded by a spinlock, as the critical section is a few stores.
+ */
+struct vtk_bufpool_s {
+    char               *mem;
+    size_t              size;
+    size_t              count;
+    size_t             *stack;     /* indices of free buffers */
+    size_t              avail;
+    vtk_bufpool_stat_t  stat;
+    int                 lock;
+};
+
+static void
+bufpool_lock(vtk_bufpool_t *pool)
+{
+    while (__atomic_test_and_set(&pool->lock, __ATOMIC_ACQUIRE));
+}
+
+static void
+bufpool_unlock(vtk_bufpool_t *pool)
+{
+    __atomic_clear(&pool->lock, __ATOMIC_RELEASE);
+}
+
+int vtk_bufpool_init(vtk_bufpool_t **pool, size_t size, size_t count)
+{
+    if (! size || ! count) {
+        vtk_loge("Buffer pool needs nonzero buffer size and count");
+        return -1;
+    }
+    /* buffers are kept aligned for the memcpy / memchr running over them */
+    size = (size + 63) & ~(size_t)63;
+
+    *pool  = vtk_mem_alloc(sizeof(vtk_bufpool_t));
+    if (! *pool) {
+        return -1;
+    }
+    **pool = (vtk_bufpool_t) {
+        .mem   = vtk_mem_alloc(size * count),
+        .size  = size,
+        .count = count,
+        .stack = vtk_mem_alloc(count * sizeof(size_t)),
+        .avail = count,
+        .stat  = {
+            .size      = size,
+            .count     = count,
+            .min_avail = count
+        }
+    };
+    if (! (*pool)->mem || ! (*pool)->stack) {
+        (*pool)->avail = count;
+        vtk_bufpool_free(*pool);
+        *pool = NULL;
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        (*pool)->stack[i] = count - 1 - i;
+    }
+    return 0;
+}
+
+void vtk_bufpool_free(vtk_bufpool_t *pool)
+{
+    if (pool) {
+        if (pool->avail != pool->count) {
+            vtk_logw("Buffer pool is freed with %lu buffers in use", pool->count - pool->avail);
+        }
+        vtk_mem_free(pool->mem);
+        vtk_mem_free(pool->stack);
+        vtk_mem_free(pool);
+    }
+}
+
+void *vtk_bufpool_get(vtk_bufpool_t *pool)
+{
+    char *buf = NULL;
+
+    bufpool_lock(pool);
+    pool->stat.gets++;
+    if (pool->avail) {
+        buf = &pool->mem[pool->stack[--pool->avail] * pool->size];
+        pool->stat.min_avail = pool->avail < pool->stat.min_avail ? pool->avail : pool->stat.min_avail;
+    } else {
+        pool->stat.exhausted++;
+    }
+    bufpool_unlock(pool);
+    return buf;
+}
+
+void vtk_bufpool_put(vtk_bufpool_t *pool, void *buf)
+{
+    if (! vtk_bufpool_owns(pool, buf)) {
+        return;
+    }
+    bufpool_lock(pool);
+    pool->stack[pool->avail++] = ((char *)buf - pool->mem) / pool->size;
+    bufpool_unlock(pool);
+}
+
+int vtk_bufpool_owns(vtk_bufpool_t *pool, void *buf)
+{
+    return ((char *)buf >= pool->mem) && ((char *)buf < pool->mem + pool->size * pool->count);
+}
+
+size_t vtk_bufpool_size(vtk_bufpool_t *pool)
+{
+    return pool->size;
+}
+
+int vtk_bufpool_pressure(vtk_bufpool_t *pool)
+{
+    return __atomic_load_n(&pool->avail, __ATOMIC_RELAXED) < (pool->count + 7) / 8;
+}
+
+void vtk_bufpool_stat(vtk_bufpool_t *pool, vtk_bufpool_stat_t *stat)
+{
+    bufpool_lock(pool);
+    *stat       = pool->stat;
+    stat->avail = pool->avail;
+    bufpool_unlock(pool);
+}
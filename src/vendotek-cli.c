@@ -1,9 +1,14 @@
+#include <arpa/inet.h>
+#include <ctype.h>
 #include <errno.h>
 #include <getopt.h>
 #include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "vendotek.h"
 
@@ -22,63 +27,41 @@ typedef struct stage_resp_s {
     int       optional;
 } stage_resp_t;
 
+/*
+ * connection dropped in the middle of a stage is restored and the stage is repeated;
+ * a stage with an operation number is repeated only after IDL on the new connection shows
+ * where POS is: FIN with the operation number POS reports as the last one is a repeat,
+ * VRP is resent only with --resume-vrp as POS may have approved it already
+ */
+#define RESUME_BACKOFF_MS   100
+#define RESUME_BACKOFF_MAX  2000
+
+typedef struct resume_opts_s {
+    char        *host;
+    char        *port;
+    int          attempts;  /* reconnects per stage, 0 disables resume */
+    int          vrp;       /* VRP may be resent after the IDL check */
+    int          timeout;   /* connect timeout, ms */
+    int          resumes;   /* stages resumed during the current payment */
+} resume_opts_t;
+
 typedef struct stage_opts_s {
-    vtk_t     *vtk;
-    vtk_msg_t *mreq;
-    vtk_msg_t *mresp;
-    int        timeout;  /* poll timeout, ms */
-    int        verbose;
-    int        allow_eof;
+    vtk_t       *vtk;
+    vtk_relay_t *relay;
+    vtk_msg_t   *mreq;
+    vtk_msg_t   *mresp;
+    int          timeout;  /* poll timeout, ms */
+    int          verbose;
+    int          allow_eof;
+    int          cancellable;  /* wait may be interrupted by vtk_net_cancel() */
+    int          cancelled;
+    int          dropped;      /* stage failed as connection is lost */
+    vtk_class_t  cls;          /* request is queued in this class unless it's a payment one */
+    resume_opts_t *resume;
 } stage_opts_t;
 
-int do_stage(stage_opts_t *opts, stage_req_t *req, stage_resp_t *resp)
+int do_stage_validate(stage_opts_t *opts, stage_resp_t *resp, int fleof)
 {
-    /*
-     * fill & send request message
-     */
-    char  valbuf[0xff];
-    char *value;
-    vtk_msg_mod(opts->mreq, VTK_MSG_RESET, VTK_BASE_VMC, 0, NULL);
-
-    for (int i = 0; req[i].id; i++) {
-        if (req[i].valint) {
-            snprintf(valbuf, sizeof(valbuf), "%lld", *req[i].valint);
-            value = valbuf;
-        } else if (req[i].valstr) {
-            value = req[i].valstr;
-        } else {
-            continue;
-        }
-        vtk_msg_mod(opts->mreq, VTK_MSG_ADDSTR, req[i].id, 0, value);
-    }
-    if (opts->verbose) {
-        vtk_msg_print(opts->mreq);
-    }
-    if (vtk_net_send(opts->vtk, opts->mreq) < 0) {
-        return -1;
-    }
-
-    /*
-     * wait & validate response
-     */
-    struct pollfd pollfd = {
-        .fd     = vtk_net_get_socket(opts->vtk),
-        .events = POLLIN
-    };
-    int rpoll = poll(&pollfd, 1, opts->timeout);
-
-    if (rpoll < 0) {
-        vtk_loge("POS connection error: %s", strerror(errno));
-        return -1;
-    } else if (rpoll == 0) {
-        vtk_loge("POS connection timeout");
-        return -1;
-    }
-    int fleof = 0;
-    if (vtk_net_recv(opts->vtk, opts->mresp, &fleof) < 0) {
-        vtk_loge("Expected event can't be received/validated");
-        return -1;
-    }
     if (opts->verbose) {
         vtk_msg_print(opts->mresp);
     }
@@ -121,14 +104,296 @@ int do_stage(stage_opts_t *opts, stage_req_t *req, stage_resp_t *resp)
     return 0;
 }
 
+int do_stage_run(stage_opts_t *opts, stage_req_t *req, stage_resp_t *resp)
+{
+    /*
+     * fill & send request message
+     */
+    char  valbuf[0xff];
+    char *value;
+    vtk_msg_mod(opts->mreq, VTK_MSG_RESET, VTK_BASE_VMC, 0, NULL);
+    opts->dropped = 0;
+
+    for (int i = 0; req[i].id; i++) {
+        if (req[i].valint) {
+            snprintf(valbuf, sizeof(valbuf), "%lld", *req[i].valint);
+            value = valbuf;
+        } else if (req[i].valstr) {
+            value = req[i].valstr;
+        } else {
+            continue;
+        }
+        if (vtk_msg_mod(opts->mreq, VTK_MSG_ADDSTR, req[i].id, 0, value) < 0) {
+            return -1;
+        }
+    }
+    if (opts->verbose) {
+        vtk_msg_print(opts->mreq);
+    }
+    int rsend = opts->cls == VTK_CLASS_PAYMENT ? vtk_net_send(opts->vtk, opts->mreq) :
+                                                 vtk_net_queue(opts->vtk, opts->mreq, opts->cls);
+    if (rsend < 0) {
+        opts->dropped = 1;
+        return -1;
+    }
+
+    /*
+     * wait & validate response; POS may tunnel its host traffic (CON / DAT / DSC) meanwhile
+     */
+    struct pollfd pollfds[2 + VTK_RELAY_MAXCONN];
+    uint64_t      deadline = vtk_clock_ns() + opts->timeout * 1000000ull;
+    uint64_t      twait = vtk_trace_now();
+    int           fleof = 0;
+
+    for (;;) {
+        if (! vtk_net_pending(opts->vtk)) {
+            uint64_t now = vtk_clock_ns();
+            if (now >= deadline) {
+                vtk_loge("POS connection timeout");
+                return -1;
+            }
+            int tm      = (deadline - now) / 1000000 + 1;
+            int relaytm = vtk_relay_timeout(opts->relay);
+            tm = ((relaytm >= 0) && (relaytm < tm)) ? relaytm : tm;
+
+            /* queued background frames (relay) are written as the socket takes them */
+            pollfds[0] = (struct pollfd) {
+                .fd     = vtk_net_get_socket(opts->vtk),
+                .events = POLLIN | (vtk_net_queued(opts->vtk, VTK_CLASS_MAX) ? POLLOUT : 0)
+            };
+            int npoll = 1 + vtk_relay_pollfds(opts->relay, &pollfds[1], VTK_RELAY_MAXCONN);
+            pollfds[npoll] = (struct pollfd) {
+                .fd     = opts->cancellable ? vtk_net_get_cancel_fd(opts->vtk) : -1,
+                .events = POLLIN
+            };
+            int rpoll = vtk_poll(pollfds, npoll + 1, tm);
+
+            if ((rpoll < 0) && (errno == EINTR)) {
+                continue;
+            }
+            if (rpoll < 0) {
+                vtk_loge("POS connection error: %s", strerror(errno));
+                return -1;
+            }
+            if (opts->relay && (vtk_relay_process(opts->relay, &pollfds[1], npoll - 1) < 0)) {
+                return -1;
+            }
+            /* response which is already here wins over cancellation */
+            if (! (pollfds[0].revents & ~POLLOUT) && pollfds[npoll].revents) {
+                uint64_t stale;
+                if (! vtk_net_cancelled(opts->vtk) && (read(pollfds[npoll].fd, &stale, sizeof(stale)) < 0)) {
+                    vtk_logw("Can't drain cancellation: %s", strerror(errno));
+                }
+                if (vtk_net_cancelled(opts->vtk)) {
+                    vtk_logn("Operation is cancelled");
+                    opts->cancelled = 1;
+                    return -1;
+                }
+            }
+            if ((pollfds[0].revents & POLLOUT) && (vtk_net_flush(opts->vtk) < 0)) {
+                opts->dropped = 1;
+                return -1;
+            }
+            if (! (pollfds[0].revents & ~POLLOUT)) {
+                continue;
+            }
+            vtk_trace_span("wait", req[0].valstr, twait);
+        }
+        int rrecv = vtk_net_recv(opts->vtk, opts->mresp, &fleof);
+        twait = vtk_trace_now();
+        if (rrecv < 0) {
+            vtk_loge("Expected event can't be received/validated");
+            return -1;
+        }
+        if (rrecv == 0) {
+            if (fleof) {
+                vtk_loge("Connection with POS was closed unexpectedly");
+                opts->dropped = 1;
+                return -1;
+            }
+            continue;
+        }
+        if (opts->relay && vtk_relay_match(opts->mresp)) {
+            if (vtk_relay_handle(opts->relay, opts->mresp) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        break;
+    }
+    uint64_t tvalid = vtk_trace_now();
+    int      rvalid = do_stage_validate(opts, resp, fleof);
+    vtk_trace_span("validate", req[0].valstr, tvalid);
+    return rvalid;
+}
+
+int do_stage_once(stage_opts_t *opts, stage_req_t *req, stage_resp_t *resp)
+{
+    uint64_t tstart = vtk_clock_ns();
+    uint64_t tspan  = vtk_trace_now();
+    VTK_PROBE(stage_start, req[0].valstr);
+
+    int rc = do_stage_run(opts, req, resp);
+    if (rc < 0) {
+        vtk_status_error(vtk_net_get_status(opts->vtk), vtk_log_last_error());
+    }
+    vtk_trace_span("stage", req[0].valstr, tspan);
+
+    vtk_exchange_t xchg;
+    if ((rc >= 0) && (vtk_net_get_exchange(opts->vtk, &xchg) >= 0)) {
+        vtk_logi("%s stage: POS think time %.3f ms, local time %.3f ms", req[0].valstr, xchg.think / 1e6, xchg.local / 1e6);
+    }
+
+    vtk_metrics_observe(vtk_metrics_stage(req[0].valstr), vtk_clock_ns() - tstart, rc < 0);
+    VTK_PROBE(stage_done, req[0].valstr, rc, vtk_clock_ns() - tstart);
+    return rc;
+}
+
+int do_reconnect(stage_opts_t *opts, int attempt)
+{
+    resume_opts_t *resume = opts->resume;
+
+    /* the first reconnect is immediate, then exponential backoff with jitter */
+    if (attempt) {
+        int backoff = RESUME_BACKOFF_MS << (attempt - 1);
+        backoff  = backoff < RESUME_BACKOFF_MAX ? backoff : RESUME_BACKOFF_MAX;
+        backoff += rand() % (backoff / 2 + 1);
+        vtk_poll(NULL, 0, backoff);
+    }
+    vtk_logn("Connection with POS is lost, reconnect, attempt %d of %d", attempt + 1, resume->attempts);
+
+    if (! VTK_NET_IS_DOWN(vtk_net_get_state(opts->vtk))) {
+        vtk_net_set(opts->vtk, VTK_NET_DOWN, 0, NULL, NULL);
+    }
+    return vtk_net_set(opts->vtk, VTK_NET_CONNECTED, resume->timeout, resume->host, resume->port);
+}
+
+/*
+ * IDL on the new connection tells if the dropped stage may be repeated
+ */
+int do_resume_check(stage_opts_t *opts, stage_req_t *req)
+{
+    ssize_t *opnum = NULL;
+    for (stage_req_t *sreq = req; sreq->id; sreq++) {
+        if (sreq->id == 0x3) {
+            opnum = sreq->valint;
+        }
+    }
+    if (! opnum) {
+        return 0;
+    }
+    int is_vrp = ! strcmp(req[0].valstr, "VRP");
+    int is_fin = ! strcmp(req[0].valstr, "FIN");
+    if (! is_fin && ! (is_vrp && opts->resume->vrp)) {
+        vtk_loge("%s stage with operation %zd isn't repeated after connection drop", req[0].valstr, *opnum);
+        opts->dropped = 0;
+        return -1;
+    }
+    ssize_t      posop      = -1;
+    stage_req_t  idl_req[]  = {
+        {.id = 0x1, .valstr = "IDL" },
+        { 0 }
+    };
+    stage_resp_t idl_resp[] = {
+        {.id = 0x1, .expstr = "IDL"  },
+        {.id = 0x3, .valint = &posop },
+        { 0 }
+    };
+    if (do_stage_once(opts, idl_req, idl_resp) < 0) {
+        return -1;
+    }
+    /* VRP that never reached POS is sent anew, the last one is repeated */
+    if ((posop == *opnum) || (is_vrp && (posop == *opnum - 1))) {
+        return 0;
+    }
+    vtk_loge("POS reports operation %zd as the last one, %s with operation %zd isn't repeated",
+             posop, req[0].valstr, *opnum);
+    return -1;
+}
+
+int do_stage(stage_opts_t *opts, stage_req_t *req, stage_resp_t *resp)
+{
+    int      rc    = do_stage_once(opts, req, resp);
+    uint64_t tdrop = vtk_clock_ns();
+
+    if ((rc >= 0) || ! opts->dropped || ! opts->resume) {
+        return rc;
+    }
+    for (int attempt = 0; (rc < 0) && opts->dropped && (attempt < opts->resume->attempts); attempt++) {
+        if (do_reconnect(opts, attempt) < 0) {
+            continue;
+        }
+        if (do_resume_check(opts, req) < 0) {
+            /* a drop during the IDL check is retried, otherwise the stage is given up */
+            if (! opts->dropped) {
+                break;
+            }
+            continue;
+        }
+        rc = do_stage_once(opts, req, resp);
+    }
+    vtk_metrics_observe(VTK_METRIC_RESUME, vtk_clock_ns() - tdrop, rc < 0);
+    if (rc >= 0) {
+        opts->resume->resumes++;
+        vtk_logn("%s stage is resumed in %.3f ms", req[0].valstr, (vtk_clock_ns() - tdrop) / 1e6);
+    } else if (opts->resume->attempts) {
+        vtk_loge("%s stage can't be resumed", req[0].valstr);
+    }
+    return rc;
+}
+
+/*
+ * banking receipt goes to the printer pipe or file while it is being received
+ */
+void receipt_write(void *ctx, uint16_t id, const char *chunk, uint16_t len, uint16_t offset, uint16_t total)
+{
+    FILE *fout = (FILE *)ctx;
+
+    fwrite(chunk, 1, len, fout);
+    if (offset + len == total) {
+        fputc('\n', fout);
+        fflush(fout);
+    }
+}
+
+/*
+ * progress of a batch, carried over to the new process by hot restart
+ */
+typedef struct batch_state_s {
+    size_t       njob;
+    size_t       nok;
+    size_t       nfail;
+    uint64_t     tstart;
+    ssize_t      opnum;
+} batch_state_t;
+
 typedef struct payment_opts_s {
-    vtk_t     *vtk;
-    vtk_msg_t *mreq;
-    vtk_msg_t *mresp;
-    int        ping;
-    int        timeout;
-    int        verbose;
+    vtk_t       *vtk;
+    vtk_relay_t *relay;
+    vtk_msg_t   *mreq;
+    vtk_msg_t   *mresp;
+    int          ping;
+    int          timeout;
+    int          verbose;
+    int          relay_conns;
+    char        *batch;
+    char        *fleet;
+    int          parallel;
+    int          interval;   /* seconds between fleet rounds / batch telemetry polls */
+    vtk_telemetry_t *telemetry;
+    char        *telemetry_path;
+    uint64_t     tpolled;    /* last telemetry poll of the batch terminal */
+    vtk_status_t *board;     /* status board of the payment clients, read by the fleet */
+    vtk_journal_t *journal;
+    resume_opts_t resume;
+    uint64_t     allocs;     /* heap allocations made by the last payment */
+    int          cancelled;  /* the last payment was cancelled */
+    int          handoff;    /* listener for hot restart requests, -1 if none */
+    int          handed;     /* the batch is handed off to the new process */
+    int          batch_fd;   /* batch input taken over from the previous process, -1 if none */
+    batch_state_t taken;     /* ... and its progress */
 
+    ssize_t    opnum;      /* carried forward between payments of the same connection */
     ssize_t    evnum;
     char      *evname;
     ssize_t    prodid;
@@ -136,6 +401,24 @@ typedef struct payment_opts_s {
     ssize_t    price;
 } payment_opts_t;
 
+/*
+ * journal records payment state transitions, so a payment interrupted by crash can be reconciled
+ */
+int journal_note(payment_opts_t *opts, uint64_t txid, vtk_jstate_t state, ssize_t opnum, ssize_t price)
+{
+    if (! opts->journal) {
+        return 0;
+    }
+    vtk_jrec_t rec = {
+        .txid   = txid,
+        .opnum  = opnum,
+        .price  = price,
+        .prodid = opts->prodid,
+        .state  = state
+    };
+    return vtk_journal_append(opts->journal, &rec);
+}
+
 int do_payment(payment_opts_t *opts)
 {
     /*
@@ -150,26 +433,44 @@ int do_payment(payment_opts_t *opts)
         ssize_t  price;
         ssize_t  price_confirmed;
         ssize_t  timeout;
+        ssize_t  amount;     /* finalized amount, zero for vending failure */
     } payment = {
+        .opnum     = opts->opnum,
         .evnum     = opts->evnum,
         .evname    = opts->evname,
         .prodid    = opts->prodid,
         .prodname  = opts->prodname,
         .price     = opts->price,
-        .timeout   = opts->timeout
+        .timeout   = opts->timeout,
+        .amount    = opts->price
     };
     int rc_idl = 0, rc_vrp = 0, rc_fin = 0;
+    uint64_t txid = opts->journal ? vtk_journal_txid(opts->journal) : 0;
+
+    /* every payment is a trace of its own: stages, sends, waits for POS, receives */
+    uint64_t trace = vtk_trace_begin();
+    uint64_t tspan = vtk_trace_now();
+    if (trace) {
+        vtk_logi("Payment trace id: %llu", trace);
+    }
+
+    vtk_alloc_stat_t astart, aend;
+    vtk_alloc_stat(&astart);
 
     /*
      * 1 stage, IDL 1
      */
     stage_opts_t stopts = {
-        .vtk     = opts->vtk,
-        .timeout = opts->timeout * 1000,
-        .verbose = opts->verbose,
-        .mreq    = opts->mreq,
-        .mresp   = opts->mresp
+        .vtk         = opts->vtk,
+        .relay       = opts->relay,
+        .timeout     = opts->timeout * 1000,
+        .verbose     = opts->verbose,
+        .mreq        = opts->mreq,
+        .mresp       = opts->mresp,
+        .resume      = &opts->resume
     };
+    int vrp_cancelled = 0;
+    opts->resume.resumes = 0;
     if (1) {
         vtk_logi("IDL Init stage");
 
@@ -215,7 +516,53 @@ int do_payment(payment_opts_t *opts)
             {.id = 0x4, .expint = &payment.price    },
             { 0 }
         };
-        rc_vrp = do_stage(&stopts, vrp_req, vrp_resp) >= 0;
+        /*
+         * VRP is sent only when its intent is on disk; failed VRP is left open in the journal,
+         * as POS might approve it without us knowing (e.g. on timeout)
+         */
+        /* customer may cancel while POS waits for the card; that's the only cancellable stage */
+        if (vtk_net_cancelled(opts->vtk)) {
+            vtk_logn("Operation is cancelled");
+            stopts.cancelled = 1;
+        } else if (journal_note(opts, txid, VTK_JOURNAL_VRP, payment.opnum, payment.price) >= 0) {
+            stopts.cancellable = 1;
+            rc_vrp             = do_stage(&stopts, vrp_req, vrp_resp) >= 0;
+            vrp_cancelled      = ! rc_vrp && stopts.cancelled;
+            stopts.cancellable = 0;
+        }
+        if (rc_vrp) {
+            journal_note(opts, txid, VTK_JOURNAL_APPROVED, payment.opnum, payment.price);
+        }
+    }
+
+    /*
+     * 2a stage, ABR: payment is cancelled while POS processes VRP; POS still answers it,
+     * and vend approved meanwhile is finalized as failure
+     */
+    if (vrp_cancelled) {
+        vtk_logi("ABR stage");
+
+        ssize_t approved = 0;
+        stage_req_t abr_req[] = {
+            {.id = 0x1, .valstr = "ABR"             },
+            {.id = 0x3, .valint = &payment.opnum    },
+            { 0 }
+        };
+        stage_resp_t abr_resp[] = {
+            {.id = 0x1, .valstr = ""                },
+            {.id = 0x4, .valint = &approved, .optional = 1 },
+            { 0 }
+        };
+        if (do_stage(&stopts, abr_req, abr_resp) >= 0) {
+            if ((vtk_msg_name(stopts.mresp) == VTK_MSGNAME_VRP) && approved) {
+                vtk_logn("Vend was approved before abort, finalize it as failure");
+                journal_note(opts, txid, VTK_JOURNAL_APPROVED, payment.opnum, payment.price);
+                payment.amount = 0;
+                rc_vrp = 1;
+            } else {
+                journal_note(opts, txid, VTK_JOURNAL_FAILED, payment.opnum, payment.price);
+            }
+        }
     }
 
     /*
@@ -230,16 +577,22 @@ int do_payment(payment_opts_t *opts)
             {.id = 0x1, .valstr = "FIN"             },
             {.id = 0x3, .valint = &payment.opnum    },
             {.id = 0x9, .valint =  payment.prodname ? &payment.prodid : NULL },
-            {.id = 0x4, .valint = &payment.price    },
+            {.id = 0x4, .valint = &payment.amount   },
             { 0 }
         };
         stage_resp_t fin_resp[] = {
             {.id = 0x1, .expstr = "FIN" },
             {.id = 0x3, .expint = &payment.opnum },
-            {.id = 0x4, .expint = &payment.price },
+            {.id = 0x4, .expint = &payment.amount },
             { 0 }
         };
-        rc_fin = do_stage(&stopts, fin_req, fin_resp) >= 0;
+        /* unconfirmed FIN is left open in the journal and repeated on reconciliation */
+        if (journal_note(opts, txid, VTK_JOURNAL_FIN, payment.opnum, payment.amount) >= 0) {
+            rc_fin = do_stage(&stopts, fin_req, fin_resp) >= 0;
+        }
+        if (rc_fin) {
+            journal_note(opts, txid, VTK_JOURNAL_DONE, payment.opnum, payment.amount);
+        }
     }
 
     /*
@@ -255,15 +608,164 @@ int do_payment(payment_opts_t *opts)
         {.id = 0x1, .expstr = "IDL"             },
         { 0 }
     };
-    do_stage(&stopts, idl2_req, idl2_resp);
+    int rc_idl2 = do_stage(&stopts, idl2_req, idl2_resp);
+
+    /* the payment is over, so late cancellation is dropped */
+    uint64_t tcancel = vtk_net_cancel_reset(opts->vtk);
+    opts->cancelled  = stopts.cancelled;
+    if (stopts.cancelled) {
+        uint64_t latency = vtk_clock_ns() - tcancel;
+        vtk_metrics_observe(VTK_METRIC_CANCEL, latency, rc_idl2 < 0);
+        vtk_logn("Payment cancelled, cancel to IDL: %.3f ms", latency / 1e6);
+    }
+    if (opts->resume.resumes) {
+        vtk_logn("Payment %s after %d resumed stages", (rc_idl && rc_vrp && rc_fin) ? "completed" : "failed",
+                 opts->resume.resumes);
+    }
+    opts->opnum = payment.opnum;
 
-    return ! (rc_idl && rc_vrp && rc_fin) ? -1 : 0;
+    vtk_alloc_stat(&aend);
+    opts->allocs = (aend.allocs + aend.reallocs) - (astart.allocs + astart.reallocs);
+    vtk_logi("Payment heap allocations: %llu", opts->allocs);
+
+    vtk_trace_span("payment", NULL, tspan);
+    vtk_trace_end();
+
+    return ! (rc_idl && rc_vrp && rc_fin && ! stopts.cancelled) ? -1 : 0;
+}
+
+/*
+ * Reconciliation of payments interrupted by crash. IDL comes first: the operation number
+ * POS reports tells whether the journaled one has reached it. POS treats VRP / FIN with
+ * the current operation number as repeats and returns previous result:
+ *   VRP      - never reached POS: failed; otherwise VRP is repeated to learn the result,
+ *              approved vend is finalized as failed
+ *   APPROVED - vend result is unknown, finalized as failed (zero amount)
+ *   FIN      - FIN is repeated with the journaled amount
+ * POS which has moved on to a later operation can't tell the result, the transaction is
+ * unresolved. So is one which failed RECONCILE_ATTEMPTS times; payments go on either way.
+ */
+#define RECONCILE_ATTEMPTS  3
+
+int do_reconcile_one(payment_opts_t *opts, stage_opts_t *stopts, vtk_jrec_t *rec)
+{
+    ssize_t opnum    = rec->opnum;
+    ssize_t amount   = rec->state == VTK_JOURNAL_FIN ? rec->price : 0;
+    ssize_t price    = rec->price;
+    ssize_t approved = 0;
+    ssize_t posop    = -1;
+    ssize_t timeout  = opts->timeout;
+
+    stage_req_t idl_req[] = {
+        {.id = 0x1, .valstr = "IDL"       },
+        { 0 }
+    };
+    stage_resp_t idl_resp[] = {
+        {.id = 0x1, .expstr = "IDL"       },
+        {.id = 0x3, .valint = &posop      },
+        {.id = 0x6, .valint = &timeout, .optional = 1 },
+        { 0 }
+    };
+    stopts->timeout = opts->timeout * 1000;
+    if (do_stage(stopts, idl_req, idl_resp) < 0) {
+        return -1;
+    }
+    if ((rec->state == VTK_JOURNAL_VRP) && (posop < opnum)) {
+        vtk_logn("VRP of opnum %zd hasn't reached POS (POS opnum: %zd), payment failed", opnum, posop);
+        rec->state = VTK_JOURNAL_FAILED;
+        return 0;
+    }
+    if (posop != opnum) {
+        vtk_loge("POS has moved on to opnum %zd, result of opnum %zd is unknown", posop, opnum);
+        rec->state = VTK_JOURNAL_UNRESOLVED;
+        return 0;
+    }
+    stopts->timeout = timeout * 1000;
+
+    if (rec->state == VTK_JOURNAL_VRP) {
+        stage_req_t vrp_req[] = {
+            {.id = 0x1, .valstr = "VRP"   },
+            {.id = 0x3, .valint = &opnum  },
+            {.id = 0x4, .valint = &price  },
+            { 0 }
+        };
+        stage_resp_t vrp_resp[] = {
+            {.id = 0x1, .expstr = "VRP"   },
+            {.id = 0x3, .expint = &opnum  },
+            {.id = 0x4, .valint = &approved, .optional = 1 },
+            { 0 }
+        };
+        if (do_stage(stopts, vrp_req, vrp_resp) < 0) {
+            return -1;
+        }
+    }
+    if ((rec->state != VTK_JOURNAL_VRP) || approved) {
+        stage_req_t fin_req[] = {
+            {.id = 0x1, .valstr = "FIN"   },
+            {.id = 0x3, .valint = &opnum  },
+            {.id = 0x4, .valint = &amount },
+            { 0 }
+        };
+        stage_resp_t fin_resp[] = {
+            {.id = 0x1, .expstr = "FIN"   },
+            {.id = 0x3, .expint = &opnum  },
+            { 0 }
+        };
+        if (do_stage(stopts, fin_req, fin_resp) < 0) {
+            return -1;
+        }
+    }
+    stopts->timeout = opts->timeout * 1000;
+    do_stage(stopts, idl_req, idl_resp);
+
+    rec->state = (rec->state == VTK_JOURNAL_VRP) && ! approved ? VTK_JOURNAL_FAILED : VTK_JOURNAL_DONE;
+    rec->price = rec->state == VTK_JOURNAL_DONE ? amount : rec->price;
+    return 0;
+}
+
+int do_reconcile(payment_opts_t *opts)
+{
+    vtk_jrec_t *recs;
+    size_t      nrecs;
+    int         unresolved = 0;
+    vtk_journal_pending(opts->journal, &recs, &nrecs);
+
+    stage_opts_t stopts = {
+        .vtk     = opts->vtk,
+        .relay   = opts->relay,
+        .verbose = opts->verbose,
+        .mreq    = opts->mreq,
+        .mresp   = opts->mresp,
+        .resume  = &opts->resume
+    };
+    for (size_t i = 0; i < nrecs; i++) {
+        vtk_jrec_t rec = recs[i];
+        rec.time = 0;
+
+        vtk_logn("Reconcile transaction %lu, opnum: %lld, state: %s, attempt %u of %d",
+                 rec.txid, rec.opnum, vtk_journal_stringify(rec.state), rec.attempts + 1, RECONCILE_ATTEMPTS);
+
+        if ((do_reconcile_one(opts, &stopts, &rec) < 0) && (++rec.attempts >= RECONCILE_ATTEMPTS)) {
+            vtk_loge("Transaction %lu can't be reconciled after %u attempts", rec.txid, rec.attempts);
+            rec.state = VTK_JOURNAL_UNRESOLVED;
+        }
+        if (rec.state == VTK_JOURNAL_UNRESOLVED) {
+            vtk_loge("UNRESOLVED transaction %lu, opnum: %lld, price: %lld, prodid: %lld: check it with the bank",
+                     rec.txid, rec.opnum, rec.price, rec.prodid);
+            unresolved++;
+        }
+        if (vtk_journal_append(opts->journal, &rec) < 0) {
+            return -1;
+        }
+    }
+    return unresolved;
 }
 
 int do_ping(payment_opts_t *opts)
 {
     stage_opts_t stopts = {
         .vtk     = opts->vtk,
+        .relay   = opts->relay,
         .timeout = opts->timeout * 1000,
         .verbose = opts->verbose,
         .mreq    = opts->mreq,
@@ -283,6 +785,654 @@ int do_ping(payment_opts_t *opts)
     return 0;
 }
 
+/*
+ * Batch mode: one payment job per line, as whitespace separated key=value pairs, e.g.
+ *   price=25000 prodid=7 prodname="CAR WASH" evnum=3 evname=CSAPP
+ */
+int parse_job(char *line, payment_opts_t *job)
+{
+    for (char *cursor = line; *cursor; ) {
+        while (isspace(*cursor)) {
+            cursor++;
+        }
+        if (! *cursor || (*cursor == '#')) {
+            break;
+        }
+        char *key = cursor, *value = strchr(cursor, '=');
+        if (! value) {
+            return -1;
+        }
+        *value++ = 0;
+        if (*value == '"') {
+            char *quote = strchr(++value, '"');
+            if (! quote) {
+                return -1;
+            }
+            *quote = 0;
+            cursor = quote + 1;
+        } else {
+            for (cursor = value; *cursor && ! isspace(*cursor); cursor++);
+            if (*cursor) {
+                *cursor++ = 0;
+            }
+        }
+        if (strcasecmp(key, "price") == 0) {
+            job->price = atol(value);
+        } else if (strcasecmp(key, "prodid") == 0) {
+            job->prodid = atol(value);
+        } else if (strcasecmp(key, "prodname") == 0) {
+            job->prodname = value;
+        } else if (strcasecmp(key, "evnum") == 0) {
+            job->evnum = atol(value);
+        } else if (strcasecmp(key, "evname") == 0) {
+            job->evname = value;
+        } else {
+            return -1;
+        }
+    }
+    return job->price > 0 ? 0 : -1;
+}
+
+/*
+ * POS local time, YYYYMMDDThhmmss with optional +hhmm / -hhmm / Z; without a zone it is taken
+ * to be in the zone of this host. Drift is against our clock halfway through the round trip.
+ */
+int64_t fleet_drift(const char *value, uint16_t len, uint64_t rtt)
+{
+    char      buf[32];
+    struct tm tm = { .tm_isdst = -1 };
+    int       zh, zm, skip = 0;
+    char      sign = 0;
+
+    snprintf(buf, sizeof(buf), "%.*s", len, value);
+    if (sscanf(buf, "%4d%2d%2dT%2d%2d%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &skip) != 6) {
+        return VTK_DRIFT_UNKNOWN;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon  -= 1;
+    time_t pos = (sscanf(buf + skip, "%c%2d%2d", &sign, &zh, &zm) == 3) && ((sign == '+') || (sign == '-')) ?
+                 timegm(&tm) - (sign == '+' ? 1 : -1) * (zh * 3600 + zm * 60) :
+                 buf[skip] == 'Z' ? timegm(&tm) : mktime(&tm);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int64_t ours = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 - rtt / 2000000;
+    return (int64_t)pos * 1000 - ours;
+}
+
+/* IDL reply of the terminal, or the error of the poll, goes to its telemetry record */
+void telemetry_note(vtk_telemetry_t *table, const char *terminal, vtk_msg_t *msg, const char *error, uint64_t rtt)
+{
+    vtk_trec_t rec = {0};
+    snprintf(rec.terminal, sizeof(rec.terminal), "%s", terminal);
+    if (vtk_telemetry_lookup(table, rec.terminal, &rec) < 0) {
+        rec.drift_ms = VTK_DRIFT_UNKNOWN;
+    }
+    rec.polls++;
+    if (error) {
+        rec.failures++;
+        vtk_telemetry_update(table, &rec);
+        return;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec.time_seen = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    rec.rtt_us    = rtt / 1000;
+    rec.drift_ms  = VTK_DRIFT_UNKNOWN;
+    memset(rec.mgmt, 0, sizeof(rec.mgmt));
+    memset(rec.localtime, 0, sizeof(rec.localtime));
+    memset(rec.sysinfo, 0, sizeof(rec.sysinfo));
+
+    uint16_t id, len;
+    char    *value;
+    for (int i = 0; vtk_msg_iter_param(msg, i, &id, &len, &value) >= 0; i++) {
+        if (id == 0x10) {
+            snprintf(rec.mgmt, sizeof(rec.mgmt), "%.*s", len, value);
+        } else if (id == 0x11) {
+            snprintf(rec.localtime, sizeof(rec.localtime), "%.*s", len, value);
+            rec.drift_ms = fleet_drift(value, len, rtt);
+        } else if (id == 0x12) {
+            snprintf(rec.sysinfo, sizeof(rec.sysinfo), "%.*s", len, value);
+        }
+    }
+    vtk_telemetry_update(table, &rec);
+}
+
+/*
+ * In-session telemetry: POS serves a single VMC connection, so the terminal of a --batch client
+ * is polled over its session, between jobs, with IDL queued in the telemetry class; the fleet
+ * leaves terminals with a session alone
+ */
+#define TELEMETRY_INTERVAL  300  /* s, by default */
+
+int do_telemetry(payment_opts_t *opts)
+{
+    stage_opts_t stopts = {
+        .vtk     = opts->vtk,
+        .relay   = opts->relay,
+        .timeout = opts->timeout * 1000,
+        .verbose = opts->verbose,
+        .mreq    = opts->mreq,
+        .mresp   = opts->mresp,
+        .cls     = VTK_CLASS_TELEMETRY,
+        .resume  = &opts->resume
+    };
+    stage_req_t idl_req[] = {
+        {.id = 0x1, .valstr = "IDL"             },
+        { 0 }
+    };
+    stage_resp_t idl_resp[] = {
+        {.id = 0x1, .expstr = "IDL"             },
+        { 0 }
+    };
+    char terminal[64];
+    snprintf(terminal, sizeof(terminal), opts->resume.port ? "%s:%s" : "%s", opts->resume.host, opts->resume.port);
+
+    opts->tpolled = vtk_clock_ns();
+    int rc = do_stage(&stopts, idl_req, idl_resp);
+    telemetry_note(opts->telemetry, terminal, opts->mresp, rc < 0 ? vtk_log_last_error() : NULL,
+                   vtk_clock_ns() - opts->tpolled);
+    vtk_telemetry_flush(opts->telemetry);
+    return rc;
+}
+
+/* batch results are the only stdout output; all the logs go to stderr */
+void batch_logline(int flags, const char *logline)
+{
+    fprintf(stderr, (flags & VTK_LOG_NOEOL) ? "%s" : "%s\n", logline);
+}
+
+/*
+ * Hot restart: between jobs the batch waits for input and for the new process at once. Input is
+ * unbuffered then, so the jobs not read yet stay in the descriptor, which is handed off along with
+ * the POS session and stdout. Returns 1 when the batch is handed off, 0 when input is ready.
+ * With --telemetry the terminal is polled while the batch waits.
+ */
+int batch_wait(payment_opts_t *opts, FILE *fin, batch_state_t *batch)
+{
+    for (;;) {
+        struct pollfd pollfds[2] = {
+            { .fd = fileno(fin),   .events = POLLIN },
+            { .fd = opts->handoff, .events = POLLIN }
+        };
+        int tm = -1;
+        if (opts->telemetry) {
+            uint64_t next = opts->tpolled + opts->interval * 1000000000ull;
+            uint64_t now  = vtk_clock_ns();
+            if (now >= next) {
+                do_telemetry(opts);
+                continue;
+            }
+            tm = (next - now) / 1000000 + 1;
+        }
+        if (vtk_poll(pollfds, 2, tm) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            vtk_loge("Batch input error: %s", strerror(errno));
+            return 0;
+        }
+        if (pollfds[0].revents) {
+            return 0;
+        }
+        if (! pollfds[1].revents) {
+            continue;
+        }
+        int usock = vtk_handoff_accept(opts->handoff);
+        if (usock < 0) {
+            continue;
+        }
+        /* host connections relayed for POS can't follow the session */
+        struct pollfd relayfds[VTK_RELAY_MAXCONN];
+        if (vtk_relay_pollfds(opts->relay, relayfds, VTK_RELAY_MAXCONN)) {
+            vtk_logw("POS host traffic is relayed, handoff is refused");
+            close(usock);
+            continue;
+        }
+        int fds[] = { fileno(fin), STDOUT_FILENO };
+        batch->opnum = opts->opnum;
+        /* the table goes to the new process too: it's written out before the new one may open it */
+        vtk_telemetry_close(opts->telemetry);
+        opts->telemetry = NULL;
+        int rc = vtk_handoff_send(usock, opts->vtk, fds, 2, batch, sizeof(*batch));
+        close(usock);
+        if (rc >= 0) {
+            vtk_logn("Batch is handed off after job %zu", batch->njob);
+            opts->handed = 1;
+            return 1;
+        }
+        if (opts->telemetry_path && (vtk_telemetry_open(&opts->telemetry, opts->telemetry_path) < 0)) {
+            vtk_logw("Telemetry polls stop as the table can't be reopened");
+        }
+    }
+}
+
+int do_batch(payment_opts_t *opts)
+{
+    FILE *fin = opts->batch_fd >= 0 ? fdopen(opts->batch_fd, "r") :
+                strcmp(opts->batch, "-") ? fopen(opts->batch, "r") : stdin;
+    if (! fin) {
+        vtk_loge("Can't open batch file %s: %s", opts->batch, strerror(errno));
+        return -1;
+    }
+    char          line[0x1000];
+    batch_state_t batch = opts->batch_fd >= 0 ? opts->taken : (batch_state_t) { .tstart = vtk_clock_ns() };
+    int waits = (opts->handoff >= 0) || opts->telemetry;
+    if (waits) {
+        setvbuf(fin, NULL, _IONBF, 0);
+    }
+
+    while ((! waits || ! batch_wait(opts, fin, &batch)) && fgets(line, sizeof(line), fin)) {
+        char *first = line + strspn(line, " \t\r\n");
+        if (! *first || (*first == '#')) {
+            continue;
+        }
+        payment_opts_t job = *opts;
+        job.price    = 0;
+        job.prodid   = job.evnum  = 0;
+        job.prodname = job.evname = NULL;
+        batch.njob++;
+
+        if (parse_job(line, &job) < 0) {
+            printf("{\"job\":%zu,\"status\":\"invalid\"}\n", batch.njob);
+            fflush(stdout);
+            batch.nfail++;
+            continue;
+        }
+        /* a cancel received between jobs is stale, it must not cancel this one */
+        vtk_net_cancel_reset(opts->vtk);
+        uint64_t tjob = vtk_clock_ns();
+        int      rc   = do_payment(&job);
+        opts->opnum   = job.opnum;
+
+        printf("{\"job\":%zu,\"status\":\"%s\",\"opnum\":%zd,\"price\":%zd,\"ms\":%.3f,\"allocs\":%llu,\"resumed\":%d}\n",
+               batch.njob, job.cancelled ? "cancelled" : rc < 0 ? "failed" : "ok", job.opnum, job.price, (vtk_clock_ns() - tjob) / 1e6,
+               job.allocs, job.resume.resumes);
+        fflush(stdout);
+        rc < 0 ? batch.nfail++ : batch.nok++;
+    }
+    if (fin != stdin) {
+        fclose(fin);
+    }
+    /* the new process goes on with the batch and sums it up */
+    if (opts->handed) {
+        return 0;
+    }
+    double seconds = (vtk_clock_ns() - batch.tstart) / 1e9;
+    printf("{\"summary\":{\"jobs\":%zu,\"ok\":%zu,\"failed\":%zu,\"seconds\":%.3f,\"per_second\":%.1f}}\n",
+           batch.njob, batch.nok, batch.nfail, seconds, seconds > 0 ? batch.njob / seconds : 0.0);
+    fflush(stdout);
+
+    return batch.nfail ? -1 : 0;
+}
+
+/*
+ * Hot restart, new process: the POS session, batch input and stdout are taken over from the running one,
+ * which has no payment in flight then, so the batch goes on with no reconnect and no lost job
+ */
+int do_takeover(payment_opts_t *opts, const char *path)
+{
+    int     fds[VTK_HANDOFF_FDS], nfds = 0;
+    void   *app = NULL;
+    size_t  len = 0;
+
+    int usock = vtk_handoff_connect(path);
+    if (usock < 0) {
+        return -1;
+    }
+    int rc = vtk_handoff_recv(usock, opts->vtk, fds, &nfds, &app, &len);
+    close(usock);
+    if (rc < 0) {
+        return -1;
+    }
+    if ((nfds != 2) || (len != sizeof(batch_state_t))) {
+        vtk_loge("Running process handed off something else than a batch");
+        for (int i = 0; i < nfds; i++) {
+            close(fds[i]);
+        }
+        vtk_mem_free(app);
+        return -1;
+    }
+    memcpy(&opts->taken, app, len);
+    vtk_mem_free(app);
+    dup2(fds[1], STDOUT_FILENO);
+    close(fds[1]);
+    opts->batch_fd = fds[0];
+    opts->opnum    = opts->taken.opnum;
+    vtk_logn("Batch is taken over after job %zu", opts->taken.njob);
+    return 0;
+}
+
+/*
+ * Fleet ping: IDL to every terminal of the list, host:port per line, from one event loop.
+ * Connections are nonblocking and at most --parallel of them are in flight, so the fleet
+ * takes about the time of the slowest terminal. Results are JSON lines in completion order.
+ * With --telemetry the management data, local time and system information of the answers
+ * go to the table, and with --interval the rounds repeat. Terminals that the payment clients
+ * of the status board hold a session with are left alone, they are polled in session.
+ */
+#define FLEET_PARALLEL  64
+#define FLEET_RXBUF     0x4000  /* response buffer, from the pool of --parallel ones */
+
+typedef enum fleet_state_e {
+    FLEET_CONNECTING,
+    FLEET_SENDING,
+    FLEET_WAITING
+} fleet_state_t;
+
+typedef struct fleet_term_s {
+    char          *target;
+    int            fd;
+    fleet_state_t  state;
+    size_t         sent;
+    uint64_t       tstart;
+    uint64_t       tconn;
+    uint64_t       tsent;
+    uint64_t       deadline;
+    vtk_stream_t   rx;
+} fleet_term_t;
+
+typedef struct fleet_s {
+    vtk_msg_t     *msg;
+    vtk_bufpool_t *pool;       /* response buffers, held by terminals in flight only */
+    vtk_stream_t   idl;        /* serialized once, sent to every terminal */
+    size_t         nok;
+    size_t         nfail;
+    size_t         nbusy;
+    vtk_telemetry_t *telemetry;
+    vtk_status_t  *board;
+} fleet_t;
+
+void fleet_json_str(const char *str, size_t len)
+{
+    putchar('"');
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = str[i];
+        if ((c == '"') || (c == '\\')) {
+            printf("\\%c", c);
+        } else if ((c < 0x20) || (c >= 0x7f)) {
+            printf("\\u%04x", c);
+        } else {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+/* busy: a payment client of the board holds the session, POS won't serve another VMC connection */
+int fleet_busy(fleet_t *fleet, fleet_term_t *term)
+{
+    for (int i = 0; fleet->board && (i < vtk_status_slots(fleet->board)); i++) {
+        vtk_status_rec_t rec;
+        if ((vtk_status_read(fleet->board, i, &rec) >= 0) && ! strcmp(rec.terminal, term->target) &&
+            VTK_NET_IS_ESTABLISHED(rec.net_state)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void fleet_done(fleet_t *fleet, fleet_term_t *term, const char *error)
+{
+    uint64_t now = vtk_clock_ns();
+
+    printf("{\"target\":");
+    fleet_json_str(term->target, strlen(term->target));
+    if (error) {
+        printf(",\"status\":\"failed\",\"error\":");
+        fleet_json_str(error, strlen(error));
+    } else {
+        printf(",\"status\":\"ok\"");
+    }
+    if (term->tconn) {
+        printf(",\"connect_ms\":%.3f", (term->tconn - term->tstart) / 1e6);
+    }
+    if (! error) {
+        printf(",\"rtt_ms\":%.3f,\"fields\":{", (now - term->tsent) / 1e6);
+        uint16_t id, len;
+        char    *value;
+        for (int i = 0; vtk_msg_iter_param(fleet->msg, i, &id, &len, &value) >= 0; i++) {
+            printf(i ? ",\"0x%x\":" : "\"0x%x\":", id);
+            fleet_json_str(value, len);
+        }
+        printf("}");
+    }
+    printf("}\n");
+    fflush(stdout);
+    error ? fleet->nfail++ : fleet->nok++;
+    if (fleet->telemetry) {
+        telemetry_note(fleet->telemetry, term->target, fleet->msg, error, now - term->tsent);
+    }
+
+    if (term->fd >= 0) {
+        close(term->fd);
+        term->fd = -1;
+    }
+    vtk_bufpool_put(fleet->pool, term->rx.data);
+    term->rx = (vtk_stream_t) {0};
+}
+
+int fleet_start(fleet_t *fleet, fleet_term_t *term, int tm)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    char  *colon = strrchr(term->target, ':');
+
+    term->tstart   = vtk_clock_ns();
+    term->deadline = term->tstart + tm * 1000000ull;
+    term->fd       = -1;
+    term->sent     = 0;
+    term->tconn    = 0;
+    if (fleet_busy(fleet, term)) {
+        printf("{\"target\":");
+        fleet_json_str(term->target, strlen(term->target));
+        printf(",\"status\":\"busy\"}\n");
+        fflush(stdout);
+        fleet->nbusy++;
+        return -1;
+    }
+    if (! colon || (colon[1] == 0)) {
+        fleet_done(fleet, term, "bad target, host:port is expected");
+        return -1;
+    }
+    *colon = 0;
+    int raddr = inet_aton(term->target, &addr.sin_addr);
+    *colon = ':';
+    addr.sin_port = htons(atoi(colon + 1));
+    if (! raddr) {
+        fleet_done(fleet, term, "bad target address");
+        return -1;
+    }
+    term->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (term->fd < 0) {
+        fleet_done(fleet, term, strerror(errno));
+        return -1;
+    }
+    term->state = FLEET_CONNECTING;
+    if ((connect(term->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) && (errno != EINPROGRESS)) {
+        fleet_done(fleet, term, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* returns 1 when the terminal is done */
+int fleet_process(fleet_t *fleet, fleet_term_t *term, short revents)
+{
+    if (term->state == FLEET_CONNECTING) {
+        int       sockerr = 0;
+        socklen_t errsize = sizeof(sockerr);
+        if ((getsockopt(term->fd, SOL_SOCKET, SO_ERROR, &sockerr, &errsize) < 0) || sockerr) {
+            fleet_done(fleet, term, strerror(sockerr ? sockerr : errno));
+            return 1;
+        }
+        term->tconn = term->tsent = vtk_clock_ns();
+        term->state = FLEET_SENDING;
+    }
+    if (term->state == FLEET_SENDING) {
+        ssize_t wresult = send(term->fd, &fleet->idl.data[term->sent], fleet->idl.len - term->sent, MSG_NOSIGNAL);
+        if ((wresult < 0) && (errno != EAGAIN)) {
+            fleet_done(fleet, term, strerror(errno));
+            return 1;
+        }
+        term->sent += wresult > 0 ? wresult : 0;
+        term->state = term->sent == fleet->idl.len ? FLEET_WAITING : FLEET_SENDING;
+        return 0;
+    }
+    if (! term->rx.data) {
+        term->rx.data = vtk_bufpool_get(fleet->pool);
+        term->rx.size = vtk_bufpool_size(fleet->pool);
+    }
+    if (! term->rx.data || (term->rx.len == term->rx.size)) {
+        fleet_done(fleet, term, term->rx.data ? "response is too long" : "no response buffer");
+        return 1;
+    }
+    ssize_t rcount = read(term->fd, &term->rx.data[term->rx.len], term->rx.size - term->rx.len);
+    if ((rcount < 0) && (errno == EAGAIN)) {
+        return 0;
+    }
+    if (rcount <= 0) {
+        fleet_done(fleet, term, rcount ? strerror(errno) : "connection closed by POS");
+        return 1;
+    }
+    term->rx.len += rcount;
+
+    uint8_t *head  = (uint8_t *)term->rx.data;
+    size_t   frame = term->rx.len >= 2 ? 2 + ((head[0] << 8) | head[1]) : 0;
+    if (! frame || (term->rx.len < frame)) {
+        return 0;
+    }
+    if (vtk_msg_deserialize(fleet->msg, &term->rx) < 0) {
+        fleet_done(fleet, term, "malformed response");
+        return 1;
+    }
+    fleet_done(fleet, term, vtk_msg_name(fleet->msg) == VTK_MSGNAME_IDL ? NULL : "unexpected response");
+    return 1;
+}
+
+int do_fleet(payment_opts_t *opts)
+{
+    FILE *fin = strcmp(opts->fleet, "-") ? fopen(opts->fleet, "r") : stdin;
+    if (! fin) {
+        vtk_loge("Can't open fleet file %s: %s", opts->fleet, strerror(errno));
+        return -1;
+    }
+    fleet_term_t *terms = NULL;
+    size_t        nterms = 0;
+    char          line[0x100];
+    int           rc     = 0;
+    while ((rc >= 0) && fgets(line, sizeof(line), fin)) {
+        char *target = line + strspn(line, " \t\r\n");
+        target[strcspn(target, " \t\r\n#")] = 0;
+        if (! *target) {
+            continue;
+        }
+        fleet_term_t *grown = vtk_mem_realloc(terms, (nterms + 1) * sizeof(fleet_term_t));
+        terms = grown ? grown : terms;
+        char *dup = grown ? vtk_mem_strdup(target) : NULL;
+        if (! dup) {
+            rc = -1;
+            break;
+        }
+        terms[nterms++] = (fleet_term_t) {
+            .target = dup,
+            .fd     = -1
+        };
+    }
+    if (fin != stdin) {
+        fclose(fin);
+    }
+
+    int     parallel = opts->parallel > 0 ? opts->parallel : FLEET_PARALLEL;
+    fleet_t fleet    = {
+        .telemetry = opts->telemetry,
+        .board     = opts->board
+    };
+    struct pollfd *pollfds  = vtk_mem_alloc(parallel * sizeof(struct pollfd));
+    fleet_term_t **inflight = vtk_mem_alloc(parallel * sizeof(fleet_term_t *));
+    if ((rc < 0) || ! pollfds || ! inflight ||
+        (vtk_bufpool_init(&fleet.pool, FLEET_RXBUF, parallel) < 0) || (vtk_msg_init(&fleet.msg, opts->vtk) < 0) ||
+        (vtk_msg_mod(fleet.msg, VTK_MSG_RESET, VTK_BASE_VMC, 0, NULL) < 0) ||
+        (vtk_msg_mod(fleet.msg, VTK_MSG_ADDSTR, 0x1, 0, "IDL") < 0) || (vtk_msg_serialize(fleet.msg, &fleet.idl) < 0)) {
+        vtk_loge("Fleet of %zu terminals can't be set up", nterms);
+        rc = -1;
+    }
+
+    while (rc >= 0) {
+        int      ninflight = 0;
+        size_t   next      = 0;
+        uint64_t tfleet    = vtk_clock_ns();
+        fleet.nok = fleet.nfail = fleet.nbusy = 0;
+
+        while ((next < nterms) || ninflight) {
+            while ((next < nterms) && (ninflight < parallel)) {
+                fleet_term_t *term = &terms[next++];
+                if (fleet_start(&fleet, term, opts->timeout * 1000) >= 0) {
+                    inflight[ninflight++] = term;
+                }
+            }
+            uint64_t now = vtk_clock_ns(), deadline = UINT64_MAX;
+            for (int i = 0; i < ninflight; i++) {
+                pollfds[i] = (struct pollfd) {
+                    .fd     = inflight[i]->fd,
+                    .events = inflight[i]->state == FLEET_WAITING ? POLLIN : POLLOUT
+                };
+                deadline = inflight[i]->deadline < deadline ? inflight[i]->deadline : deadline;
+            }
+            int tm = ! ninflight ? 0 : deadline > now ? (deadline - now) / 1000000 + 1 : 0;
+            if ((vtk_poll(pollfds, ninflight, tm) < 0) && (errno != EINTR)) {
+                vtk_loge("Fleet poll error: %s", strerror(errno));
+                break;
+            }
+            now = vtk_clock_ns();
+            for (int i = ninflight - 1; i >= 0; i--) {
+                fleet_term_t *term = inflight[i];
+                int           done = 0;
+                if (pollfds[i].revents) {
+                    done = fleet_process(&fleet, term, pollfds[i].revents);
+                }
+                if (! done && (now >= term->deadline)) {
+                    fleet_done(&fleet, term, term->state == FLEET_CONNECTING ? "connection timeout" : "response timeout");
+                    done = 1;
+                }
+                if (done) {
+                    inflight[i] = inflight[--ninflight];
+                }
+            }
+        }
+        double seconds = (vtk_clock_ns() - tfleet) / 1e9;
+        printf(fleet.board ? "{\"summary\":{\"targets\":%zu,\"ok\":%zu,\"failed\":%zu,\"seconds\":%.3f,\"busy\":%zu}}\n" :
+                             "{\"summary\":{\"targets\":%zu,\"ok\":%zu,\"failed\":%zu,\"seconds\":%.3f}}\n",
+               nterms, fleet.nok, fleet.nfail, seconds, fleet.nbusy);
+        fflush(stdout);
+
+        /* one write per changed record and one sync per round */
+        int written = fleet.telemetry ? vtk_telemetry_flush(fleet.telemetry) : -1;
+        if (written >= 0) {
+            vtk_logi("Telemetry: %d records written", written);
+        }
+        if (opts->interval <= 0) {
+            break;
+        }
+        uint64_t next_round = tfleet + opts->interval * 1000000000ull;
+        for (uint64_t now; (now = vtk_clock_ns()) < next_round; ) {
+            vtk_poll(NULL, 0, (next_round - now) / 1000000 + 1);
+        }
+    }
+
+    for (size_t i = 0; i < nterms; i++) {
+        vtk_mem_free(terms[i].target);
+    }
+    vtk_mem_free(terms);
+    vtk_mem_free(pollfds);
+    vtk_mem_free(inflight);
+    vtk_mem_free(fleet.idl.data);
+    vtk_msg_free(fleet.msg);
+    vtk_bufpool_free(fleet.pool);
+
+    return (rc < 0) || fleet.nfail ? -1 : 0;
+}
+
 void show_help(void) {
     const char *help[] = {
         "Available options are:",
@@ -290,11 +1440,29 @@ void show_help(void) {
         "  --port       mandatory       POS port number",
         "  --price      optional        Price in minor currency units (MCU)",
         "  --ping       optional        Connect, send IDL message, disconnect",
+        "  --batch      optional        Run payment jobs from the file (\"-\" for stdin) over one connection",
         "  --prodname   optional        Product Name",
         "  --prodid     optional        Product ID",
         "  --evname     optional        Event Name",
         "  --evnum      optional        Event Number",
         "  --timeout    optional        Timeout in seconds, 60 by default",
+        "  --receipt    optional        Write banking receipt to the file or printer pipe",
+        "  --relay      optional        Number of POS host connections to relay, 1 by default",
+        "  --metrics    optional        Write Prometheus metrics to the file on exit",
+        "  --trace      optional        Write spans of every payment to the file on exit, Chrome trace format",
+        "  --tstamp     optional        Kernel timestamps: split stages into POS think time and local time",
+        "  --journal    optional        Journal payments to the file, reconcile interrupted ones on start",
+        "  --status     optional        Publish terminal status to the shared memory board, e.g. /vendotek",
+        "  --pool       optional        Allocate from a static 1 MB pool instead of the heap",
+        "  --transport  optional        tcp (default) or unix; with unix --host is the socket path",
+        "  --resume     optional        Reconnects to resume a stage after connection drop, 3 by default",
+        "  --resume-vrp optional        Resend VRP after connection drop if IDL shows POS hasn't processed another one",
+        "  --fleet      optional        Ping every host:port of the file (\"-\" for stdin) concurrently",
+        "  --parallel   optional        Connections in flight for --fleet, 64 by default",
+        "  --telemetry  optional        Keep POS management data, local time and system info of --fleet or --batch in the table file",
+        "  --interval   optional        Repeat --fleet rounds or --batch telemetry polls every given number of seconds",
+        "  --handoff    optional        Hand the --batch session to a new process connecting to the socket path",
+        "  --takeover   optional        Take the --batch session over from the process at the socket path",
         "  --verbose    optional        Set verbosity level",
         "                               0 - silent, 4 - errs + warnings, 7 - most verbose",
         "                               4 by default",
@@ -307,16 +1475,36 @@ void show_help(void) {
 }
 
 
+/* SIGUSR1 cancels the payment in flight, e.g. when the customer presses cancel */
+static vtk_t *cancel_vtk;
+
+static void
+cancel_signal(int signo)
+{
+    vtk_net_cancel(cancel_vtk);
+}
+
+/* static pool for --pool, large enough for a few mapped messages and streams */
+static char pool_mem[1 << 20];
+
 int main(int argc, char *argv[])
 {
     /*
      * Configure
      */
     payment_opts_t popts = {
-        .timeout   = 60,
-        .verbose   = LOG_WARNING
+        .timeout     = 60,
+        .verbose     = LOG_WARNING,
+        .relay_conns = 1,
+        .resume.attempts = 3,
+        .handoff     = -1,
+        .batch_fd    = -1
     };
-    char *conn_host = NULL, *conn_port = NULL;
+    char *conn_host = NULL, *conn_port = NULL, *metrics_path = NULL, *receipt_path = NULL, *journal_path = NULL;
+    char *status_name = NULL, *trace_path = NULL, *handoff_path = NULL, *takeover_path = NULL;
+    char *telemetry_path = NULL;
+    int   use_pool    = 0, tstamp = 0;
+    const vtk_transport_t *transport = &vtk_transport_tcp;
 
     /* command line optios */
     const struct option longopts[] = {
@@ -328,7 +1516,25 @@ int main(int argc, char *argv[])
         {"evname",    required_argument, NULL, 'e'},
         {"evnum",     required_argument, NULL, 'E'},
         {"ping",      optional_argument, NULL, 'i'},
+        {"batch",     required_argument, NULL, 'b'},
         {"timeout",   required_argument, NULL, 't'},
+        {"receipt",   required_argument, NULL, 'R'},
+        {"relay",     required_argument, NULL, 'r'},
+        {"metrics",   required_argument, NULL, 'm'},
+        {"trace",     required_argument, NULL, 'x'},
+        {"tstamp",    no_argument,       NULL, 'S'},
+        {"journal",   required_argument, NULL, 'j'},
+        {"status",    required_argument, NULL, 's'},
+        {"pool",      no_argument,       NULL, 'o'},
+        {"transport", required_argument, NULL, 'T'},
+        {"resume",    required_argument, NULL, 'u'},
+        {"resume-vrp", no_argument,      NULL, 'U'},
+        {"fleet",     required_argument, NULL, 'F'},
+        {"parallel",  required_argument, NULL, 'n'},
+        {"telemetry", required_argument, NULL, 'y'},
+        {"interval",  required_argument, NULL, 'l'},
+        {"handoff",   required_argument, NULL, 'H'},
+        {"takeover",  required_argument, NULL, 'K'},
         {"verbose",   required_argument, NULL, 'v'},
         {NULL,        0,                 NULL,  0 }
     };
@@ -361,9 +1567,66 @@ int main(int argc, char *argv[])
         case 'i':
             popts.ping = 1;
             break;
+        case 'b':
+            popts.batch = strdup(optarg);
+            break;
         case 't':
             popts.timeout = atol(optarg);
             break;
+        case 'R':
+            receipt_path = strdup(optarg);
+            break;
+        case 'r':
+            popts.relay_conns = atol(optarg);
+            break;
+        case 'm':
+            metrics_path = strdup(optarg);
+            break;
+        case 'x':
+            trace_path = strdup(optarg);
+            vtk_trace_enable(1);
+            break;
+        case 'S':
+            tstamp = 1;
+            break;
+        case 'j':
+            journal_path = strdup(optarg);
+            break;
+        case 's':
+            status_name = strdup(optarg);
+            break;
+        case 'o':
+            use_pool = 1;
+            break;
+        case 'F':
+            popts.fleet = strdup(optarg);
+            break;
+        case 'n':
+            popts.parallel = atol(optarg);
+            break;
+        case 'y':
+            telemetry_path = strdup(optarg);
+            break;
+        case 'l':
+            popts.interval = atol(optarg);
+            break;
+        case 'u':
+            popts.resume.attempts = atol(optarg);
+            break;
+        case 'U':
+            popts.resume.vrp = 1;
+            break;
+        case 'H':
+            handoff_path = strdup(optarg);
+            break;
+        case 'K':
+            takeover_path = strdup(optarg);
+            break;
+        case 'T':
+            if (! (transport = vtk_transport_find(optarg))) {
+                return -1;
+            }
+            break;
         case 'v':
             popts.verbose = atol(optarg);
             break;
@@ -373,33 +1636,136 @@ int main(int argc, char *argv[])
         show_help();
         return -1;
     }
-    if (!conn_host || !conn_port) {
+    if (!popts.fleet && (!conn_host || (!conn_port && (transport == &vtk_transport_tcp)))) {
         vtk_loge("--host and --port options are mandatory. Please check documentation");
         return -1;
     }
-    if ((!popts.price && !popts.ping) || (popts.price && popts.ping)) {
-        vtk_loge("one of --price or --ping option should be set. Please check documentation");
+    if ((!!popts.price + !!popts.ping + !!popts.batch + !!popts.fleet) != 1) {
+        vtk_loge("one of --price, --ping, --batch or --fleet option should be set. Please check documentation");
+        return -1;
+    }
+    if ((handoff_path || takeover_path) && ! popts.batch) {
+        vtk_loge("--handoff and --takeover options work with --batch only");
         return -1;
     }
+    if ((telemetry_path || popts.interval) && ! popts.fleet && ! (popts.batch && telemetry_path)) {
+        vtk_loge("--telemetry and --interval options work with --fleet or --batch --telemetry only");
+        return -1;
+    }
+    if (popts.batch && telemetry_path && (popts.interval <= 0)) {
+        popts.interval = TELEMETRY_INTERVAL;
+    }
     /*
      * Initialize VTK & do payment
      */
     int rcode = 0;
 
-    vtk_logline_set(NULL, popts.verbose);
-    vtk_init(&popts.vtk);
-    rcode = vtk_net_set(popts.vtk, VTK_NET_CONNECTED, popts.timeout * 1000, conn_host, conn_port);
+    FILE *receipt = NULL;
+    if (receipt_path && ((receipt = fopen(receipt_path, "a")) == NULL)) {
+        vtk_loge("Can't open receipt file %s: %s", receipt_path, strerror(errno));
+        return -1;
+    }
+    vtk_logline_set((popts.batch || popts.fleet) ? batch_logline : NULL, popts.verbose);
+    if (use_pool) {
+        vtk_allocator_t pool;
+        if ((vtk_pool_allocator(&pool, pool_mem, sizeof(pool_mem)) < 0) || (vtk_set_allocator(&pool) < 0)) {
+            return -1;
+        }
+    }
+    if (vtk_init(&popts.vtk) < 0) {
+        return -1;
+    }
+    vtk_net_set_transport(popts.vtk, transport);
+    vtk_net_set_timestamping(popts.vtk, tstamp);
 
-    if (rcode >= 0) {
-        vtk_msg_init(&popts.mreq,  popts.vtk);
-        vtk_msg_init(&popts.mresp, popts.vtk);
+    /* restart interrupted reads, or fgets on --batch - ends the batch on a cancel */
+    struct sigaction sa = { .sa_handler = cancel_signal, .sa_flags = SA_RESTART };
+    cancel_vtk = popts.vtk;
+    sigaction(SIGUSR1, &sa, NULL);
+    if (receipt) {
+        vtk_net_set_field_fn(popts.vtk, 0x13, receipt_write, receipt);
+    }
+    if (journal_path && ! takeover_path && (vtk_journal_open(&popts.journal, journal_path) < 0)) {
+        return -1;
+    }
+    vtk_status_t *status = NULL;
+    if (status_name && popts.fleet) {
+        /* the fleet only reads the board, to leave terminals in the middle of a payment alone */
+        vtk_status_open(&popts.board, status_name, 0);
+    } else if (status_name && (vtk_status_open(&status, status_name, VTK_STATUS_SLOTS) >= 0)) {
+        char terminal[64];
+        snprintf(terminal, sizeof(terminal), conn_port ? "%s:%s" : "%s", conn_host, conn_port);
+        vtk_net_set_status(popts.vtk, vtk_status_claim(status, terminal));
+    }
+    if (popts.fleet) {
+        rcode = telemetry_path ? vtk_telemetry_open(&popts.telemetry, telemetry_path) : 0;
+        if (rcode >= 0) {
+            rcode = do_fleet(&popts);
+        }
+        vtk_telemetry_close(popts.telemetry);
+        vtk_status_close(popts.board);
+        vtk_free(popts.vtk);
+        return rcode < 0 ? 1 : 0;
+    }
+    popts.resume.host    = conn_host;
+    popts.resume.port    = conn_port;
+    popts.resume.timeout = popts.timeout * 1000;
 
-        rcode = popts.ping ? do_ping(&popts) : do_payment(&popts);
+    /* connect and reconciliation are traced apart from the payments */
+    vtk_trace_begin();
+    rcode = takeover_path ? do_takeover(&popts, takeover_path) :
+                            vtk_net_set(popts.vtk, VTK_NET_CONNECTED, popts.timeout * 1000, conn_host, conn_port);
+    /* the journal is opened once the previous process is done with it */
+    if ((rcode >= 0) && takeover_path && journal_path) {
+        rcode = vtk_journal_open(&popts.journal, journal_path);
+    }
+    if ((rcode >= 0) && telemetry_path) {
+        popts.telemetry_path = telemetry_path;
+        rcode = vtk_telemetry_open(&popts.telemetry, telemetry_path);
+    }
+    if ((rcode >= 0) && handoff_path) {
+        rcode = popts.handoff = vtk_handoff_listen(handoff_path);
+    }
 
+    if (rcode >= 0) {
+        rcode = (vtk_msg_init(&popts.mreq, popts.vtk) < 0) || (vtk_msg_init(&popts.mresp, popts.vtk) < 0) ? -1 :
+                vtk_relay_init(&popts.relay, popts.vtk, popts.relay_conns);
+    }
+    /* transactions which can't be reconciled are left to the operator, payments go on */
+    if ((rcode >= 0) && popts.journal) {
+        do_reconcile(&popts);
+    }
+    if (rcode >= 0) {
+        rcode = popts.ping  ? do_ping(&popts)  :
+                popts.batch ? do_batch(&popts) : do_payment(&popts);
+    }
+    if (popts.mreq) {
+        vtk_relay_free(popts.relay);
         vtk_msg_free(popts.mreq);
         vtk_msg_free(popts.mresp);
     }
+    /* the path belongs to the new process once the batch is handed off */
+    if (popts.handoff >= 0) {
+        close(popts.handoff);
+        if (! popts.handed) {
+            unlink(handoff_path);
+        }
+    }
+    vtk_status_rec_t *status_rec = vtk_net_get_status(popts.vtk);
     vtk_free(popts.vtk);
+    vtk_status_release(status_rec);
+    vtk_status_close(status);
+    vtk_journal_close(popts.journal);
+    vtk_telemetry_close(popts.telemetry);
+    if (receipt) {
+        fclose(receipt);
+    }
 
+    if (metrics_path) {
+        vtk_metrics_export_file(metrics_path);
+    }
+    if (trace_path) {
+        vtk_trace_export_file(trace_path);
+    }
     return rcode < 0 ? 1 : 0;
 }
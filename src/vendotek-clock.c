@@ -0,0 +1,87 @@
+#include <poll.h>
+#include <time.h>
+
+#include "vendotek.h"
+
+/*
+ * Clock
+ *
+ * The library takes time from vtk_clock_ns() and waits through vtk_poll(), both going
+ * to the clock set by vtk_set_clock(): CLOCK_MONOTONIC and poll(2) by default.
+ */
+static uint64_t
+vtk_real_now(void *ctx)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int
+vtk_real_poll(void *ctx, struct pollfd *fds, int nfds, int tm)
+{
+    return poll(fds, nfds, tm);
+}
+
+static vtk_clock_t vtk_clock = {
+    .now  = vtk_real_now,
+    .poll = vtk_real_poll
+};
+
+int vtk_set_clock(const vtk_clock_t *clock)
+{
+    if (clock && (! clock->now || ! clock->poll)) {
+        vtk_loge("Clock must provide now and poll");
+        return -1;
+    }
+    vtk_clock = clock ? *clock : (vtk_clock_t) {
+        .now  = vtk_real_now,
+        .poll = vtk_real_poll
+    };
+    return 0;
+}
+
+uint64_t vtk_clock_ns(void)
+{
+    return vtk_clock.now(vtk_clock.ctx);
+}
+
+int vtk_poll(struct pollfd *fds, int nfds, int tm)
+{
+    return vtk_clock.poll(vtk_clock.ctx, fds, nfds, tm);
+}
+
+/*
+ * Virtual clock: time stands still until the caller advances it or somebody waits.
+ * A wait with nothing ready completes at once and moves the time to its end, so
+ * timeouts of any length expire instantly and in a reproducible order.
+ */
+static uint64_t
+vtk_virtual_now(void *ctx)
+{
+    return __atomic_load_n((uint64_t *)ctx, __ATOMIC_RELAXED);
+}
+
+static int
+vtk_virtual_poll(void *ctx, struct pollfd *fds, int nfds, int tm)
+{
+    int rpoll = poll(fds, nfds, 0);
+    if ((rpoll != 0) || (tm == 0)) {
+        return rpoll;
+    }
+    if (tm < 0) {
+        /* endless wait can't be skipped */
+        return poll(fds, nfds, -1);
+    }
+    __atomic_add_fetch((uint64_t *)ctx, tm * 1000000ull, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void vtk_virtual_clock(vtk_clock_t *clock, uint64_t *now)
+{
+    *clock = (vtk_clock_t) {
+        .now  = vtk_virtual_now,
+        .poll = vtk_virtual_poll,
+        .ctx  = now
+    };
+}
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "vendotek.h"
@@ -24,12 +25,23 @@ show_help(void)
         "       conn to 127.0.0.1, on port 1234",
         "    net stat",
         "       show current net state",
+        "    net transport unix",
+        "       use transport for the next conn / list: tcp (default), unix or mem;",
+        "       unix takes the socket path instead of the IP, port is omitted then",
+        "    net limit frame 4096",
+        "       refuse received frames over the limit: frame (bytes), args (per message),",
+        "       buffered (bytes), parse (ms); 0 disables the limit",
         "",
         "Message commands:",
         "    msg reset [POS | VMC]",
         "       reset / initialize Upload message structure",
         "    msg addstr 1 IDL",
         "       add new field to Upload message, with code 0x01 and value = \"IDL\"",
+        "    msg addhex 13 0A0B0C",
+        "       add new field with code 0x13 and binary value, given as hex digits",
+        "    msg addfile 13 receipt.txt",
+        "       add new field with code 0x13 and value from the file; the file is mapped",
+        "       and sent right from the mapping, up to the maximum message size",
         "    msg print",
         "       show Upload message in human readable form",
         "    msg printhex",
@@ -37,10 +49,31 @@ show_help(void)
         "    msg send",
         "       send message over TCP, if connected; message structure will be reset then",
         "",
+        "Macro commands, usable interactively too:",
+        "    repeat 1000",
+        "       repeat commands up to the matching \"end\" 1000 times; blocks may be nested",
+        "    end",
+        "       end of the repeat block",
+        "    sleep 250",
+        "       sleep for 250 ms",
+        "    expect 1 IDL [5000]",
+        "       wait up to 5000 ms (by default) for the next message, it must have",
+        "       field 0x01 equal to \"IDL\"; macro is stopped otherwise",
+        "    timer start",
+        "       reset message counters and latency statistics",
+        "    timer report",
+        "       show messages per second and request - response latency since \"timer start\"",
+        "    verbose 4",
+        "       set verbosity level, 0 - silent, 7 - most verbose",
+        "",
         "Other commands:",
         "    macro sample0.macro",
-        "       load commands from \"sample0.macro\" file and execute them ",
+        "       compile commands from \"sample0.macro\" file and execute them ",
         "       as if they were read from terminal ",
+        "    status [/vendotek]",
+        "       show terminals published on the shared memory status board",
+        "    telemetry <file>",
+        "       show terminals kept in the fleet telemetry table",
         "    help",
         "       show this help",
         "    quit",
@@ -52,140 +85,603 @@ show_help(void)
     }
 }
 
+/*
+ * Commands are compiled once into a list, so macro loops don't parse anything
+ */
+typedef enum cmd_op_e {
+    CMD_NET_CONN,
+    CMD_NET_LIST,
+    CMD_NET_DROP,
+    CMD_NET_DOWN,
+    CMD_NET_STAT,
+    CMD_NET_TRANSPORT,
+    CMD_NET_LIMIT,
+    CMD_MSG_RESET,
+    CMD_MSG_ADDSTR,
+    CMD_MSG_ADDHEX,
+    CMD_MSG_ADDFILE,
+    CMD_MSG_PRINT,
+    CMD_MSG_PRINTHEX,
+    CMD_MSG_SEND,
+    CMD_STATUS,
+    CMD_TELEMETRY,
+    CMD_REPEAT,
+    CMD_END,
+    CMD_SLEEP,
+    CMD_EXPECT,
+    CMD_TIMER_START,
+    CMD_TIMER_REPORT,
+    CMD_VERBOSE,
+    CMD_NONE
+} cmd_op_t;
+
+typedef struct cmd_s {
+    cmd_op_t   op;
+    char      *arg[2];     /* string arguments: address & port, field value, board name */
+    long       num;        /* numeric argument: protocol, repeat count, sleep / expect timeout, level */
+    uint16_t   id;         /* message field id */
+    size_t     jump;       /* repeat: index of the matching end, and vice versa */
+    long       left;       /* repeat: iterations left */
+    char      *src;        /* file name, for error messages */
+    int        line;
+} cmd_t;
+
+typedef struct prog_s {
+    cmd_t     *cmds;
+    size_t     cnt;
+    size_t     size;
+    size_t     open[16];   /* stack of open repeat blocks */
+    int        nopen;
+    char     **srcs;       /* macro file names */
+    size_t     nsrcs;
+} prog_t;
+
+#define MACRO_DEPTH       8
+#define EXPECT_DEFAULT_TM 5000
+
+typedef struct stopwatch_s {
+    uint64_t   tstart;
+    uint64_t   tsent;      /* time of the last message sent */
+    size_t     sent;
+    size_t     recv;
+    uint64_t  *lat;        /* request - response latencies, ns */
+    size_t     lat_cnt;
+    size_t     lat_size;
+} stopwatch_t;
+
 typedef struct state_s {
     vtk_t        *vtk;
     vtk_msg_t    *msg_up;
     vtk_stream_t  msg_stream_up;
     vtk_msg_t    *msg_down;
     vtk_stream_t  msg_stream_down;
+    stopwatch_t   timer;
 } state_t;
 
-int user_action_ctrl(state_t *state, char *action)
+void prog_free(prog_t *prog)
+{
+    for (size_t i = 0; i < prog->cnt; i++) {
+        free(prog->cmds[i].arg[0]);
+        free(prog->cmds[i].arg[1]);
+    }
+    for (size_t i = 0; i < prog->nsrcs; i++) {
+        free(prog->srcs[i]);
+    }
+    free(prog->cmds);
+    free(prog->srcs);
+    memset(prog, 0, sizeof(*prog));
+}
+
+int prog_compile_file(prog_t *prog, char *path, int depth);
+
+int prog_compile(prog_t *prog, char *line, char *src, int lineno, int depth)
 {
     const char *errmsg = "unexpected command; type \"help\" to check syntax";
     char   *args[5] = {0};
     size_t  args_sz = sizeof(args) / sizeof(args[0]);
 
-    for (int i = 0; (i < args_sz) && (args[i] = strtok((i ? NULL : action), " \t\n")); i++);
+    for (int i = 0; (i < args_sz) && (args[i] = strtok((i ? NULL : line), " \t\r\n")); i++);
+
+    if (! args[0] || (args[0][0] == '#')) {
+        return 0;
+    }
+    if (strcasecmp(args[0], "macro") == 0) {
+        if (! args[1]) {
+            vtk_loge(errmsg);
+            return -1;
+        }
+        return prog_compile_file(prog, args[1], depth + 1);
+    }
+    cmd_t cmd = {
+        .op   = CMD_NONE,
+        .src  = src,
+        .line = lineno
+    };
+    int argmin = 1;
 
-    if (args[0] && (strcasecmp(args[0], "net") == 0)) {
+    if (strcasecmp(args[0], "net") == 0) {
         /*
          * network commands
          */
-        if (args[1] && (strcasecmp(args[1], "conn") == 0)) {
-            if (! args[2] || ! args[3]) {
-                vtk_loge(errmsg);
-                return -1;
+        const char *names[] = { "conn", "list", "drop", "down", "stat", "transport", "limit" };
+        cmd_op_t    ops[]   = { CMD_NET_CONN, CMD_NET_LIST, CMD_NET_DROP, CMD_NET_DOWN, CMD_NET_STAT,
+                                CMD_NET_TRANSPORT, CMD_NET_LIMIT };
+        for (int i = 0; args[1] && (i < sizeof(ops) / sizeof(ops[0])); i++) {
+            if (strcasecmp(args[1], names[i]) == 0) {
+                cmd.op = ops[i];
             }
-            return vtk_net_set(state->vtk, VTK_NET_CONNECTED, 0, args[2], args[3]);
         }
+        argmin = ((cmd.op == CMD_NET_CONN) || (cmd.op == CMD_NET_LIST) || (cmd.op == CMD_NET_TRANSPORT)) ? 3 :
+                 (cmd.op == CMD_NET_LIMIT) ? 4 : 2;
 
-        if (args[1] && (strcasecmp(args[1], "list") == 0)) {
-            if (! args[2] || ! args[3]) {
-                vtk_loge(errmsg);
-                return -1;
+    } else if (strcasecmp(args[0], "msg") == 0) {
+        /*
+         * message commands
+         */
+        const char *names[] = { "reset", "addstr", "addhex", "addfile", "print", "printhex", "send" };
+        cmd_op_t    ops[]   = { CMD_MSG_RESET, CMD_MSG_ADDSTR, CMD_MSG_ADDHEX, CMD_MSG_ADDFILE,
+                                CMD_MSG_PRINT, CMD_MSG_PRINTHEX, CMD_MSG_SEND };
+        for (int i = 0; args[1] && (i < sizeof(ops) / sizeof(ops[0])); i++) {
+            if (strcasecmp(args[1], names[i]) == 0) {
+                cmd.op = ops[i];
             }
-            return vtk_net_set(state->vtk, VTK_NET_LISTENED, 0, args[2], args[3]);
         }
-
-        if (args[1] && (strcasecmp(args[1], "drop") == 0)) {
-            if (VTK_NET_IS_ACCEPTED(vtk_net_get_state(state->vtk))) {
-                return vtk_net_set(state->vtk, VTK_NET_LISTENED, 0, NULL, NULL);
+        int addop = (cmd.op == CMD_MSG_ADDSTR) || (cmd.op == CMD_MSG_ADDHEX) || (cmd.op == CMD_MSG_ADDFILE);
+        argmin    = addop ? 4 : 2;
+
+        if ((cmd.op == CMD_MSG_RESET) && args[2]) {
+            if (strcasecmp(args[2], "VMC") == 0) {
+                cmd.num = VTK_BASE_VMC;
+            } else if (strcasecmp(args[2], "POS") == 0) {
+                cmd.num = VTK_BASE_POS;
             } else {
-                return vtk_net_set(state->vtk, VTK_NET_DOWN, 0, NULL, NULL);
+                cmd.op = CMD_NONE;
             }
         }
-        if (args[1] && (strcasecmp(args[1], "down") == 0)) {
-            return vtk_net_set(state->vtk, VTK_NET_DOWN, 0, NULL, NULL);
+        if (addop && args[2] && (sscanf(args[2], "%hx", &cmd.id) != 1)) {
+            cmd.op = CMD_NONE;
         }
-        if (args[1] && (strcasecmp(args[1], "stat") == 0)) {
-            vtk_logi("current state: %s", vtk_net_stringify(vtk_net_get_state(state->vtk)));
-            return 0;
+
+    } else if (strcasecmp(args[0], "status") == 0) {
+        cmd.op = CMD_STATUS;
+
+    } else if (strcasecmp(args[0], "telemetry") == 0) {
+        cmd.op = CMD_TELEMETRY;
+        argmin = 2;
+
+    } else if (strcasecmp(args[0], "repeat") == 0) {
+        cmd.op = CMD_REPEAT;
+        argmin = 2;
+
+    } else if (strcasecmp(args[0], "end") == 0) {
+        cmd.op = CMD_END;
+
+    } else if (strcasecmp(args[0], "sleep") == 0) {
+        cmd.op = CMD_SLEEP;
+        argmin = 2;
+
+    } else if (strcasecmp(args[0], "expect") == 0) {
+        cmd.op  = CMD_EXPECT;
+        cmd.num = args[3] ? atol(args[3]) : EXPECT_DEFAULT_TM;
+        argmin  = 3;
+        if (args[1] && (sscanf(args[1], "%hx", &cmd.id) != 1)) {
+            cmd.op = CMD_NONE;
         }
 
+    } else if (strcasecmp(args[0], "timer") == 0) {
+        cmd.op = ! args[1]                          ? CMD_NONE :
+                 strcasecmp(args[1], "start") == 0  ? CMD_TIMER_START :
+                 strcasecmp(args[1], "report") == 0 ? CMD_TIMER_REPORT : CMD_NONE;
+
+    } else if (strcasecmp(args[0], "verbose") == 0) {
+        cmd.op = CMD_VERBOSE;
+        argmin = 2;
+    }
+
+    for (int i = 0; i < argmin; i++) {
+        cmd.op = args[i] ? cmd.op : CMD_NONE;
+    }
+    if (cmd.op == CMD_NONE) {
         vtk_loge(errmsg);
         return -1;
+    }
+    switch (cmd.op) {
+        case CMD_NET_CONN:
+        case CMD_NET_LIST:
+            cmd.arg[0] = strdup(args[2]);
+            cmd.arg[1] = args[3] ? strdup(args[3]) : NULL;
+            break;
+        case CMD_NET_TRANSPORT:
+            cmd.arg[0] = strdup(args[2]);
+            break;
+        case CMD_NET_LIMIT:
+            cmd.arg[0] = strdup(args[2]);
+            cmd.num    = atol(args[3]);
+            break;
+        case CMD_MSG_ADDSTR:
+        case CMD_MSG_ADDHEX:
+        case CMD_MSG_ADDFILE:
+            cmd.arg[0] = strdup(args[3]);
+            break;
+        case CMD_EXPECT:
+            cmd.arg[0] = strdup(args[2]);
+            break;
+        case CMD_STATUS:
+            cmd.arg[0] = strdup(args[1] ? args[1] : "/vendotek");
+            break;
+        case CMD_TELEMETRY:
+            cmd.arg[0] = strdup(args[1]);
+            break;
+        case CMD_REPEAT:
+        case CMD_SLEEP:
+        case CMD_VERBOSE:
+            cmd.num = atol(args[1]);
+            break;
+        default:
+            break;
+    }
 
-    } else if (args[0] && (strcasecmp(args[0], "msg") == 0)) {
-        /*
-         * message commands
-         */
-        if (args[1] && (strcasecmp(args[1], "reset") == 0)) {
-            uint16_t protocol = VTK_BASE_FROM_STATE(vtk_net_get_state(state->vtk));
-            if (args[2]) {
-                if (strcasecmp(args[2], "VMC") == 0) {
-                    protocol = VTK_BASE_VMC;
-                } else if (strcasecmp(args[2], "POS") == 0) {
-                    protocol = VTK_BASE_POS;
-                } else {
-                    vtk_loge(errmsg);
-                    return -1;
-                }
-            }
-            return vtk_msg_mod(state->msg_up, VTK_MSG_RESET, protocol, 0, NULL);
+    /* loops are resolved to jumps */
+    if (cmd.op == CMD_REPEAT) {
+        if (prog->nopen == sizeof(prog->open) / sizeof(prog->open[0])) {
+            vtk_loge("repeat blocks are nested too deep");
+            return -1;
+        }
+        prog->open[prog->nopen++] = prog->cnt;
+    }
+    if (cmd.op == CMD_END) {
+        if (! prog->nopen) {
+            vtk_loge("\"end\" without \"repeat\"");
+            return -1;
+        }
+        cmd.jump = prog->open[--prog->nopen];
+        prog->cmds[cmd.jump].jump = prog->cnt;
+    }
+    if (prog->cnt == prog->size) {
+        prog->size = prog->size ? prog->size * 2 : 64;
+        prog->cmds = realloc(prog->cmds, prog->size * sizeof(cmd_t));
+    }
+    prog->cmds[prog->cnt++] = cmd;
+    return 0;
+}
+
+int prog_compile_file(prog_t *prog, char *path, int depth)
+{
+    if (depth > MACRO_DEPTH) {
+        vtk_loge("macro %s: nested too deep", path);
+        return -1;
+    }
+    FILE *fin = fopen(path, "r");
+    if (! fin) {
+        vtk_loge("can't open %s macro file for read", path);
+        return -1;
+    }
+    char   *line   = NULL;
+    size_t  linesz = 0;
+    int     lineno = 0;
+    int     rc     = 0;
+
+    /* file name is kept for error messages */
+    char   *src    = strdup(path);
+    prog->srcs = realloc(prog->srcs, (prog->nsrcs + 1) * sizeof(char *));
+    prog->srcs[prog->nsrcs++] = src;
+
+    while ((rc == 0) && (getline(&line, &linesz, fin) > 0)) {
+        lineno++;
+        if ((rc = prog_compile(prog, line, src, lineno, depth)) < 0) {
+            vtk_loge("  at %s:%d", path, lineno);
         }
+    }
+    free(line);
+    fclose(fin);
+    return rc;
+}
 
-        if (args[1] && (strcasecmp(args[1], "addstr") == 0)) {
-            if (! args[2] || ! args[3]) {
-                vtk_loge(errmsg);
+void timer_lat_add(stopwatch_t *timer, uint64_t lat)
+{
+    if (timer->lat_cnt == timer->lat_size) {
+        timer->lat_size = timer->lat_size ? timer->lat_size * 2 : 1024;
+        timer->lat      = realloc(timer->lat, timer->lat_size * sizeof(uint64_t));
+    }
+    timer->lat[timer->lat_cnt++] = lat;
+}
+
+int timer_lat_cmp(const void *a, const void *b)
+{
+    uint64_t la = *(const uint64_t *)a, lb = *(const uint64_t *)b;
+    return (la > lb) - (la < lb);
+}
+
+void timer_report(stopwatch_t *timer)
+{
+    double seconds = (vtk_clock_ns() - timer->tstart) / 1e9;
+
+    vtk_logn("%.3f s: %zu messages sent, %zu received, %.1f messages/s",
+             seconds, timer->sent, timer->recv, seconds > 0 ? (timer->sent + timer->recv) / seconds : 0.0);
+    if (! timer->lat_cnt) {
+        return;
+    }
+    qsort(timer->lat, timer->lat_cnt, sizeof(uint64_t), timer_lat_cmp);
+
+    double sum = 0;
+    for (size_t i = 0; i < timer->lat_cnt; i++) {
+        sum += timer->lat[i];
+    }
+    vtk_logn("latency, us: min %.1f, avg %.1f, p50 %.1f, p99 %.1f, max %.1f (%zu responses)",
+             timer->lat[0] / 1e3, sum / timer->lat_cnt / 1e3,
+             timer->lat[timer->lat_cnt / 2] / 1e3, timer->lat[timer->lat_cnt * 99 / 100] / 1e3,
+             timer->lat[timer->lat_cnt - 1] / 1e3, timer->lat_cnt);
+}
+
+/* wait for the next message; it must carry the field with expected value */
+int do_expect(state_t *state, cmd_t *cmd)
+{
+    uint64_t deadline = vtk_clock_ns() + cmd->num * 1000000ull;
+    int      fleof    = 0;
+
+    for (;;) {
+        if (! VTK_NET_IS_ESTABLISHED(vtk_net_get_state(state->vtk))) {
+            vtk_loge("expect: no connection");
+            return -1;
+        }
+        if (! vtk_net_pending(state->vtk)) {
+            uint64_t now = vtk_clock_ns();
+            if (now >= deadline) {
+                vtk_loge("expect: timeout waiting for 0x%x = %s", cmd->id, cmd->arg[0]);
                 return -1;
             }
-            uint16_t id;
-            if (sscanf(args[2], "%0x%x", &id) < 1) {
-                vtk_loge(errmsg);
-                return -1;
+            struct pollfd pfd = {
+                .fd     = vtk_net_get_socket(state->vtk),
+                .events = POLLIN
+            };
+            if (vtk_poll(&pfd, 1, (deadline - now) / 1000000 + 1) <= 0) {
+                continue;
             }
-            return vtk_msg_mod(state->msg_up, VTK_MSG_ADDSTR, id, 0, args[3]);
         }
-
-        if (args[1] && (strcasecmp(args[1], "print") == 0)) {
-            return vtk_msg_print(state->msg_up);
+        int rrecv = vtk_net_recv(state->vtk, state->msg_down, &fleof);
+        if (rrecv < 0) {
+            return -1;
         }
+        if (rrecv > 0) {
+            break;
+        }
+        if (fleof) {
+            vtk_loge("expect: connection was closed");
+            return -1;
+        }
+    }
+    state->timer.recv++;
+    timer_lat_add(&state->timer, vtk_clock_ns() - state->timer.tsent);
+
+    char     *value = NULL;
+    uint16_t  len   = 0;
+    if ((vtk_msg_find_param(state->msg_down, cmd->id, &len, &value) < 0) ||
+        (len != strlen(cmd->arg[0])) || (memcmp(value, cmd->arg[0], len) != 0)) {
+        vtk_loge("expect: 0x%x = %s, received message is:", cmd->id, cmd->arg[0]);
+        vtk_msg_print(state->msg_down);
+        return -1;
+    }
+    return 0;
+}
 
-        if (args[1] && (strcasecmp(args[1], "printhex") == 0)) {
-            return vtk_msg_serialize(state->msg_up, &state->msg_stream_up);
+int prog_run(state_t *state, prog_t *prog)
+{
+    for (size_t pc = 0; pc < prog->cnt; pc++) {
+        cmd_t *cmd = &prog->cmds[pc];
 
+        switch (cmd->op) {
+        case CMD_NET_CONN:
+            vtk_net_set(state->vtk, VTK_NET_CONNECTED, 0, cmd->arg[0], cmd->arg[1]);
+            break;
+        case CMD_NET_LIST:
+            vtk_net_set(state->vtk, VTK_NET_LISTENED, 0, cmd->arg[0], cmd->arg[1]);
+            break;
+        case CMD_NET_DROP:
+            if (VTK_NET_IS_ACCEPTED(vtk_net_get_state(state->vtk))) {
+                vtk_net_set(state->vtk, VTK_NET_LISTENED, 0, NULL, NULL);
+            } else {
+                vtk_net_set(state->vtk, VTK_NET_DOWN, 0, NULL, NULL);
+            }
+            break;
+        case CMD_NET_DOWN:
+            vtk_net_set(state->vtk, VTK_NET_DOWN, 0, NULL, NULL);
+            break;
+        case CMD_NET_STAT:
+            vtk_logi("current state: %s", vtk_net_stringify(vtk_net_get_state(state->vtk)));
+            break;
+        case CMD_NET_TRANSPORT: {
+            const vtk_transport_t *transport = vtk_transport_find(cmd->arg[0]);
+            if (transport) {
+                vtk_net_set_transport(state->vtk, transport);
+            }
+            break;
+        }
+        case CMD_NET_LIMIT: {
+            vtk_limits_t limits;
+            vtk_net_get_limits(state->vtk, &limits);
+            if (strcasecmp(cmd->arg[0], "frame") == 0) {
+                limits.frame = cmd->num;
+            } else if (strcasecmp(cmd->arg[0], "args") == 0) {
+                limits.args = cmd->num;
+            } else if (strcasecmp(cmd->arg[0], "buffered") == 0) {
+                limits.buffered = cmd->num;
+            } else if (strcasecmp(cmd->arg[0], "parse") == 0) {
+                limits.parse_ns = cmd->num * 1000000ull;
+            } else {
+                vtk_loge("unknown limit: %s", cmd->arg[0]);
+                break;
+            }
+            vtk_net_set_limits(state->vtk, &limits);
+            break;
         }
 
-        if (args[1] && (strcasecmp(args[1], "send") == 0)) {
-
+        case CMD_MSG_RESET:
+            vtk_msg_mod(state->msg_up, VTK_MSG_RESET,
+                        cmd->num ? cmd->num : VTK_BASE_FROM_STATE(vtk_net_get_state(state->vtk)), 0, NULL);
+            break;
+        case CMD_MSG_ADDSTR:
+            vtk_msg_mod(state->msg_up, VTK_MSG_ADDSTR, cmd->id, 0, cmd->arg[0]);
+            break;
+        case CMD_MSG_ADDHEX:
+            vtk_msg_mod(state->msg_up, VTK_MSG_ADDHEX, cmd->id, 0, cmd->arg[0]);
+            break;
+        case CMD_MSG_ADDFILE:
+            vtk_msg_mod(state->msg_up, VTK_MSG_ADDFILE, cmd->id, 0, cmd->arg[0]);
+            break;
+        case CMD_MSG_PRINT:
+            vtk_msg_print(state->msg_up);
+            break;
+        case CMD_MSG_PRINTHEX:
+            vtk_msg_serialize(state->msg_up, &state->msg_stream_up);
+            break;
+        case CMD_MSG_SEND:
             if (vtk_net_send(state->vtk, state->msg_up) < 0) {
-                return -1;
+                break;
             }
+            state->timer.sent++;
+            state->timer.tsent = vtk_clock_ns();
             vtk_msg_mod(state->msg_up, VTK_MSG_RESET, VTK_BASE_FROM_STATE(vtk_net_get_state(state->vtk)), 0, NULL);
-            return 0;
-        }
-
-        vtk_loge(errmsg);
-        return -1;
+            break;
 
-    } else if (args[0] && (strcasecmp(args[0], "macro") == 0)) {
-        if (! args[1]) {
-            vtk_loge(errmsg);
-            return -1;
+        case CMD_STATUS: {
+            /*
+             * show terminals published on the shared memory status board
+             */
+            vtk_status_t *board;
+            if (vtk_status_open(&board, cmd->arg[0], 0) < 0) {
+                break;
+            }
+            for (int i = 0; i < vtk_status_slots(board); i++) {
+                vtk_status_rec_t rec;
+                if (vtk_status_read(board, i, &rec) < 0) {
+                    continue;
+                }
+                vtk_logi("%2d: %-24s pid %-6d %-9s sent: %-3s recv: %-3s opnum: %lld frames: %llu/%llu errors: %u %s",
+                         i, rec.terminal, rec.pid, vtk_net_stringify(rec.net_state), rec.stage, rec.reply,
+                         rec.opnum, rec.frames_tx, rec.frames_rx, rec.errors, rec.error);
+            }
+            vtk_status_close(board);
+            break;
         }
-        FILE *fin = fopen(args[1], "r");
-        if (! fin) {
-            vtk_loge("can't open %s macro file for read", args[1]);
-            return -1;
+
+        case CMD_TELEMETRY: {
+            /*
+             * show terminals kept in the fleet telemetry table
+             */
+            vtk_telemetry_t *table;
+            if (vtk_telemetry_open(&table, cmd->arg[0]) < 0) {
+                break;
+            }
+            for (size_t i = 0; i < vtk_telemetry_count(table); i++) {
+                vtk_trec_t rec;
+                if (vtk_telemetry_read(table, i, &rec) < 0) {
+                    continue;
+                }
+                char drift[24] = "unknown";
+                if (rec.drift_ms != VTK_DRIFT_UNKNOWN) {
+                    snprintf(drift, sizeof(drift), "%+lld ms", (long long)rec.drift_ms);
+                }
+                time_t seen = rec.time_seen / 1000000000ull, changed = rec.time_changed / 1000000000ull;
+                char   tseen[32] = "never", tchanged[32] = "never";
+                if (seen) {
+                    strftime(tseen, sizeof(tseen), "%Y-%m-%d %H:%M:%S", localtime(&seen));
+                }
+                if (changed) {
+                    strftime(tchanged, sizeof(tchanged), "%Y-%m-%d %H:%M:%S", localtime(&changed));
+                }
+                vtk_logi("%3lu: %-24s seen: %s changed: %s polls: %u failures: %u rtt: %u us drift: %s "
+                         "mgmt: %s time: %s info: %s",
+                         i, rec.terminal, tseen, tchanged, rec.polls, rec.failures, rec.rtt_us, drift,
+                         rec.mgmt, rec.localtime, rec.sysinfo);
+            }
+            vtk_telemetry_close(table);
+            break;
         }
-        char line[0xff];
-        line[sizeof(line) - 1] = 0;
 
-        while (fgets(line, sizeof(line) - 1, fin) > 0) {
-            /* drop trailing control characters */
-            if (! line[0] || (line[0] == '\n') || (line[0] == '#')) {
-                continue;
+        case CMD_REPEAT:
+            cmd->left = cmd->num;
+            if (cmd->left <= 0) {
+                pc = cmd->jump;
             }
-            user_action_ctrl(state, line);
+            break;
+        case CMD_END:
+            if (--prog->cmds[cmd->jump].left > 0) {
+                pc = cmd->jump;
+            }
+            break;
+        case CMD_SLEEP: {
+            struct timespec ts = { .tv_sec = cmd->num / 1000, .tv_nsec = (cmd->num % 1000) * 1000000 };
+            while ((nanosleep(&ts, &ts) < 0) && (errno == EINTR));
+            break;
         }
-        fclose(fin);
+        case CMD_EXPECT:
+            /* failed expectation stops the macro */
+            if (do_expect(state, cmd) < 0) {
+                if (cmd->src) {
+                    vtk_loge("macro is stopped at %s:%d", cmd->src, cmd->line);
+                }
+                return -1;
+            }
+            break;
+        case CMD_TIMER_START:
+            free(state->timer.lat);
+            state->timer = (stopwatch_t) {
+                .tstart = vtk_clock_ns(),
+                .tsent  = vtk_clock_ns()
+            };
+            break;
+        case CMD_TIMER_REPORT:
+            timer_report(&state->timer);
+            break;
+        case CMD_VERBOSE:
+            vtk_logline_set(NULL, cmd->num);
+            break;
+        default:
+            break;
+        }
+    }
+    return 0;
+}
 
-    } else {
-        vtk_loge(errmsg);
-        return -1;
+int user_action_ctrl(state_t *state, char *action)
+{
+    prog_t prog = {0};
+    int    rc   = prog_compile(&prog, action, NULL, 0, 0);
+
+    if ((rc == 0) && prog.nopen) {
+        vtk_loge("\"repeat\" without \"end\"");
+        rc = -1;
+    }
+    if (rc == 0) {
+        rc = prog_run(state, &prog);
     }
+    prog_free(&prog);
+    return rc;
+}
 
+/* returns 1 on quit */
+int user_line(state_t *state, char *buff)
+{
+    /* drop trailing control characters */
+    int bufflen = strlen(buff);
+    for (int ic = bufflen; (ic > 0) && iscntrl(buff[ic - 1]); ic--) {
+        bufflen = ic - 1;
+        buff[bufflen] = 0;
+    }
+    if (! bufflen) {
+        return 0;
+    }
+
+    /* process basic commands here */
+    if (strcasecmp(buff, "help") == 0) {
+        show_help();
+        return 0;
+    }
+    if (strcasecmp(buff, "quit") == 0) {
+        return 1;
+    }
+    /* care about most actions here */
+    user_action_ctrl(state, buff);
     return 0;
 }
 
@@ -195,6 +691,8 @@ int main_loop_run(state_t *state)
     const int in_sock = 1;
 
     struct pollfd spool[2] = {0};
+    char          term[0x1000];
+    size_t        termlen = 0;
 
     spool[in_term].fd     = fileno(stdin);
     spool[in_term].events = POLLIN;
@@ -211,36 +709,32 @@ int main_loop_run(state_t *state)
             vtk_loge("IO error on poll syscall: %s", strerror(errno));
             break;
         }
-        if (spool[in_term].revents == POLLIN) {
-            /* terminal input has some bytes */
-            char buff[0x100];
-            int  bufflen = read(spool[in_term].fd, buff, sizeof(buff) - 1);
+        if (spool[in_term].revents & (POLLIN | POLLHUP)) {
+            /* terminal input has some bytes; piped input may bring several lines at once */
+            int bufflen = read(spool[in_term].fd, &term[termlen], sizeof(term) - 1 - termlen);
 
             if (bufflen <= 0) {
-                vtk_loge("IO error on read syscall: %s", strerror(errno));
                 break;
             }
-            buff[bufflen] = 0;
-
-            /* drop trailing control characters */
-            for (int ic = bufflen; (ic > 0) && iscntrl(buff[ic - 1]); ic--) {
-                bufflen = ic - 1;
-                buff[bufflen] = 0;
+            termlen += bufflen;
+            term[termlen] = 0;
+
+            char *line = term, *eol;
+            int   quit = 0;
+            while (! quit && (eol = strchr(line, '\n'))) {
+                *eol = 0;
+                quit = user_line(state, line);
+                line = eol + 1;
             }
-            if (! bufflen) {
-                continue;
+            termlen -= line - term;
+            memmove(term, line, termlen + 1);
+            if (termlen == sizeof(term) - 1) {
+                vtk_loge("command is too long");
+                termlen = 0;
             }
-
-            /* process basic commands here */
-            if (strcasecmp(buff, "help") == 0) {
-                show_help();
-                continue;
-            }
-            if (strcasecmp(buff, "quit") == 0) {
+            if (quit) {
                 break;
             }
-            /* care about most actions here */
-            user_action_ctrl(state, buff);
         }
 
         if (spool[in_sock].revents == POLLIN) {
@@ -256,11 +750,15 @@ int main_loop_run(state_t *state)
                  * check for incoming data
                  */
                 int fleof = 0;
-                int rcode = vtk_net_recv(state->vtk, state->msg_down, &fleof);
+                int rcode = 0;
+                do {
+                    rcode = vtk_net_recv(state->vtk, state->msg_down, &fleof);
+                    if (rcode > 0) {
+                        state->timer.recv++;
+                        vtk_msg_print(state->msg_down);
+                    }
+                } while ((rcode > 0) && vtk_net_pending(state->vtk));
 
-                if (rcode >= 0) {
-                    vtk_msg_print(state->msg_down);
-                }
                 if (fleof) {
                     vtk_net_t nstate = vtk_net_get_state(state->vtk);
                     vtk_logi("EOF was found on %s socket. Close it", vtk_net_stringify(nstate));
@@ -275,14 +773,20 @@ int main_loop_run(state_t *state)
 int main(int argc, char *argv[])
 {
     state_t state = {0};
-    vtk_init(&state.vtk);
-    vtk_msg_init(&state.msg_up, state.vtk);
-    vtk_msg_init(&state.msg_down, state.vtk);
+    if (vtk_init(&state.vtk) < 0) {
+        return 1;
+    }
+    if ((vtk_msg_init(&state.msg_up, state.vtk) < 0) || (vtk_msg_init(&state.msg_down, state.vtk) < 0)) {
+        vtk_msg_free(state.msg_up);
+        vtk_free(state.vtk);
+        return 1;
+    }
 
     main_loop_run(&state);
 
-    free(state.msg_stream_up.data);
-    free(state.msg_stream_down.data);
+    vtk_mem_free(state.msg_stream_up.data);
+    vtk_mem_free(state.msg_stream_down.data);
+    free(state.timer.lat);
     vtk_msg_free(state.msg_up);
     vtk_msg_free(state.msg_down);
     vtk_free(state.vtk);
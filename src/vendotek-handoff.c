@@ -0,0 +1,293 @@
+#define _GNU_SOURCE  /* struct ucred, accept4() */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "vendotek.h"
+
+/*
+ * Hot restart handoff
+ *
+ * The old process sends a header with all the descriptors attached (session ones first), then
+ * the session state and the application state. The new one adopts the session and acks it;
+ * the old one commits and detaches. Until the commit the new process doesn't touch the session,
+ * so the old one may take it back on any failure.
+ */
+#define HANDOFF_MAGIC   0x564B4831  /* "VKH1" */
+#define HANDOFF_ACK     'A'
+#define HANDOFF_COMMIT  'C'
+
+typedef struct handoff_hdr_s {
+    uint32_t   magic;
+    uint32_t   nsess;      /* session descriptors */
+    uint32_t   nfds;       /* application descriptors, after the session ones */
+    uint32_t   reserved;
+    uint64_t   state;      /* bytes of the session state */
+    uint64_t   app;        /* bytes of the application state */
+} handoff_hdr_t;
+
+#define HANDOFF_MAXFDS  (VTK_NET_EXPORT_FDS + VTK_HANDOFF_FDS)
+
+static int
+handoff_addr(struct sockaddr_un *sun, const char *path)
+{
+    memset(sun, 0, sizeof(*sun));
+    sun->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun->sun_path)) {
+        vtk_loge("%s %s", "Bad socket path:", path);
+        return -1;
+    }
+    strcpy(sun->sun_path, path);
+    return 0;
+}
+
+/* the other side must run as the same user, and waits for it are bounded */
+static int
+handoff_peer(int usock)
+{
+    struct ucred   cred;
+    socklen_t      credlen = sizeof(cred);
+    struct timeval tv      = { .tv_sec = VTK_HANDOFF_TM / 1000, .tv_usec = VTK_HANDOFF_TM % 1000 * 1000 };
+
+    if (getsockopt(usock, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) < 0) {
+        vtk_loge("Can't get handoff peer credentials: %s", strerror(errno));
+        return -1;
+    }
+    if (cred.uid != geteuid()) {
+        vtk_loge("Handoff peer (pid %d) runs as another user (uid %d)", cred.pid, cred.uid);
+        return -1;
+    }
+    setsockopt(usock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(usock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    return 0;
+}
+
+static int
+handoff_write(int usock, const void *data, size_t len)
+{
+    for (size_t done = 0; done < len; ) {
+        ssize_t wresult = send(usock, (const char *)data + done, len - done, MSG_NOSIGNAL);
+        if ((wresult < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (wresult <= 0) {
+            vtk_loge("Handoff socket error: %s", wresult < 0 ? strerror(errno) : "closed");
+            return -1;
+        }
+        done += wresult;
+    }
+    return 0;
+}
+
+static int
+handoff_read(int usock, void *data, size_t len)
+{
+    for (size_t done = 0; done < len; ) {
+        ssize_t rresult = recv(usock, (char *)data + done, len - done, 0);
+        if ((rresult < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (rresult <= 0) {
+            vtk_loge("Handoff socket error: %s", rresult < 0 ? strerror(errno) : "closed by peer");
+            return -1;
+        }
+        done += rresult;
+    }
+    return 0;
+}
+
+int vtk_handoff_listen(const char *path)
+{
+    struct sockaddr_un sun;
+    if (handoff_addr(&sun, path) < 0) {
+        return -1;
+    }
+    int lsock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (lsock < 0) {
+        vtk_loge("%s %s", "Can't create socket:", strerror(errno));
+        return -1;
+    }
+    /* the path is taken over from the previous process, its listener is no longer needed */
+    unlink(path);
+    mode_t umask_prev = umask(0077);
+    int    rbind      = bind(lsock, (struct sockaddr *)&sun, sizeof(sun));
+    umask(umask_prev);
+    if ((rbind < 0) || (listen(lsock, 1) < 0)) {
+        vtk_loge("Can't listen for handoff on %s: %s", path, strerror(errno));
+        close(lsock);
+        return -1;
+    }
+    vtk_logi("Waiting for handoff requests on %s", path);
+    return lsock;
+}
+
+int vtk_handoff_accept(int lsock)
+{
+    int usock = accept4(lsock, NULL, NULL, SOCK_CLOEXEC);
+    if (usock < 0) {
+        vtk_loge("Can't accept handoff request: %s", strerror(errno));
+    }
+    return usock;
+}
+
+int vtk_handoff_connect(const char *path)
+{
+    struct sockaddr_un sun;
+    if (handoff_addr(&sun, path) < 0) {
+        return -1;
+    }
+    int usock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (usock < 0) {
+        vtk_loge("%s %s", "Can't create socket:", strerror(errno));
+        return -1;
+    }
+    if (connect(usock, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+        vtk_loge("Can't connect for handoff to %s: %s", path, strerror(errno));
+        close(usock);
+        return -1;
+    }
+    return usock;
+}
+
+int vtk_handoff_send(int usock, vtk_t *vtk, const int *fds, int nfds, const void *app, size_t len)
+{
+    if ((nfds < 0) || (nfds > VTK_HANDOFF_FDS)) {
+        vtk_loge("Too many descriptors to hand off, %d is maximum", VTK_HANDOFF_FDS);
+        return -1;
+    }
+    if (handoff_peer(usock) < 0) {
+        return -1;
+    }
+    vtk_stream_t state = {0};
+    int          sfds[HANDOFF_MAXFDS];
+    int          nsess;
+    if (vtk_net_export(vtk, &state, sfds, &nsess) < 0) {
+        return -1;
+    }
+    memcpy(&sfds[nsess], fds, nfds * sizeof(int));
+
+    handoff_hdr_t hdr = {
+        .magic = HANDOFF_MAGIC,
+        .nsess = nsess,
+        .nfds  = nfds,
+        .state = state.len,
+        .app   = len
+    };
+    union {
+        char           buf[CMSG_SPACE(sizeof(sfds))];
+        struct cmsghdr align;
+    } control;
+    struct iovec  iov    = { .iov_base = &hdr, .iov_len = sizeof(hdr) };
+    struct msghdr msghdr = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = control.buf,
+        .msg_controllen = CMSG_SPACE((nsess + nfds) * sizeof(int))
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msghdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN((nsess + nfds) * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), sfds, (nsess + nfds) * sizeof(int));
+
+    char reply = 0;
+    int  rc    = -1;
+    if (sendmsg(usock, &msghdr, MSG_NOSIGNAL) != sizeof(hdr)) {
+        vtk_loge("Can't send session descriptors: %s", strerror(errno));
+    } else if ((handoff_write(usock, state.data, state.len) >= 0) && (handoff_write(usock, app, len) >= 0) &&
+               (handoff_read(usock, &reply, 1) >= 0)) {
+        if (reply != HANDOFF_ACK) {
+            vtk_loge("New process refused the session");
+        } else {
+            rc = handoff_write(usock, &(char) { HANDOFF_COMMIT }, 1);
+        }
+    }
+    vtk_mem_free(state.data);
+    if (rc < 0) {
+        vtk_logw("Session is not handed off, it goes on here");
+        return -1;
+    }
+    vtk_net_detach(vtk);
+    vtk_logn("Session is handed off to the new process");
+    return 0;
+}
+
+int vtk_handoff_recv(int usock, vtk_t *vtk, int *fds, int *nfds, void **app, size_t *len)
+{
+    if (handoff_peer(usock) < 0) {
+        return -1;
+    }
+    handoff_hdr_t hdr;
+    union {
+        char           buf[CMSG_SPACE(HANDOFF_MAXFDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec  iov    = { .iov_base = &hdr, .iov_len = sizeof(hdr) };
+    struct msghdr msghdr = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = control.buf,
+        .msg_controllen = sizeof(control.buf)
+    };
+    ssize_t rresult = recvmsg(usock, &msghdr, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    if (rresult != sizeof(hdr)) {
+        vtk_loge("Can't receive handoff: %s", rresult < 0 ? strerror(errno) : "closed by peer");
+        return -1;
+    }
+    int sfds[HANDOFF_MAXFDS], nrecv = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msghdr); cmsg; cmsg = CMSG_NXTHDR(&msghdr, cmsg)) {
+        if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS)) {
+            nrecv = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(sfds, CMSG_DATA(cmsg), nrecv * sizeof(int));
+        }
+    }
+
+    char *state = NULL;
+    int   rc    = -1;
+    *app = NULL;
+    *len = 0;
+    if ((hdr.magic != HANDOFF_MAGIC) || (msghdr.msg_flags & MSG_CTRUNC) || (hdr.nfds > VTK_HANDOFF_FDS) ||
+        (nrecv != hdr.nsess + hdr.nfds)) {
+        vtk_loge("Bad handoff from the running process");
+    } else {
+        state = vtk_mem_alloc(hdr.state);
+        *app  = hdr.app ? vtk_mem_alloc(hdr.app) : NULL;
+        if (state && (*app || ! hdr.app) &&
+            (handoff_read(usock, state, hdr.state) >= 0) && (handoff_read(usock, *app, hdr.app) >= 0)) {
+            rc = vtk_net_import(vtk, state, hdr.state, sfds, hdr.nsess);
+        }
+    }
+    vtk_mem_free(state);
+    if (rc < 0) {
+        for (int i = 0; i < nrecv; i++) {
+            close(sfds[i]);
+        }
+        vtk_mem_free(*app);
+        *app = NULL;
+        handoff_write(usock, &(char) { 0 }, 1);
+        return -1;
+    }
+
+    /* the session is used only after the old process has let it go */
+    char commit = 0;
+    if ((handoff_write(usock, &(char) { HANDOFF_ACK }, 1) < 0) || (handoff_read(usock, &commit, 1) < 0) ||
+        (commit != HANDOFF_COMMIT)) {
+        vtk_loge("Running process didn't hand the session off");
+        vtk_net_detach(vtk);
+        for (int i = hdr.nsess; i < nrecv; i++) {
+            close(sfds[i]);
+        }
+        vtk_mem_free(*app);
+        *app = NULL;
+        return -1;
+    }
+    memcpy(fds, &sfds[hdr.nsess], hdr.nfds * sizeof(int));
+    *nfds = hdr.nfds;
+    *len  = hdr.app;
+    return 0;
+}
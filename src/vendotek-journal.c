@@ -0,0 +1,398 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vendotek.h"
+
+/*
+ * Payment journal
+ *
+ * Append-only file of fixed-size checksummed records, one per payment state transition.
+ * Appends of concurrent sessions are made durable by a shared fdatasync (group commit):
+ * the first waiter syncs everything written so far, the others just wait for it.
+ * At open the file is scanned through mmap, torn tail is cut off, and transactions
+ * without final state are collected for reconciliation. Journal is compacted at open
+ * when it is large, so recovery time doesn't depend on the payment history length;
+ * open and unresolved transactions are kept.
+ */
+#define JOURNAL_MAGIC     0x4A4B5456   /* "VTKJ" */
+#define JOURNAL_MARKER    0x4D4B5456   /* "VTKM", compaction marker: txid is the last one issued */
+#define JOURNAL_COMPACT   4096         /* records; journal is compacted at open above it */
+
+typedef struct journal_rec_s {
+    uint32_t    magic;
+    uint32_t    crc;        /* crc32 of seq and payload */
+    uint64_t    seq;
+    vtk_jrec_t  rec;
+} journal_rec_t;
+
+struct vtk_journal_s {
+    char            *path;
+    int              fd;
+    pthread_mutex_t  lock;
+    pthread_cond_t   synced_cond;
+    uint64_t         seq_written;
+    uint64_t         seq_synced;
+    int              syncing;
+    uint64_t         txid_last;
+    uint64_t         fsyncs;
+
+    vtk_jrec_t      *pending;      /* open transactions found at open, then unresolved ones */
+    size_t           pending_cnt;
+    size_t           kept_cnt;     /* open and unresolved, rewritten by compaction */
+};
+
+static uint32_t
+journal_crc32(const void *data, size_t len, uint32_t crc)
+{
+    static uint32_t table[256];
+    static int      table_ready;
+
+    if (! table_ready) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+            }
+            table[i] = c;
+        }
+        table_ready = 1;
+    }
+    const uint8_t *bytes = data;
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = table[(crc ^ bytes[i]) & 255] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static uint32_t
+journal_rec_crc(journal_rec_t *jrec)
+{
+    return journal_crc32(&jrec->seq, sizeof(*jrec) - offsetof(journal_rec_t, seq), 0);
+}
+
+char *vtk_journal_stringify(vtk_jstate_t state)
+{
+    switch(state) {
+        case VTK_JOURNAL_VRP:      return "VRP";
+        case VTK_JOURNAL_APPROVED: return "APPROVED";
+        case VTK_JOURNAL_FIN:      return "FIN";
+        case VTK_JOURNAL_DONE:     return "DONE";
+        case VTK_JOURNAL_FAILED:   return "FAILED";
+        case VTK_JOURNAL_UNRESOLVED: return "UNRESOLVED";
+        default:                   return "UNKNOWN";
+    }
+}
+
+/*
+ * recovery; the scan hash is sized by the journal length and lives for the scan only,
+ * so it comes from the heap rather than the library allocator (e.g. a static pool)
+ */
+typedef struct journal_scan_s {
+    vtk_jrec_t  *recs;      /* open addressing hash by txid, latest record per transaction */
+    size_t       size;
+    size_t       cnt;
+} journal_scan_t;
+
+static int
+journal_scan_put(journal_scan_t *scan, vtk_jrec_t *rec)
+{
+    if ((scan->cnt + 1) * 2 > scan->size) {
+        journal_scan_t grown = { .size = scan->size ? scan->size * 2 : 1024 };
+        grown.recs = calloc(grown.size, sizeof(vtk_jrec_t));
+        if (! grown.recs) {
+            return -1;
+        }
+        for (size_t i = 0; i < scan->size; i++) {
+            if (scan->recs[i].txid) {
+                journal_scan_put(&grown, &scan->recs[i]);
+            }
+        }
+        free(scan->recs);
+        *scan = grown;
+    }
+    size_t i = (rec->txid * 0x9E3779B97F4A7C15ull) & (scan->size - 1);
+    for (; scan->recs[i].txid && (scan->recs[i].txid != rec->txid); i = (i + 1) & (scan->size - 1));
+
+    scan->cnt += ! scan->recs[i].txid;
+    scan->recs[i] = *rec;
+    return 0;
+}
+
+static int
+journal_is_final(vtk_jstate_t state)
+{
+    return (state == VTK_JOURNAL_DONE) || (state == VTK_JOURNAL_FAILED) || (state == VTK_JOURNAL_UNRESOLVED);
+}
+
+static int
+journal_write_all(int fd, const void *data, size_t len)
+{
+    const char *cdata = data;
+    while (len) {
+        ssize_t wresult = write(fd, cdata, len);
+        if ((wresult < 0) && (errno == EINTR)) {
+            continue;
+        } else if (wresult <= 0) {
+            return -1;
+        }
+        cdata += wresult;
+        len   -= wresult;
+    }
+    return 0;
+}
+
+/* the renamed file is durable only once its directory entry is */
+static int
+journal_sync_dir(const char *path)
+{
+    char  dir[4096];
+    char *slash = strrchr(path, '/');
+    snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - path) + 1 : 1, slash ? path : ".");
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+/* rewrite journal with open and unresolved transactions only */
+static int
+journal_compact(vtk_journal_t *journal)
+{
+    char tmppath[4096];
+    snprintf(tmppath, sizeof(tmppath), "%s.compact", journal->path);
+
+    int fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return -1;
+    }
+    /*
+     * the marker goes first and keeps the last transaction id, so ids are never reused;
+     * it isn't a transaction record and can't hide the kept ones
+     */
+    journal_rec_t jrec = { .magic = JOURNAL_MARKER, .rec = { .txid = journal->txid_last } };
+    int           rc   = 0;
+
+    for (size_t i = 0; (i <= journal->kept_cnt) && (rc == 0); i++) {
+        if (i) {
+            jrec.magic = JOURNAL_MAGIC;
+            jrec.rec   = journal->pending[i - 1];
+        }
+        jrec.seq = i + 1;
+        jrec.crc = journal_rec_crc(&jrec);
+        rc = journal_write_all(fd, &jrec, sizeof(jrec));
+    }
+    if ((rc < 0) || (fsync(fd) < 0) || (rename(tmppath, journal->path) < 0)) {
+        close(fd);
+        unlink(tmppath);
+        return -1;
+    }
+    close(fd);
+    if (journal_sync_dir(journal->path) < 0) {
+        vtk_logw("Journal %s: can't sync directory: %s", journal->path, strerror(errno));
+    }
+    journal->seq_written = journal->seq_synced = journal->kept_cnt + 1;
+    return 0;
+}
+
+static int
+journal_recover(vtk_journal_t *journal)
+{
+    struct stat st;
+    if (fstat(journal->fd, &st) < 0) {
+        return -1;
+    }
+    size_t nrecs = st.st_size / sizeof(journal_rec_t);
+    size_t valid = 0;
+
+    if (nrecs) {
+        journal_rec_t *map = mmap(NULL, nrecs * sizeof(journal_rec_t), PROT_READ, MAP_PRIVATE, journal->fd, 0);
+        if (map == MAP_FAILED) {
+            vtk_loge("Can't map journal %s: %s", journal->path, strerror(errno));
+            return -1;
+        }
+        madvise(map, nrecs * sizeof(journal_rec_t), MADV_SEQUENTIAL);
+
+        journal_scan_t scan = {0};
+        for (; valid < nrecs; valid++) {
+            journal_rec_t *jrec = &map[valid];
+            if (((jrec->magic != JOURNAL_MAGIC) && (jrec->magic != JOURNAL_MARKER)) ||
+                (jrec->crc != journal_rec_crc(jrec))) {
+                break;
+            }
+            if ((jrec->magic == JOURNAL_MAGIC) && (journal_scan_put(&scan, &jrec->rec) < 0)) {
+                vtk_loge("Journal %s: no memory to scan %lu records", journal->path, nrecs);
+                munmap(map, nrecs * sizeof(journal_rec_t));
+                free(scan.recs);
+                return -1;
+            }
+            journal->seq_written = jrec->seq;
+            journal->txid_last   = jrec->rec.txid > journal->txid_last ? jrec->rec.txid : journal->txid_last;
+        }
+        munmap(map, nrecs * sizeof(journal_rec_t));
+
+        journal->pending = vtk_mem_alloc(sizeof(vtk_jrec_t) * (scan.cnt ? scan.cnt : 1));
+        if (! journal->pending) {
+            free(scan.recs);
+            return -1;
+        }
+        for (size_t i = 0; i < scan.size; i++) {
+            if (scan.recs[i].txid && ! journal_is_final(scan.recs[i].state)) {
+                journal->pending[journal->pending_cnt++] = scan.recs[i];
+            }
+        }
+        journal->kept_cnt = journal->pending_cnt;
+        for (size_t i = 0; i < scan.size; i++) {
+            if (scan.recs[i].txid && (scan.recs[i].state == VTK_JOURNAL_UNRESOLVED)) {
+                journal->pending[journal->kept_cnt++] = scan.recs[i];
+            }
+        }
+        free(scan.recs);
+    }
+    if (valid * sizeof(journal_rec_t) != st.st_size) {
+        vtk_logw("Journal %s: torn tail is dropped after %lu records", journal->path, valid);
+        if (ftruncate(journal->fd, valid * sizeof(journal_rec_t)) < 0) {
+            return -1;
+        }
+    }
+    journal->seq_synced = journal->seq_written;
+
+    if (valid > JOURNAL_COMPACT) {
+        if (journal_compact(journal) < 0) {
+            vtk_logw("Journal %s: can't compact: %s", journal->path, strerror(errno));
+        } else {
+            close(journal->fd);
+            journal->fd = open(journal->path, O_WRONLY | O_APPEND | O_CLOEXEC);
+            return journal->fd < 0 ? -1 : 0;
+        }
+    }
+    return 0;
+}
+
+int vtk_journal_open(vtk_journal_t **journal, const char *path)
+{
+    *journal  = vtk_mem_alloc(sizeof(vtk_journal_t));
+    if (! *journal) {
+        return -1;
+    }
+    **journal = (vtk_journal_t) {
+        .path = vtk_mem_strdup(path),
+        .fd   = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600)
+    };
+    pthread_mutex_init(&(*journal)->lock, NULL);
+    pthread_cond_init(&(*journal)->synced_cond, NULL);
+
+    uint64_t tstart = vtk_clock_ns();
+    if (! (*journal)->path || ((*journal)->fd < 0) || (journal_recover(*journal) < 0)) {
+        vtk_loge("Can't open journal %s: %s", path, strerror(errno));
+        vtk_journal_close(*journal);
+        *journal = NULL;
+        return -1;
+    }
+    vtk_logi("Journal %s: %lu open transactions, recovered in %.3f ms",
+             path, (*journal)->pending_cnt, (vtk_clock_ns() - tstart) / 1e6);
+    if ((*journal)->kept_cnt > (*journal)->pending_cnt) {
+        vtk_logw("Journal %s: %lu unresolved transactions wait for the operator",
+                 path, (*journal)->kept_cnt - (*journal)->pending_cnt);
+    }
+    return 0;
+}
+
+void vtk_journal_close(vtk_journal_t *journal)
+{
+    if (! journal) {
+        return;
+    }
+    if (journal->fd >= 0) {
+        close(journal->fd);
+    }
+    pthread_mutex_destroy(&journal->lock);
+    pthread_cond_destroy(&journal->synced_cond);
+    vtk_mem_free(journal->pending);
+    vtk_mem_free(journal->path);
+    vtk_mem_free(journal);
+}
+
+uint64_t vtk_journal_txid(vtk_journal_t *journal)
+{
+    pthread_mutex_lock(&journal->lock);
+    uint64_t txid = ++journal->txid_last;
+    pthread_mutex_unlock(&journal->lock);
+    return txid;
+}
+
+int vtk_journal_append(vtk_journal_t *journal, vtk_jrec_t *rec)
+{
+    journal_rec_t jrec = {
+        .magic = JOURNAL_MAGIC,
+        .rec   = *rec
+    };
+    if (! jrec.rec.time) {
+        jrec.rec.time = (uint64_t)time(NULL);
+    }
+    pthread_mutex_lock(&journal->lock);
+
+    jrec.seq = journal->seq_written + 1;
+    jrec.crc = journal_rec_crc(&jrec);
+    if (journal_write_all(journal->fd, &jrec, sizeof(jrec)) < 0) {
+        pthread_mutex_unlock(&journal->lock);
+        vtk_loge("Journal %s: write error: %s", journal->path, strerror(errno));
+        return -1;
+    }
+    journal->seq_written = jrec.seq;
+
+    /* group commit: one fdatasync covers every record written before it started */
+    int rc = 0;
+    while ((journal->seq_synced < jrec.seq) && (rc == 0)) {
+        if (journal->syncing) {
+            pthread_cond_wait(&journal->synced_cond, &journal->lock);
+            continue;
+        }
+        uint64_t target = journal->seq_written;
+        journal->syncing = 1;
+        pthread_mutex_unlock(&journal->lock);
+
+        rc = fdatasync(journal->fd);
+
+        pthread_mutex_lock(&journal->lock);
+        journal->syncing = 0;
+        journal->fsyncs++;
+        if (rc == 0) {
+            journal->seq_synced = target;
+        }
+        pthread_cond_broadcast(&journal->synced_cond);
+    }
+    pthread_mutex_unlock(&journal->lock);
+
+    if (rc < 0) {
+        vtk_loge("Journal %s: sync error: %s", journal->path, strerror(errno));
+    }
+    return rc;
+}
+
+int vtk_journal_pending(vtk_journal_t *journal, vtk_jrec_t **recs, size_t *cnt)
+{
+    *recs = journal->pending;
+    *cnt  = journal->pending_cnt;
+    return 0;
+}
+
+uint64_t vtk_journal_fsyncs(vtk_journal_t *journal)
+{
+    pthread_mutex_lock(&journal->lock);
+    uint64_t fsyncs = journal->fsyncs;
+    pthread_mutex_unlock(&journal->lock);
+    return fsyncs;
+}
@@ -0,0 +1,323 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "vendotek.h"
+
+/*
+ * Metrics
+ *
+ * Every thread owns a private block of counters and histograms, so the hot path
+ * is a handful of relaxed stores without any locking or cache line sharing.
+ * Blocks are pushed once into a lock-free list; a snapshot sums all of them.
+ */
+
+/*
+ * HDR-style histogram: values below 2^VTK_HIST_SUBBITS+1 have own bucket, larger values
+ * are grouped by power of two with 2^VTK_HIST_SUBBITS linear sub-buckets (~12% precision)
+ */
+#define VTK_HIST_SUBBITS   3
+#define VTK_HIST_SUBCNT    (1 << VTK_HIST_SUBBITS)
+#define VTK_HIST_LINEAR    (VTK_HIST_SUBCNT * 2)
+#define VTK_HIST_MAXEXP    40
+#define VTK_HIST_BUCKETS   (VTK_HIST_LINEAR + (VTK_HIST_MAXEXP - VTK_HIST_SUBBITS) * VTK_HIST_SUBCNT)
+
+typedef struct vtk_hist_s {
+    uint64_t   count;
+    uint64_t   fails;
+    uint64_t   sum;
+    uint64_t   buckets[VTK_HIST_BUCKETS];
+} vtk_hist_t;
+
+typedef struct vtk_metrics_blk_s {
+    struct vtk_metrics_blk_s *next;
+    uint64_t                  counters[VTK_COUNTER_MAX];
+    vtk_hist_t                hists[VTK_METRIC_MAX];
+} vtk_metrics_blk_t;
+
+static vtk_metrics_blk_t          *vtk_metrics_list;
+static __thread vtk_metrics_blk_t *vtk_metrics_tls;
+
+static struct vtk_metric_desc_s {
+    const char *name;
+    const char *help;
+    int         is_time;
+} vtk_metric_desc[VTK_METRIC_MAX] = {
+    [VTK_METRIC_CONNECT]        = { "vtk_connect_seconds",         "Time to establish POS connection",           1 },
+    [VTK_METRIC_SEND]           = { "vtk_send_seconds",            "Time to serialize and send a frame",         1 },
+    [VTK_METRIC_RECV]           = { "vtk_recv_seconds",            "Time to receive and parse a frame",          1 },
+    [VTK_METRIC_STAGE_IDL]      = { "vtk_stage_idl_seconds",       "IDL stage round trip",                       1 },
+    [VTK_METRIC_STAGE_VRP]      = { "vtk_stage_vrp_seconds",       "VRP stage round trip",                       1 },
+    [VTK_METRIC_STAGE_FIN]      = { "vtk_stage_fin_seconds",       "FIN stage round trip",                       1 },
+    [VTK_METRIC_STAGE_OTHER]    = { "vtk_stage_other_seconds",     "Other stages round trip",                    1 },
+    [VTK_METRIC_SESSION_BYTES]  = { "vtk_session_bytes",           "Bytes sent and received per session",        0 },
+    [VTK_METRIC_SESSION_FRAMES] = { "vtk_session_frames",          "Frames sent and received per session",       0 },
+    [VTK_METRIC_CANCEL]         = { "vtk_cancel_idle_seconds",     "Cancel request to IDL confirmation",         1 },
+    [VTK_METRIC_RESUME]         = { "vtk_resume_seconds",          "Connection drop to resumed stage",           1 },
+    [VTK_METRIC_THINK_IDL]      = { "vtk_pos_think_idl_seconds",   "POS think time of IDL, wire to wire",        1 },
+    [VTK_METRIC_THINK_VRP]      = { "vtk_pos_think_vrp_seconds",   "POS think time of VRP, wire to wire",        1 },
+    [VTK_METRIC_THINK_FIN]      = { "vtk_pos_think_fin_seconds",   "POS think time of FIN, wire to wire",        1 },
+    [VTK_METRIC_THINK_OTHER]    = { "vtk_pos_think_other_seconds", "POS think time of other requests",           1 },
+    [VTK_METRIC_LOCAL_IDL]      = { "vtk_local_idl_seconds",       "Own time of IDL exchange, beyond POS think", 1 },
+    [VTK_METRIC_LOCAL_VRP]      = { "vtk_local_vrp_seconds",       "Own time of VRP exchange, beyond POS think", 1 },
+    [VTK_METRIC_LOCAL_FIN]      = { "vtk_local_fin_seconds",       "Own time of FIN exchange, beyond POS think", 1 },
+    [VTK_METRIC_LOCAL_OTHER]    = { "vtk_local_other_seconds",      "Own time of other exchanges",                1 },
+};
+
+static struct vtk_counter_desc_s {
+    const char *name;
+    const char *help;
+} vtk_counter_desc[VTK_COUNTER_MAX] = {
+    [VTK_COUNTER_BYTES_TX]      = { "vtk_tx_bytes_total",         "Bytes sent to the peer"                     },
+    [VTK_COUNTER_BYTES_RX]      = { "vtk_rx_bytes_total",         "Bytes received from the peer"               },
+    [VTK_COUNTER_FRAMES_TX]     = { "vtk_tx_frames_total",        "Frames sent to the peer"                    },
+    [VTK_COUNTER_FRAMES_RX]     = { "vtk_rx_frames_total",        "Frames received from the peer"              },
+    [VTK_COUNTER_SESSIONS]      = { "vtk_sessions_total",         "Established sessions"                       },
+    [VTK_COUNTER_RESYNCS]       = { "vtk_rx_resyncs_total",       "Stream resynchronizations after garbage"    },
+    [VTK_COUNTER_BYTES_DROPPED] = { "vtk_rx_dropped_bytes_total", "Bytes dropped to resynchronize the stream"  },
+    [VTK_COUNTER_LIMIT_FRAME]   = { "vtk_rx_limit_frame_total",   "Frames refused by the frame size limit"     },
+    [VTK_COUNTER_LIMIT_ARGS]    = { "vtk_rx_limit_args_total",    "Frames refused by the arguments limit"      },
+    [VTK_COUNTER_LIMIT_BUFFER]  = { "vtk_rx_limit_buffer_total",  "Frames refused by the buffered bytes limit" },
+    [VTK_COUNTER_LIMIT_PARSE]   = { "vtk_rx_limit_parse_total",   "Frames refused by the parse time limit"     },
+    [VTK_COUNTER_BUF_HEAP]      = { "vtk_bufpool_heap_total",     "Stream buffers taken from heap, not pool"   },
+};
+
+static vtk_metrics_blk_t *
+vtk_metrics_blk(void)
+{
+    vtk_metrics_blk_t *blk = vtk_metrics_tls;
+    if (blk) {
+        return blk;
+    }
+    blk = vtk_mem_alloc(sizeof(vtk_metrics_blk_t));
+    if (! blk) {
+        return NULL;
+    }
+    memset(blk, 0, sizeof(vtk_metrics_blk_t));
+    blk->next = __atomic_load_n(&vtk_metrics_list, __ATOMIC_ACQUIRE);
+    while (! __atomic_compare_exchange_n(&vtk_metrics_list, &blk->next, blk, 1,
+                                         __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+    return vtk_metrics_tls = blk;
+}
+
+static int
+vtk_hist_index(uint64_t value)
+{
+    if (value < VTK_HIST_LINEAR) {
+        return value;
+    }
+    int exp = 63 - __builtin_clzll(value);
+    if (exp > VTK_HIST_MAXEXP) {
+        return VTK_HIST_BUCKETS - 1;
+    }
+    int sub = (value >> (exp - VTK_HIST_SUBBITS)) & (VTK_HIST_SUBCNT - 1);
+    return VTK_HIST_LINEAR + (exp - VTK_HIST_SUBBITS - 1) * VTK_HIST_SUBCNT + sub;
+}
+
+/* highest value which falls into the bucket */
+static uint64_t
+vtk_hist_upper(int index)
+{
+    if (index < VTK_HIST_LINEAR) {
+        return index;
+    }
+    int exp = (index - VTK_HIST_LINEAR) / VTK_HIST_SUBCNT + VTK_HIST_SUBBITS + 1;
+    int sub = (index - VTK_HIST_LINEAR) % VTK_HIST_SUBCNT;
+    return ((uint64_t)(VTK_HIST_SUBCNT + sub + 1) << (exp - VTK_HIST_SUBBITS)) - 1;
+}
+
+/* only the owner thread writes to its block, so relaxed add is enough to avoid torn reads */
+#define VTK_METRICS_ADD(var, value) __atomic_store_n(&(var), (var) + (value), __ATOMIC_RELAXED)
+
+void vtk_metrics_observe(vtk_metric_t metric, uint64_t value, int failed)
+{
+    vtk_metrics_blk_t *blk = vtk_metrics_blk();
+    if (! blk || (metric >= VTK_METRIC_MAX)) {
+        return;
+    }
+    vtk_hist_t *hist = &blk->hists[metric];
+    VTK_METRICS_ADD(hist->count, 1);
+    VTK_METRICS_ADD(hist->sum, value);
+    VTK_METRICS_ADD(hist->buckets[vtk_hist_index(value)], 1);
+    if (failed) {
+        VTK_METRICS_ADD(hist->fails, 1);
+    }
+}
+
+void vtk_metrics_count(vtk_counter_t counter, uint64_t value)
+{
+    vtk_metrics_blk_t *blk = vtk_metrics_blk();
+    if (! blk || (counter >= VTK_COUNTER_MAX)) {
+        return;
+    }
+    VTK_METRICS_ADD(blk->counters[counter], value);
+}
+
+vtk_metric_t vtk_metrics_stage(const char *msgname)
+{
+    switch (vtk_msgname_lookup(msgname, msgname ? strlen(msgname) : 0)) {
+        case VTK_MSGNAME_IDL: return VTK_METRIC_STAGE_IDL;
+        case VTK_MSGNAME_VRP: return VTK_METRIC_STAGE_VRP;
+        case VTK_MSGNAME_FIN: return VTK_METRIC_STAGE_FIN;
+        default:              return VTK_METRIC_STAGE_OTHER;
+    }
+}
+
+static void
+vtk_metrics_snapshot(vtk_hist_t *hist, vtk_metric_t metric, uint64_t *counters)
+{
+    vtk_metrics_blk_t *blk = __atomic_load_n(&vtk_metrics_list, __ATOMIC_ACQUIRE);
+
+    if (hist) {
+        memset(hist, 0, sizeof(*hist));
+    }
+    for (; blk; blk = blk->next) {
+        if (hist) {
+            vtk_hist_t *src = &blk->hists[metric];
+            hist->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+            hist->fails += __atomic_load_n(&src->fails, __ATOMIC_RELAXED);
+            hist->sum   += __atomic_load_n(&src->sum,   __ATOMIC_RELAXED);
+            for (int i = 0; i < VTK_HIST_BUCKETS; i++) {
+                hist->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+            }
+        }
+        if (counters) {
+            for (int i = 0; i < VTK_COUNTER_MAX; i++) {
+                counters[i] += __atomic_load_n(&blk->counters[i], __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+uint64_t vtk_metrics_quantile(vtk_metric_t metric, double quantile)
+{
+    vtk_hist_t hist;
+    if (metric >= VTK_METRIC_MAX) {
+        return 0;
+    }
+    vtk_metrics_snapshot(&hist, metric, NULL);
+
+    uint64_t rank = (uint64_t)(quantile * hist.count + 0.5), seen = 0;
+    for (int i = 0; i < VTK_HIST_BUCKETS; i++) {
+        seen += hist.buckets[i];
+        if (seen && (seen >= rank)) {
+            return vtk_hist_upper(i);
+        }
+    }
+    return 0;
+}
+
+int vtk_metrics_export(int fd)
+{
+    /* fixed bucket bounds keep exported series stable between scrapes */
+    static const double time_le[] = {
+        0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 0
+    };
+    static const double size_le[] = {
+        16, 64, 256, 1024, 4096, 16384, 65536, 262144, 1048576, 0
+    };
+    FILE *fout = fdopen(dup(fd), "w");
+    if (! fout) {
+        vtk_loge("Can't export metrics: %s", strerror(errno));
+        return -1;
+    }
+    uint64_t   counters[VTK_COUNTER_MAX] = {0};
+    vtk_hist_t hist;
+
+    for (int im = 0; im < VTK_METRIC_MAX; im++) {
+        struct vtk_metric_desc_s *desc = &vtk_metric_desc[im];
+        const double             *le   = desc->is_time ? time_le : size_le;
+        double                    unit = desc->is_time ? 1e9 : 1;
+
+        vtk_metrics_snapshot(&hist, im, im ? NULL : counters);
+
+        fprintf(fout, "# HELP %s %s\n# TYPE %s histogram\n", desc->name, desc->help, desc->name);
+        uint64_t cumulative = 0;
+        int      ibucket = 0;
+        for (int ile = 0; le[ile]; ile++) {
+            for (; (ibucket < VTK_HIST_BUCKETS) && (vtk_hist_upper(ibucket) <= le[ile] * unit); ibucket++) {
+                cumulative += hist.buckets[ibucket];
+            }
+            fprintf(fout, "%s_bucket{le=\"%g\"} %llu\n", desc->name, le[ile], cumulative);
+        }
+        fprintf(fout, "%s_bucket{le=\"+Inf\"} %llu\n", desc->name, hist.count);
+        fprintf(fout, "%s_sum %.9g\n",    desc->name, hist.sum / unit);
+        fprintf(fout, "%s_count %llu\n",  desc->name, hist.count);
+        fprintf(fout, "# TYPE %s_failures_total counter\n%s_failures_total %llu\n",
+                desc->name, desc->name, hist.fails);
+    }
+    for (int ic = 0; ic < VTK_COUNTER_MAX; ic++) {
+        struct vtk_counter_desc_s *desc = &vtk_counter_desc[ic];
+        fprintf(fout, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+                desc->name, desc->help, desc->name, desc->name, counters[ic]);
+    }
+    int rc = ferror(fout) ? -1 : 0;
+    if (fclose(fout) != 0) {
+        rc = -1;
+    }
+    return rc;
+}
+
+int vtk_metrics_export_file(const char *path)
+{
+    /* write aside and rename, so scrapers never observe partial file */
+    char tmppath[4096];
+    snprintf(tmppath, sizeof(tmppath), "%s.%d.tmp", path, (int)getpid());
+
+    int fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        vtk_loge("Can't open metrics file %s: %s", tmppath, strerror(errno));
+        return -1;
+    }
+    int rc = vtk_metrics_export(fd);
+    close(fd);
+
+    if ((rc < 0) || (rename(tmppath, path) < 0)) {
+        vtk_loge("Can't write metrics file %s", path);
+        unlink(tmppath);
+        return -1;
+    }
+    return 0;
+}
+
+int vtk_metrics_listen(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        vtk_loge("Metrics socket path is too long: %s", path);
+        return -1;
+    }
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        vtk_loge("Can't create metrics socket: %s", strerror(errno));
+        return -1;
+    }
+    unlink(path);
+    if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) || (listen(fd, 16) < 0)) {
+        vtk_loge("Can't listen metrics socket %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int vtk_metrics_serve(int lfd)
+{
+    int served = 0;
+    for (;;) {
+        int cfd = accept(lfd, NULL, NULL);
+        if (cfd < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? served : -1;
+        }
+        vtk_metrics_export(cfd);
+        close(cfd);
+        served++;
+    }
+}
@@ -0,0 +1,485 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vendotek.h"
+
+/*
+ * TCP/IP relay
+ *
+ * POS terminal without own uplink tunnels bank host traffic through VMC with
+ * CON / DAT / DSC messages (VTK protocol, section 4.8). Every connection is addressed
+ * by destination index of "TCP/IP destination" (0x0B) parameter.
+ */
+#define RELAY_CONN_TM      25000   /* ms, connection timeout recommended by VTK spec */
+#define RELAY_DEST_LEN     10      /* index, IP, port, status, window */
+
+/* frame room left for data block: proto, name, 1-byte destination and 0x0D header */
+#define RELAY_BLOCK_MAX    (VTK_MSG_MAXLEN - 2 - 5 - 3 - 4)
+
+/* remote hosts aren't read while this much is queued to POS, so payment frames never wait long */
+#define RELAY_QUEUE_MAX    (2 * RELAY_BLOCK_MAX)
+
+typedef enum relay_state_e {
+    RELAY_CLOSED,
+    RELAY_CONNECTING,
+    RELAY_ESTABLISHED
+} relay_state_t;
+
+typedef struct relay_conn_s {
+    int            fd;
+    relay_state_t  state;
+    uint8_t        dest[RELAY_DEST_LEN];   /* destination as reported to POS, with last status */
+    uint64_t       deadline;               /* connection attempt deadline, ns */
+    uint64_t       tx_bytes;               /* outgoing byte counter (0x0C) of current session */
+    uint64_t       rx_bytes;
+    char          *out;                    /* data not yet accepted by the remote host */
+    size_t         out_len;
+    size_t         out_sz;
+    int            confirm;                /* confirmable block is waiting for send completion */
+} relay_conn_t;
+
+struct vtk_relay_s {
+    vtk_t            *vtk;
+    vtk_msg_t        *msg;
+    int               maxconn;
+    relay_conn_t      conns[VTK_RELAY_MAXCONN];
+    char             *block;               /* remote host input, forwarded to POS as is */
+    vtk_relay_stat_t  stat;
+};
+
+int vtk_relay_init(vtk_relay_t **relay, vtk_t *vtk, int maxconn)
+{
+    if ((maxconn < 0) || (maxconn > VTK_RELAY_MAXCONN)) {
+        vtk_loge("Relay supports up to %d connections", VTK_RELAY_MAXCONN);
+        return -1;
+    }
+    *relay  = vtk_mem_alloc(sizeof(vtk_relay_t));
+    if (! *relay) {
+        return -1;
+    }
+    **relay = (vtk_relay_t) {
+        .vtk     = vtk,
+        .maxconn = maxconn,
+        .block   = vtk_mem_alloc(RELAY_BLOCK_MAX)
+    };
+    for (int i = 0; i < VTK_RELAY_MAXCONN; i++) {
+        (*relay)->conns[i].fd      = -1;
+        (*relay)->conns[i].dest[0] = i;
+        (*relay)->conns[i].dest[7] = VTK_RELAY_ST_NEVER;
+    }
+    if (! (*relay)->block || (vtk_msg_init(&(*relay)->msg, vtk) < 0)) {
+        vtk_relay_free(*relay);
+        *relay = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void
+relay_close(relay_conn_t *conn, uint8_t status)
+{
+    if (conn->fd >= 0) {
+        close(conn->fd);
+    }
+    conn->fd       = -1;
+    conn->state    = RELAY_CLOSED;
+    conn->dest[7]  = status;
+    conn->out_len  = 0;
+    conn->confirm  = 0;
+}
+
+void vtk_relay_free(vtk_relay_t *relay)
+{
+    if (! relay) {
+        return;
+    }
+    for (int i = 0; i < VTK_RELAY_MAXCONN; i++) {
+        relay_close(&relay->conns[i], VTK_RELAY_ST_LOCAL);
+        vtk_mem_free(relay->conns[i].out);
+    }
+    vtk_msg_free(relay->msg);
+    vtk_mem_free(relay->block);
+    vtk_mem_free(relay);
+}
+
+/*
+ * messages to POS
+ */
+static int
+relay_msg_start(vtk_relay_t *relay, char *name, uint8_t *dest, uint16_t destlen)
+{
+    vtk_msg_t *msg = relay->msg;
+    vtk_msg_mod(msg, VTK_MSG_RESET, VTK_BASE_FROM_STATE(vtk_net_get_state(relay->vtk)), 0, NULL);
+    vtk_msg_mod(msg, VTK_MSG_ADDSTR, 0x1, 0, name);
+    return vtk_msg_mod(msg, VTK_MSG_ADDBIN, 0xB, destlen, (char *)dest);
+}
+
+static int
+relay_send_state(vtk_relay_t *relay, char *name, uint8_t *dest)
+{
+    vtk_logd("relay #%u: %s, status 0x%02x", dest[0], name, dest[7]);
+    relay_msg_start(relay, name, dest, RELAY_DEST_LEN);
+    return vtk_net_queue(relay->vtk, relay->msg, VTK_CLASS_RELAY);
+}
+
+static int
+relay_send_confirm(vtk_relay_t *relay, relay_conn_t *conn)
+{
+    char counter[24];
+    snprintf(counter, sizeof(counter), "%llu", (unsigned long long)conn->tx_bytes);
+
+    conn->confirm = 0;
+    relay_msg_start(relay, "DAT", conn->dest, 1);
+    vtk_msg_mod(relay->msg, VTK_MSG_ADDSTR, 0xC, 0, counter);
+    return vtk_net_queue(relay->vtk, relay->msg, VTK_CLASS_RELAY);
+}
+
+/*
+ * traffic to the remote host
+ */
+static int
+relay_out_grow(relay_conn_t *conn, size_t size)
+{
+    char *out = vtk_mem_realloc(conn->out, size);
+    if (! out) {
+        return -1;
+    }
+    conn->out    = out;
+    conn->out_sz = size;
+    return 0;
+}
+
+static int
+relay_flush(vtk_relay_t *relay, relay_conn_t *conn, const char *data, size_t len)
+{
+    /* keep order: new data goes after the queued one */
+    if (conn->out_len) {
+        if ((conn->out_len + len > conn->out_sz) && (relay_out_grow(conn, conn->out_len + len) < 0)) {
+            return -1;
+        }
+        memcpy(&conn->out[conn->out_len], data, len);
+        conn->out_len += len;
+        data = conn->out;
+        len  = conn->out_len;
+    }
+    size_t written = 0;
+    while (written < len) {
+        ssize_t wresult = write(conn->fd, &data[written], len - written);
+        if (wresult > 0) {
+            written += wresult;
+        } else if ((wresult < 0) && (errno == EINTR)) {
+            continue;
+        } else if ((wresult < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+            break;
+        } else {
+            return -1;
+        }
+    }
+    conn->tx_bytes     += written;
+    relay->stat.tx_bytes += written;
+
+    size_t rest = len - written;
+    if (rest && (data != conn->out)) {
+        if ((rest > conn->out_sz) && (relay_out_grow(conn, rest) < 0)) {
+            return -1;
+        }
+        memcpy(conn->out, &data[written], rest);
+    } else if (rest) {
+        memmove(conn->out, &conn->out[written], rest);
+    }
+    conn->out_len = rest;
+
+    if (! conn->out_len && conn->confirm) {
+        return relay_send_confirm(relay, conn);
+    }
+    return 0;
+}
+
+static int
+relay_connect(vtk_relay_t *relay, relay_conn_t *conn)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    memcpy(&addr.sin_addr, &conn->dest[1], 4);
+    memcpy(&addr.sin_port, &conn->dest[5], 2);
+
+    conn->tx_bytes = conn->rx_bytes = 0;
+    conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (conn->fd < 0) {
+        relay_close(conn, VTK_RELAY_ST_NOSERVICE);
+        return relay_send_state(relay, "CON", conn->dest);
+    }
+    int nodelay = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    vtk_logi("relay #%u: connect to %s:%u", conn->dest[0], inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+
+    if (connect(conn->fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        conn->state   = RELAY_ESTABLISHED;
+        conn->dest[7] = VTK_RELAY_ST_ESTABLISHED;
+        return relay_send_state(relay, "CON", conn->dest);
+    }
+    if (errno == EINPROGRESS) {
+        conn->state    = RELAY_CONNECTING;
+        conn->deadline = vtk_clock_ns() + RELAY_CONN_TM * 1000000ull;
+        return 0;
+    }
+    vtk_logw("relay #%u: can't connect: %s", conn->dest[0], strerror(errno));
+    relay_close(conn, ((errno == ENETUNREACH) || (errno == EHOSTUNREACH)) ?
+                      VTK_RELAY_ST_INACTIVE : VTK_RELAY_ST_REMOTE);
+    return relay_send_state(relay, "CON", conn->dest);
+}
+
+/*
+ * messages from POS, routed by name; every handler gets the connection of the destination
+ */
+typedef struct relay_req_s {
+    vtk_relay_t   *relay;
+    relay_conn_t  *conn;
+    uint8_t        index;
+    char          *dest;
+    uint16_t       destlen;
+} relay_req_t;
+
+static int
+relay_on_con(void *ctx, vtk_msg_t *msg)
+{
+    relay_req_t  *req   = ctx;
+    vtk_relay_t  *relay = req->relay;
+    relay_conn_t *conn  = req->conn;
+
+    if (req->destlen < 7) {
+        vtk_loge("relay #%u: CON message with truncated destination", req->index);
+        return -1;
+    }
+    if (conn->state == RELAY_ESTABLISHED) {
+        return relay_send_state(relay, "CON", conn->dest);
+    }
+    if (conn->state == RELAY_CONNECTING) {
+        return 0;
+    }
+    memcpy(&conn->dest[1], &req->dest[1], 6);
+    conn->dest[8] = conn->dest[9] = 0;
+
+    /* VMC must be able to receive window of 65536 bytes, according to the spec */
+    if ((req->destlen >= RELAY_DEST_LEN) && (req->dest[8] || req->dest[9])) {
+        conn->dest[7] = VTK_RELAY_ST_NOSERVICE;
+        return relay_send_state(relay, "CON", conn->dest);
+    }
+    relay->stat.connects++;
+    return relay_connect(relay, conn);
+}
+
+static int
+relay_on_dsc(void *ctx, vtk_msg_t *msg)
+{
+    relay_req_t  *req  = ctx;
+    relay_conn_t *conn = req->conn;
+
+    if (conn->state != RELAY_CLOSED) {
+        vtk_logi("relay #%u: closed by POS; sent %llu, received %llu bytes",
+                 req->index, conn->tx_bytes, conn->rx_bytes);
+        relay_close(conn, VTK_RELAY_ST_LOCAL);
+    }
+    return relay_send_state(req->relay, "DSC", conn->dest);
+}
+
+static int
+relay_on_dat(void *ctx, vtk_msg_t *msg)
+{
+    relay_req_t  *req      = ctx;
+    vtk_relay_t  *relay    = req->relay;
+    relay_conn_t *conn     = req->conn;
+    char         *block    = NULL;
+    uint16_t      blocklen = 0;
+    int           confirm  = 0;
+
+    if (conn->state != RELAY_ESTABLISHED) {
+        return relay_send_state(relay, "DSC", conn->dest);
+    }
+    if (vtk_msg_find_param(msg, 0xE, &blocklen, &block) >= 0) {
+        confirm = 1;
+    } else if (vtk_msg_find_param(msg, 0xD, &blocklen, &block) < 0) {
+        return 0;
+    }
+    relay->stat.blocks_up++;
+    conn->confirm |= confirm;
+
+    if (relay_flush(relay, conn, block, blocklen) < 0) {
+        vtk_logw("relay #%u: remote host write error: %s", req->index, strerror(errno));
+        relay_close(conn, VTK_RELAY_ST_REMOTE);
+        return relay_send_state(relay, "DSC", conn->dest);
+    }
+    return 0;
+}
+
+static const vtk_dispatch_t relay_dispatch = {
+    .fn = {
+        [VTK_MSGNAME_CON] = relay_on_con,
+        [VTK_MSGNAME_DAT] = relay_on_dat,
+        [VTK_MSGNAME_DSC] = relay_on_dsc
+    }
+};
+
+int vtk_relay_match(vtk_msg_t *msg)
+{
+    return relay_dispatch.fn[vtk_msg_name(msg)] != NULL;
+}
+
+int vtk_relay_handle(vtk_relay_t *relay, vtk_msg_t *msg)
+{
+    relay_req_t req = { .relay = relay };
+
+    if (! vtk_relay_match(msg)) {
+        return -1;
+    }
+    vtk_msg_find_param(msg, 0xB, &req.destlen, &req.dest);
+
+    /* no destination parameter in DAT and DSC means destination index 0 */
+    req.index = req.destlen ? (uint8_t)req.dest[0] : 0;
+
+    if (req.index >= relay->maxconn) {
+        uint8_t reply[RELAY_DEST_LEN] = { req.index };
+        memcpy(reply, req.dest, req.destlen < RELAY_DEST_LEN ? req.destlen : RELAY_DEST_LEN);
+        reply[7] = VTK_RELAY_ST_NOSERVICE;
+        reply[8] = reply[9] = 0;
+        vtk_logw("relay #%u: destination index is out of service", req.index);
+        return relay_send_state(relay, "CON", reply);
+    }
+    req.conn = &relay->conns[req.index];
+
+    return vtk_msg_dispatch(&relay_dispatch, msg, &req);
+}
+
+/*
+ * remote hosts IO
+ */
+int vtk_relay_pollfds(vtk_relay_t *relay, struct pollfd *fds, int nfds)
+{
+    int ifd = 0;
+    for (int i = 0; relay && (i < relay->maxconn) && (ifd < nfds); i++) {
+        relay_conn_t *conn = &relay->conns[i];
+        if (conn->state == RELAY_CLOSED) {
+            continue;
+        }
+        /* input of a throttled connection isn't polled at all, or its hangup would spin */
+        int throttled = vtk_net_queued(relay->vtk, VTK_CLASS_RELAY) >= RELAY_QUEUE_MAX;
+        short events  = (conn->state == RELAY_CONNECTING) ? POLLOUT :
+                        ((throttled ? 0 : POLLIN) | (conn->out_len ? POLLOUT : 0));
+        fds[ifd].fd      = events ? conn->fd : -1;
+        fds[ifd].events  = events;
+        fds[ifd].revents = 0;
+        ifd++;
+    }
+    return ifd;
+}
+
+int vtk_relay_timeout(vtk_relay_t *relay)
+{
+    uint64_t now = vtk_clock_ns();
+    int      tm  = -1;
+    for (int i = 0; relay && (i < relay->maxconn); i++) {
+        relay_conn_t *conn = &relay->conns[i];
+        if (conn->state != RELAY_CONNECTING) {
+            continue;
+        }
+        int conntm = (conn->deadline > now) ? (conn->deadline - now) / 1000000 + 1 : 0;
+        tm = ((tm < 0) || (conntm < tm)) ? conntm : tm;
+    }
+    return tm;
+}
+
+static int
+relay_forward(vtk_relay_t *relay, relay_conn_t *conn)
+{
+    /*
+     * available input is coalesced into as few DAT frames as possible and queued to POS
+     * as relay traffic, up to RELAY_QUEUE_MAX; the rest waits in the socket of the remote host
+     */
+    while (vtk_net_queued(relay->vtk, VTK_CLASS_RELAY) < RELAY_QUEUE_MAX) {
+        ssize_t rcount = read(conn->fd, relay->block, RELAY_BLOCK_MAX);
+        if (rcount > 0) {
+            conn->rx_bytes        += rcount;
+            relay->stat.rx_bytes  += rcount;
+            relay->stat.blocks_down++;
+
+            relay_msg_start(relay, "DAT", conn->dest, 1);
+            if (vtk_net_queue_ref(relay->vtk, relay->msg, VTK_CLASS_RELAY, 0xD, rcount, relay->block) < 0) {
+                return -1;
+            }
+            if (rcount < RELAY_BLOCK_MAX) {
+                return 0;
+            }
+        } else if ((rcount < 0) && (errno == EINTR)) {
+            continue;
+        } else if ((rcount < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+            return 0;
+        } else {
+            vtk_logi("relay #%u: closed by remote host; sent %llu, received %llu bytes",
+                     conn->dest[0], conn->tx_bytes, conn->rx_bytes);
+            relay_close(conn, VTK_RELAY_ST_REMOTE);
+            return relay_send_state(relay, "DSC", conn->dest);
+        }
+    }
+    return 0;
+}
+
+int vtk_relay_process(vtk_relay_t *relay, struct pollfd *fds, int nfds)
+{
+    uint64_t now = vtk_clock_ns();
+    int      rc  = 0;
+
+    for (int i = 0; relay && (i < relay->maxconn); i++) {
+        relay_conn_t *conn    = &relay->conns[i];
+        short         revents = 0;
+        for (int ifd = 0; ifd < nfds; ifd++) {
+            if ((fds[ifd].fd == conn->fd) && (conn->fd >= 0)) {
+                revents = fds[ifd].revents;
+            }
+        }
+        if ((conn->state == RELAY_CONNECTING) && revents) {
+            int       sockerr = 0;
+            socklen_t socklen = sizeof(sockerr);
+            getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &sockerr, &socklen);
+            if (sockerr == 0) {
+                conn->state   = RELAY_ESTABLISHED;
+                conn->dest[7] = VTK_RELAY_ST_ESTABLISHED;
+            } else {
+                vtk_logw("relay #%u: can't connect: %s", i, strerror(sockerr));
+                relay_close(conn, VTK_RELAY_ST_REMOTE);
+            }
+            rc |= relay_send_state(relay, "CON", conn->dest);
+
+        } else if ((conn->state == RELAY_CONNECTING) && (now >= conn->deadline)) {
+            vtk_logw("relay #%u: connection timeout", i);
+            relay_close(conn, VTK_RELAY_ST_TIMEOUT);
+            rc |= relay_send_state(relay, "CON", conn->dest);
+
+        } else if ((conn->state == RELAY_ESTABLISHED) && revents) {
+            if ((revents & POLLOUT) && conn->out_len && (relay_flush(relay, conn, NULL, 0) < 0)) {
+                relay_close(conn, VTK_RELAY_ST_REMOTE);
+                rc |= relay_send_state(relay, "DSC", conn->dest);
+                continue;
+            }
+            if (revents & (POLLIN | POLLHUP | POLLERR)) {
+                rc |= relay_forward(relay, conn);
+            }
+        }
+    }
+    /* what the POS socket takes now, the rest is written on POLLOUT */
+    if (relay && (vtk_net_flush(relay->vtk) < 0)) {
+        rc = -1;
+    }
+    return rc;
+}
+
+void vtk_relay_stat(vtk_relay_t *relay, vtk_relay_stat_t *stat)
+{
+    *stat = relay->stat;
+}
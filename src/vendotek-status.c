@@ -0,0 +1,245 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vendotek.h"
+
+/*
+ * Status board
+ *
+ * POSIX shared memory segment with one record per terminal. Each record is written by its
+ * owner process only and is guarded by a seqlock: the writer makes the sequence odd, updates
+ * the record and makes it even again, readers copy the record and retry if the sequence
+ * was odd or has changed meanwhile. Readers never block the payment path and need no syscalls.
+ */
+#define STATUS_MAGIC    0x53544B56   /* "VKTS" */
+#define STATUS_VERSION  1
+#define STATUS_RETRIES  0x10000
+
+typedef struct status_board_hdr_s {
+    uint32_t   magic;
+    uint32_t   version;
+    uint32_t   slots;
+    uint32_t   rec_size;
+} status_board_hdr_t;
+
+struct vtk_status_s {
+    status_board_hdr_t *hdr;
+    vtk_status_rec_t   *recs;
+    size_t              size;
+    int                 writable;
+};
+
+static uint64_t
+status_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+status_write_begin(vtk_status_rec_t *rec)
+{
+    __atomic_store_n(&rec->seq, rec->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+status_write_end(vtk_status_rec_t *rec)
+{
+    __atomic_store_n(&rec->seq, rec->seq + 1, __ATOMIC_RELEASE);
+}
+
+int vtk_status_open(vtk_status_t **board, const char *name, int slots)
+{
+    int writable = slots > 0;
+    int fd       = shm_open(name, writable ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+    if (fd < 0) {
+        vtk_loge("Can't open status board %s: %s", name, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        vtk_loge("Can't open status board %s: %s", name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    size_t size = writable ? sizeof(status_board_hdr_t) + slots * sizeof(vtk_status_rec_t) : st.st_size;
+    if (writable && (st.st_size == 0) && (ftruncate(fd, size) < 0)) {
+        vtk_loge("Can't size status board %s: %s", name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    size = (st.st_size > 0) ? st.st_size : size;
+    if (size < sizeof(status_board_hdr_t)) {
+        vtk_loge("Status board %s isn't initialized", name);
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        vtk_loge("Can't map status board %s: %s", name, strerror(errno));
+        return -1;
+    }
+    status_board_hdr_t *hdr = map;
+
+    /* the first writer initializes the header, zero-filled segment has no magic yet */
+    if (writable && ! __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE)) {
+        hdr->version  = STATUS_VERSION;
+        hdr->rec_size = sizeof(vtk_status_rec_t);
+        hdr->slots    = (size - sizeof(status_board_hdr_t)) / sizeof(vtk_status_rec_t);
+        __atomic_store_n(&hdr->magic, STATUS_MAGIC, __ATOMIC_RELEASE);
+    }
+    if ((__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != STATUS_MAGIC) ||
+        (hdr->version != STATUS_VERSION) || (hdr->rec_size != sizeof(vtk_status_rec_t)) ||
+        (sizeof(status_board_hdr_t) + hdr->slots * sizeof(vtk_status_rec_t) > size)) {
+        vtk_loge("Status board %s has incompatible layout", name);
+        munmap(map, size);
+        return -1;
+    }
+    *board  = vtk_mem_alloc(sizeof(vtk_status_t));
+    if (! *board) {
+        munmap(map, size);
+        return -1;
+    }
+    **board = (vtk_status_t) {
+        .hdr      = hdr,
+        .recs     = (vtk_status_rec_t *)(hdr + 1),
+        .size     = size,
+        .writable = writable
+    };
+    return 0;
+}
+
+void vtk_status_close(vtk_status_t *board)
+{
+    if (board) {
+        munmap(board->hdr, board->size);
+        vtk_mem_free(board);
+    }
+}
+
+int vtk_status_slots(vtk_status_t *board)
+{
+    return board->hdr->slots;
+}
+
+/*
+ * writer side
+ */
+vtk_status_rec_t *vtk_status_claim(vtk_status_t *board, const char *terminal)
+{
+    if (! board->writable) {
+        vtk_loge("Status board is opened read-only");
+        return NULL;
+    }
+    int32_t pid = getpid();
+
+    for (uint32_t i = 0; i < board->hdr->slots; i++) {
+        vtk_status_rec_t *rec   = &board->recs[i];
+        int32_t           owner = __atomic_load_n(&rec->pid, __ATOMIC_ACQUIRE);
+
+        /* free slot, or slot of a dead process */
+        if (owner && ((kill(owner, 0) == 0) || (errno != ESRCH))) {
+            continue;
+        }
+        if (! __atomic_compare_exchange_n(&rec->pid, &owner, pid, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        /* the previous owner might die in the middle of update */
+        rec->seq += rec->seq & 1;
+        status_write_begin(rec);
+        uint32_t seq = rec->seq;
+        memset((char *)rec + offsetof(vtk_status_rec_t, terminal), 0,
+               sizeof(*rec) - offsetof(vtk_status_rec_t, terminal));
+        rec->seq = seq;
+        snprintf(rec->terminal, sizeof(rec->terminal), "%s", terminal);
+        rec->opnum    = -1;
+        rec->time_net = status_time_ns();
+        status_write_end(rec);
+        return rec;
+    }
+    vtk_loge("Status board has no free slots");
+    return NULL;
+}
+
+void vtk_status_release(vtk_status_rec_t *rec)
+{
+    if (rec) {
+        vtk_status_net(rec, VTK_NET_DOWN);
+        __atomic_store_n(&rec->pid, 0, __ATOMIC_RELEASE);
+    }
+}
+
+void vtk_status_net(vtk_status_rec_t *rec, vtk_net_t state)
+{
+    if (rec) {
+        status_write_begin(rec);
+        rec->net_state = state;
+        rec->time_net  = status_time_ns();
+        status_write_end(rec);
+    }
+}
+
+void vtk_status_frame(vtk_status_rec_t *rec, int sent, const char *name, long opnum)
+{
+    if (rec) {
+        status_write_begin(rec);
+        if (sent) {
+            strncpy(rec->stage, name, sizeof(rec->stage) - 1);
+            rec->frames_tx++;
+            rec->time_sent = status_time_ns();
+        } else {
+            strncpy(rec->reply, name, sizeof(rec->reply) - 1);
+            rec->frames_rx++;
+            rec->time_recv = status_time_ns();
+        }
+        rec->opnum = opnum >= 0 ? opnum : rec->opnum;
+        status_write_end(rec);
+    }
+}
+
+void vtk_status_error(vtk_status_rec_t *rec, const char *error)
+{
+    if (rec) {
+        status_write_begin(rec);
+        snprintf(rec->error, sizeof(rec->error), "%s", error);
+        rec->errors++;
+        rec->time_error = status_time_ns();
+        status_write_end(rec);
+    }
+}
+
+/*
+ * reader side
+ */
+int vtk_status_read(vtk_status_t *board, int islot, vtk_status_rec_t *out)
+{
+    if ((islot < 0) || (islot >= board->hdr->slots)) {
+        return -1;
+    }
+    vtk_status_rec_t *rec = &board->recs[islot];
+
+    /* retries are bounded, as the writer may die in the middle of update */
+    for (int retry = 0; retry < STATUS_RETRIES; retry++) {
+        uint32_t seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        memcpy(out, rec, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) == seq) {
+            return out->pid ? 0 : -1;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,339 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vendotek.h"
+
+/*
+ * Telemetry table
+ *
+ * The file is an array of checksummed slots, one per terminal, in the order terminals were added.
+ * The table is kept in memory with a hash index by terminal name; changed slots are marked dirty
+ * and written back in place, a run of adjacent ones with one write. A slot torn by a crash fails
+ * its checksum at open and is left free, the terminal gets a new record on its next poll.
+ *
+ * Every poll changes its counters and timestamps, so a slot changed only by them is stale rather
+ * than dirty: stale slots go to disk with the flush after TELEMETRY_STALE_NS and at close, dirty
+ * ones with the next flush. A slot is dirty when its management data, system information or
+ * drift, in TELEMETRY_DRIFT_MS buckets, changes.
+ */
+#define TELEMETRY_MAGIC     0x54544B56   /* "VKTT" */
+#define TELEMETRY_SLOT      256
+#define TELEMETRY_DRIFT_MS  1000
+#define TELEMETRY_STALE_NS  (600 * 1000000000ull)
+
+enum {
+    TELEMETRY_CLEAN,
+    TELEMETRY_STALE,
+    TELEMETRY_DIRTY
+};
+
+typedef struct telemetry_slot_s {
+    uint32_t    magic;
+    uint32_t    crc;        /* FNV-1a of the record */
+    vtk_trec_t  rec;
+    char        pad[TELEMETRY_SLOT - 2 * sizeof(uint32_t) - sizeof(vtk_trec_t)];
+} telemetry_slot_t;
+
+_Static_assert(sizeof(telemetry_slot_t) == TELEMETRY_SLOT, "telemetry slot must keep its size");
+
+struct vtk_telemetry_s {
+    char             *path;
+    int               fd;
+    telemetry_slot_t *slots;
+    uint8_t          *dirty;    /* TELEMETRY_CLEAN / STALE / DIRTY per slot */
+    uint64_t          tstale;   /* when stale slots were written last */
+    size_t            count;
+    size_t            size;     /* allocated slots */
+    size_t           *index;    /* open addressing hash by terminal name, slot + 1, 0 if empty */
+    size_t            isize;
+};
+
+static uint32_t
+telemetry_fnv(const void *data, size_t len)
+{
+    const uint8_t *bytes = data;
+    uint32_t       hash  = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static size_t *
+telemetry_find(vtk_telemetry_t *table, const char *terminal)
+{
+    size_t i = telemetry_fnv(terminal, strlen(terminal)) & (table->isize - 1);
+    for (; table->index[i] && strcmp(table->slots[table->index[i] - 1].rec.terminal, terminal);
+           i = (i + 1) & (table->isize - 1));
+    return &table->index[i];
+}
+
+/* index is kept at most half full */
+static int
+telemetry_reindex(vtk_telemetry_t *table)
+{
+    if (table->index && (table->count * 2 < table->isize)) {
+        return 0;
+    }
+    size_t isize = table->isize ? table->isize * 2 : 64;
+    while (isize < table->count * 2) {
+        isize *= 2;
+    }
+    size_t *index = vtk_mem_alloc(isize * sizeof(size_t));
+    if (! index) {
+        return -1;
+    }
+    vtk_mem_free(table->index);
+    table->index = index;
+    table->isize = isize;
+    memset(table->index, 0, table->isize * sizeof(size_t));
+    for (size_t i = 0; i < table->count; i++) {
+        if (table->slots[i].rec.terminal[0]) {
+            *telemetry_find(table, table->slots[i].rec.terminal) = i + 1;
+        }
+    }
+    return 0;
+}
+
+static int
+telemetry_grow(vtk_telemetry_t *table, size_t count)
+{
+    if (count > table->size) {
+        size_t            size  = count > table->size * 2 ? count : table->size * 2;
+        telemetry_slot_t *slots = vtk_mem_realloc(table->slots, size * sizeof(telemetry_slot_t));
+        if (slots) {
+            table->slots = slots;
+        }
+        uint8_t *dirty = slots ? vtk_mem_realloc(table->dirty, size) : NULL;
+        if (! dirty) {
+            return -1;
+        }
+        table->dirty = dirty;
+        memset(&table->slots[table->size], 0, (size - table->size) * sizeof(telemetry_slot_t));
+        memset(&table->dirty[table->size], 0, size - table->size);
+        table->size = size;
+    }
+    table->count = count;
+    return 0;
+}
+
+static int
+telemetry_load(vtk_telemetry_t *table)
+{
+    struct stat st;
+    if (fstat(table->fd, &st) < 0) {
+        return -1;
+    }
+    size_t count = st.st_size / TELEMETRY_SLOT;
+    size_t torn  = 0;
+    if (telemetry_grow(table, count) < 0) {
+        return -1;
+    }
+
+    for (size_t done = 0; done < count * TELEMETRY_SLOT; ) {
+        ssize_t rresult = pread(table->fd, (char *)table->slots + done, count * TELEMETRY_SLOT - done, done);
+        if ((rresult < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (rresult <= 0) {
+            return -1;
+        }
+        done += rresult;
+    }
+    for (size_t i = 0; i < count; i++) {
+        telemetry_slot_t *slot = &table->slots[i];
+        if ((slot->magic != TELEMETRY_MAGIC) || (slot->crc != telemetry_fnv(&slot->rec, sizeof(slot->rec)))) {
+            memset(slot, 0, sizeof(*slot));
+            torn++;
+        }
+    }
+    if (torn) {
+        vtk_logw("Telemetry %s: %lu torn records are dropped", table->path, torn);
+    }
+    /* a slot cut short is written anew with the next new terminal */
+    if ((count * TELEMETRY_SLOT != st.st_size) && (ftruncate(table->fd, count * TELEMETRY_SLOT) < 0)) {
+        return -1;
+    }
+    return telemetry_reindex(table);
+}
+
+static int
+telemetry_write(vtk_telemetry_t *table, size_t first, size_t cnt)
+{
+    const char *data = (const char *)&table->slots[first];
+    size_t      len  = cnt * TELEMETRY_SLOT;
+    off_t       off  = first * TELEMETRY_SLOT;
+    while (len) {
+        ssize_t wresult = pwrite(table->fd, data, len, off);
+        if ((wresult < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (wresult < 0) {
+            return -1;
+        }
+        data += wresult;
+        off  += wresult;
+        len  -= wresult;
+    }
+    return 0;
+}
+
+static int
+telemetry_flush(vtk_telemetry_t *table, int stale)
+{
+    uint8_t level   = stale ? TELEMETRY_STALE : TELEMETRY_DIRTY;
+    int     written = 0;
+    for (size_t i = 0; i < table->count; ) {
+        if (table->dirty[i] < level) {
+            i++;
+            continue;
+        }
+        size_t first = i;
+        for (; (i < table->count) && (table->dirty[i] >= level); i++) {
+            telemetry_slot_t *slot = &table->slots[i];
+            slot->magic = TELEMETRY_MAGIC;
+            slot->crc   = telemetry_fnv(&slot->rec, sizeof(slot->rec));
+            table->dirty[i] = TELEMETRY_CLEAN;
+        }
+        if (telemetry_write(table, first, i - first) < 0) {
+            vtk_loge("Telemetry %s: write error: %s", table->path, strerror(errno));
+            return -1;
+        }
+        written += i - first;
+    }
+    if (written && (fdatasync(table->fd) < 0)) {
+        vtk_loge("Telemetry %s: sync error: %s", table->path, strerror(errno));
+        return -1;
+    }
+    if (stale) {
+        table->tstale = vtk_clock_ns();
+    }
+    return written;
+}
+
+int vtk_telemetry_open(vtk_telemetry_t **table, const char *path)
+{
+    *table  = vtk_mem_alloc(sizeof(vtk_telemetry_t));
+    if (! *table) {
+        return -1;
+    }
+    **table = (vtk_telemetry_t) {
+        .path   = vtk_mem_strdup(path),
+        .fd     = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644),
+        .tstale = vtk_clock_ns()
+    };
+    if (! (*table)->path || ((*table)->fd < 0) || (telemetry_load(*table) < 0)) {
+        vtk_loge("Can't open telemetry table %s: %s", path, strerror(errno));
+        vtk_telemetry_close(*table);
+        *table = NULL;
+        return -1;
+    }
+    vtk_logi("Telemetry %s: %lu terminals", path, (*table)->count);
+    return 0;
+}
+
+void vtk_telemetry_close(vtk_telemetry_t *table)
+{
+    if (! table) {
+        return;
+    }
+    if (table->fd >= 0) {
+        telemetry_flush(table, 1);
+        close(table->fd);
+    }
+    vtk_mem_free(table->slots);
+    vtk_mem_free(table->dirty);
+    vtk_mem_free(table->index);
+    vtk_mem_free(table->path);
+    vtk_mem_free(table);
+}
+
+int vtk_telemetry_lookup(vtk_telemetry_t *table, const char *terminal, vtk_trec_t *rec)
+{
+    size_t islot = *telemetry_find(table, terminal);
+    if (! islot) {
+        return -1;
+    }
+    *rec = table->slots[islot - 1].rec;
+    return 0;
+}
+
+static int64_t
+telemetry_drift_bucket(int64_t drift_ms)
+{
+    if (drift_ms == VTK_DRIFT_UNKNOWN) {
+        return drift_ms;
+    }
+    return drift_ms >= 0 ? drift_ms / TELEMETRY_DRIFT_MS : -((-drift_ms + TELEMETRY_DRIFT_MS - 1) / TELEMETRY_DRIFT_MS);
+}
+
+int vtk_telemetry_update(vtk_telemetry_t *table, const vtk_trec_t *rec)
+{
+    if (! rec->terminal[0] || (strnlen(rec->terminal, sizeof(rec->terminal)) == sizeof(rec->terminal))) {
+        vtk_loge("Telemetry record needs a terminal name of up to %lu chars", sizeof(rec->terminal) - 1);
+        return -1;
+    }
+    size_t *islot = telemetry_find(table, rec->terminal);
+    if (! *islot) {
+        size_t i = 0;
+        for (; (i < table->count) && table->slots[i].rec.terminal[0]; i++);
+        int appended = i == table->count;
+        if (appended && (telemetry_grow(table, table->count + 1) < 0)) {
+            return -1;
+        }
+        if (telemetry_reindex(table) < 0) {
+            table->count -= appended;
+            return -1;
+        }
+        table->slots[i].rec = (vtk_trec_t) {0};
+        snprintf(table->slots[i].rec.terminal, sizeof(rec->terminal), "%s", rec->terminal);
+        islot  = telemetry_find(table, rec->terminal);
+        *islot = i + 1;
+        table->dirty[i] = TELEMETRY_DIRTY;
+    }
+    vtk_trec_t *old = &table->slots[*islot - 1].rec;
+    vtk_trec_t  upd = *rec;
+    int changed = strncmp(upd.mgmt, old->mgmt, sizeof(upd.mgmt)) || strncmp(upd.sysinfo, old->sysinfo, sizeof(upd.sysinfo));
+    if (changed) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        upd.time_changed = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    } else {
+        upd.time_changed = old->time_changed;
+    }
+    if (! memcmp(&upd, old, sizeof(upd))) {
+        return 0;
+    }
+    uint8_t *dirty = &table->dirty[*islot - 1];
+    if (changed || (telemetry_drift_bucket(upd.drift_ms) != telemetry_drift_bucket(old->drift_ms))) {
+        *dirty = TELEMETRY_DIRTY;
+    } else if (*dirty == TELEMETRY_CLEAN) {
+        *dirty = TELEMETRY_STALE;
+    }
+    *old = upd;
+    return 0;
+}
+
+int vtk_telemetry_flush(vtk_telemetry_t *table)
+{
+    return telemetry_flush(table, vtk_clock_ns() - table->tstale >= TELEMETRY_STALE_NS);
+}
+
+size_t vtk_telemetry_count(vtk_telemetry_t *table)
+{
+    return table->count;
+}
+
+int vtk_telemetry_read(vtk_telemetry_t *table, size_t i, vtk_trec_t *rec)
+{
+    if ((i >= table->count) || ! table->slots[i].rec.terminal[0]) {
+        return -1;
+    }
+    *rec = table->slots[i].rec;
+    return 0;
+}
@@ -0,0 +1,145 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "vendotek.h"
+
+/*
+ * Tracing
+ *
+ * Like metrics, every thread records into a private block: a ring of the last
+ * VTK_TRACE_SPANS spans, written with plain stores and published by the ring head.
+ * Blocks are pushed once into a lock-free list, the export walks all of them.
+ */
+typedef struct vtk_span_s {
+    const char *name;        /* static string */
+    char        arg[4];      /* message name, appended to the span name */
+    uint64_t    trace;
+    uint64_t    start;
+    uint64_t    dur;
+} vtk_span_t;
+
+typedef struct vtk_trace_blk_s {
+    struct vtk_trace_blk_s *next;
+    int                     tid;
+    uint64_t                trace;   /* current trace of the thread, 0 if none */
+    uint64_t                head;    /* spans ever recorded, the ring keeps the last ones */
+    vtk_span_t              spans[VTK_TRACE_SPANS];
+} vtk_trace_blk_t;
+
+static int                       vtk_trace_on;
+static uint64_t                  vtk_trace_ids;
+static vtk_trace_blk_t          *vtk_trace_list;
+static __thread vtk_trace_blk_t *vtk_trace_tls;
+
+static vtk_trace_blk_t *
+vtk_trace_blk(void)
+{
+    vtk_trace_blk_t *blk = vtk_trace_tls;
+    if (blk) {
+        return blk;
+    }
+    blk = vtk_mem_alloc(sizeof(vtk_trace_blk_t));
+    if (! blk) {
+        return NULL;
+    }
+    memset(blk, 0, sizeof(vtk_trace_blk_t));
+    blk->tid  = syscall(SYS_gettid);
+    blk->next = __atomic_load_n(&vtk_trace_list, __ATOMIC_ACQUIRE);
+    while (! __atomic_compare_exchange_n(&vtk_trace_list, &blk->next, blk, 1,
+                                         __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+    return vtk_trace_tls = blk;
+}
+
+void vtk_trace_enable(int on)
+{
+    __atomic_store_n(&vtk_trace_on, on, __ATOMIC_RELAXED);
+}
+
+uint64_t vtk_trace_begin(void)
+{
+    vtk_trace_blk_t *blk = __atomic_load_n(&vtk_trace_on, __ATOMIC_RELAXED) ? vtk_trace_blk() : NULL;
+    if (! blk) {
+        return 0;
+    }
+    return blk->trace = __atomic_add_fetch(&vtk_trace_ids, 1, __ATOMIC_RELAXED);
+}
+
+void vtk_trace_end(void)
+{
+    if (vtk_trace_tls) {
+        vtk_trace_tls->trace = 0;
+    }
+}
+
+uint64_t vtk_trace_now(void)
+{
+    return (vtk_trace_tls && vtk_trace_tls->trace) ? vtk_clock_ns() : 0;
+}
+
+void vtk_trace_span(const char *name, const char *arg, uint64_t tstart)
+{
+    vtk_trace_blk_t *blk = vtk_trace_tls;
+    if (! tstart || ! blk || ! blk->trace) {
+        return;
+    }
+    vtk_span_t *span = &blk->spans[blk->head % VTK_TRACE_SPANS];
+    span->name  = name;
+    span->trace = blk->trace;
+    span->start = tstart;
+    span->dur   = vtk_clock_ns() - tstart;
+    snprintf(span->arg, sizeof(span->arg), "%s", arg ? arg : "");
+    __atomic_store_n(&blk->head, blk->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Chrome trace-event format, complete ("X") events with microsecond timestamps;
+ * spans of a busy thread may be overwritten while being exported
+ */
+int vtk_trace_export(int fd)
+{
+    FILE *fout = fdopen(dup(fd), "w");
+    if (! fout) {
+        vtk_loge("Can't export trace: %s", strerror(errno));
+        return -1;
+    }
+    int   pid = getpid();
+    char *sep = "";
+
+    fprintf(fout, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (vtk_trace_blk_t *blk = __atomic_load_n(&vtk_trace_list, __ATOMIC_ACQUIRE); blk; blk = blk->next) {
+        uint64_t head  = __atomic_load_n(&blk->head, __ATOMIC_ACQUIRE);
+        uint64_t first = head > VTK_TRACE_SPANS ? head - VTK_TRACE_SPANS : 0;
+
+        for (uint64_t i = first; i < head; i++) {
+            vtk_span_t *span = &blk->spans[i % VTK_TRACE_SPANS];
+            fprintf(fout, "%s\n{\"name\":\"%s%s%s\",\"cat\":\"vtk\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                          "\"pid\":%d,\"tid\":%d,\"args\":{\"trace\":%llu}}",
+                    sep, span->name, span->arg[0] ? " " : "", span->arg, span->start / 1e3, span->dur / 1e3,
+                    pid, blk->tid, span->trace);
+            sep = ",";
+        }
+    }
+    fprintf(fout, "\n]}\n");
+
+    int rc = ferror(fout) ? -1 : 0;
+    if (fclose(fout) != 0) {
+        rc = -1;
+    }
+    return rc;
+}
+
+int vtk_trace_export_file(const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        vtk_loge("Can't open trace file %s: %s", path, strerror(errno));
+        return -1;
+    }
+    int rc = vtk_trace_export(fd);
+    close(fd);
+    return rc;
+}
@@ -0,0 +1,766 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "vendotek.h"
+
+/*
+ * Socket transports: TCP and Unix domain sockets
+ */
+#define SOCK_NOTSENT_LOWAT  16384  /* unsent bytes the kernel takes, the rest waits in the send scheduler */
+typedef struct sock_conn_s {
+    int                      fd;
+    int                      listener;
+    struct sockaddr_storage  addr;     /* peer address, or own address of the listener */
+    socklen_t                addrlen;
+} sock_conn_t;
+
+static char *
+sock_name(sock_conn_t *sconn, char *buf, size_t len)
+{
+    if (sconn->addr.ss_family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&sconn->addr;
+        snprintf(buf, len, "%s:%u", inet_ntoa(sin->sin_addr), ntohs(sin->sin_port));
+    } else if (sconn->addr.ss_family == AF_UNIX) {
+        struct sockaddr_un *sun = (struct sockaddr_un *)&sconn->addr;
+        snprintf(buf, len, "%s", (sconn->addrlen > offsetof(struct sockaddr_un, sun_path)) && sun->sun_path[0] ?
+                                 sun->sun_path : "unix socket");
+    } else {
+        snprintf(buf, len, "unknown");
+    }
+    return buf;
+}
+
+static int
+sock_addr(sock_conn_t *sconn, int family, const char *addr, const char *port)
+{
+    memset(&sconn->addr, 0, sizeof(sconn->addr));
+    if (family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&sconn->addr;
+        sin->sin_family = AF_INET;
+        sin->sin_port   = htons(port ? atoi(port) : 0);
+        if (! addr || (inet_aton(addr, &sin->sin_addr) == 0)) {
+            vtk_loge("%s %s", "Bad address:", addr ? addr : "(none)");
+            return -1;
+        }
+        sconn->addrlen = sizeof(*sin);
+    } else {
+        struct sockaddr_un *sun = (struct sockaddr_un *)&sconn->addr;
+        sun->sun_family = AF_UNIX;
+        if (! addr || (strlen(addr) >= sizeof(sun->sun_path))) {
+            vtk_loge("%s %s", "Bad socket path:", addr ? addr : "(none)");
+            return -1;
+        }
+        strcpy(sun->sun_path, addr);
+        sconn->addrlen = sizeof(*sun);
+    }
+    return 0;
+}
+
+/*
+ * background traffic queued in the kernel can't be overtaken, so it is kept short there:
+ * the socket is writable only while its unsent bytes are below the mark
+ */
+static void
+sock_lowat(int fd)
+{
+    int lowat = SOCK_NOTSENT_LOWAT;
+    setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+}
+
+static sock_conn_t *
+sock_open(int family, const char *addr, const char *port)
+{
+    sock_conn_t *sconn = vtk_mem_alloc(sizeof(sock_conn_t));
+    if (! sconn) {
+        return NULL;
+    }
+    sconn->fd       = -1;
+    sconn->listener = 0;
+    if (sock_addr(sconn, family, addr, port) < 0) {
+        vtk_mem_free(sconn);
+        return NULL;
+    }
+    sconn->fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sconn->fd < 0) {
+        vtk_loge("%s %s", "Can't create socket:", strerror(errno));
+        vtk_mem_free(sconn);
+        return NULL;
+    }
+    if (family == AF_INET) {
+        int sockopt = 1;
+        setsockopt(sconn->fd, SOL_SOCKET, SO_REUSEADDR, &sockopt, sizeof(sockopt));
+        sock_lowat(sconn->fd);
+    }
+    return sconn;
+}
+
+static void
+sock_close(void *conn)
+{
+    sock_conn_t *sconn = conn;
+    if (sconn->listener && (sconn->addr.ss_family == AF_UNIX)) {
+        unlink(((struct sockaddr_un *)&sconn->addr)->sun_path);
+    }
+    close(sconn->fd);
+    vtk_mem_free(sconn);
+}
+
+static int
+sock_connect(void **conn, int family, int tm, const char *addr, const char *port)
+{
+    char         name[128];
+    sock_conn_t *sconn = sock_open(family, addr, port);
+    if (! sconn) {
+        return -1;
+    }
+    int rconn = connect(sconn->fd, (struct sockaddr *)&sconn->addr, sconn->addrlen);
+    if ((rconn < 0) && (errno != EINPROGRESS)) {
+        vtk_loge("%s %s (%s)", "Can't connect to:", sock_name(sconn, name, sizeof(name)), strerror(errno));
+        sock_close(sconn);
+        return -1;
+    }
+    if (rconn < 0) {
+        struct pollfd pollfd = {
+            .fd     = sconn->fd,
+            .events = POLLOUT
+        };
+        int       sockerr = 0;
+        socklen_t errsize = sizeof(sockerr);
+        int       rpoll   = vtk_poll(&pollfd, 1, tm);
+        if (rpoll == 0) {
+            vtk_loge("%s %s", "Connection timeout. Endpoint:", sock_name(sconn, name, sizeof(name)));
+            sock_close(sconn);
+            return -1;
+        } else if ((rpoll < 0) ||
+                   (getsockopt(sconn->fd, SOL_SOCKET, SO_ERROR, &sockerr, &errsize) < 0) ||
+                   (sockerr != 0)
+                  ) {
+            vtk_loge("%s %s", "Can't connect to:", sock_name(sconn, name, sizeof(name)));
+            sock_close(sconn);
+            return -1;
+        }
+    }
+    vtk_logi("Connected to %s", sock_name(sconn, name, sizeof(name)));
+    *conn = sconn;
+    return 0;
+}
+
+static int
+sock_listen(void **conn, int family, const char *addr, const char *port)
+{
+    sock_conn_t *sconn = sock_open(family, addr, port);
+    if (! sconn) {
+        return -1;
+    }
+    /* stale socket file of the previous run */
+    struct stat st;
+    if ((family == AF_UNIX) && (stat(addr, &st) == 0) && S_ISSOCK(st.st_mode)) {
+        unlink(addr);
+    }
+    if (bind(sconn->fd, (struct sockaddr *)&sconn->addr, sconn->addrlen) < 0) {
+        vtk_loge("%s %s", "Listen socket binding error:", strerror(errno));
+        sock_close(sconn);
+        return -1;
+    }
+    sconn->listener = 1;
+    if (listen(sconn->fd, INT32_MAX) < 0) {
+        vtk_loge("%s %s", "Listen socket error:", strerror(errno));
+        sock_close(sconn);
+        return -1;
+    }
+    *conn = sconn;
+    return 0;
+}
+
+static int
+sock_accept(void **conn, void *lconn)
+{
+    char         name[128];
+    sock_conn_t *lsconn = lconn;
+    sock_conn_t *sconn  = vtk_mem_alloc(sizeof(sock_conn_t));
+    if (! sconn) {
+        return -1;
+    }
+    sconn->listener = 0;
+    sconn->addrlen  = sizeof(sconn->addr);
+    sconn->fd       = accept(lsconn->fd, (struct sockaddr *)&sconn->addr, &sconn->addrlen);
+    if (sconn->fd < 0) {
+        vtk_loge("%s %s", "Can't accept incoming connection:", strerror(errno));
+        vtk_mem_free(sconn);
+        return -1;
+    }
+    long fdflags = (fdflags = fcntl(sconn->fd, F_GETFL, NULL)) < 0 ? 0 : fdflags;
+    fcntl(sconn->fd, F_SETFL, fdflags | O_NONBLOCK);
+    if (sconn->addr.ss_family == AF_INET) {
+        sock_lowat(sconn->fd);
+    }
+    vtk_logi("Client connected from %s", sock_name(sconn, name, sizeof(name)));
+    *conn = sconn;
+    return 0;
+}
+
+static ssize_t
+sock_read(void *conn, void *buf, size_t len)
+{
+    return read(((sock_conn_t *)conn)->fd, buf, len);
+}
+
+static ssize_t
+sock_writev(void *conn, struct iovec *iov, int iovcnt)
+{
+    /* broken connection is reported as error instead of SIGPIPE */
+    struct msghdr msghdr = {
+        .msg_iov    = iov,
+        .msg_iovlen = iovcnt
+    };
+    return sendmsg(((sock_conn_t *)conn)->fd, &msghdr, MSG_NOSIGNAL);
+}
+
+static int
+sock_fd(void *conn)
+{
+    return ((sock_conn_t *)conn)->fd;
+}
+
+/*
+ * socket received from another process: it's a listener or a connection, as the kernel tells
+ */
+static int
+sock_adopt(void **conn, int fd)
+{
+    char         name[128];
+    int          listener = 0;
+    socklen_t    optlen   = sizeof(listener);
+    sock_conn_t *sconn    = vtk_mem_alloc(sizeof(sock_conn_t));
+    if (! sconn) {
+        return -1;
+    }
+    sconn->fd      = fd;
+    sconn->addrlen = sizeof(sconn->addr);
+    if ((getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listener, &optlen) < 0) ||
+        ((listener ? getsockname : getpeername)(fd, (struct sockaddr *)&sconn->addr, &sconn->addrlen) < 0)) {
+        vtk_loge("%s %s", "Can't adopt socket:", strerror(errno));
+        vtk_mem_free(sconn);
+        return -1;
+    }
+    sconn->listener = listener;
+    long fdflags = (fdflags = fcntl(fd, F_GETFL, NULL)) < 0 ? 0 : fdflags;
+    fcntl(fd, F_SETFL, fdflags | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    vtk_logi("Adopted %s %s", listener ? "listener on" : "connection with", sock_name(sconn, name, sizeof(name)));
+    *conn = sconn;
+    return 0;
+}
+
+/* only the descriptor is closed: the socket stays open in the process it was passed to */
+static void
+sock_detach(void *conn)
+{
+    close(((sock_conn_t *)conn)->fd);
+    vtk_mem_free(conn);
+}
+
+/*
+ * Kernel timestamps: software ones always, hardware ones when the NIC is configured to stamp.
+ * Transmit timestamps come back on the error queue, keyed by the byte offset of the last byte
+ * of the write (OPT_ID) and carrying no payload (OPT_TSONLY).
+ */
+static int
+sock_tstamp(void *conn)
+{
+    int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_TX_HARDWARE |
+                SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_RX_HARDWARE |
+                SOF_TIMESTAMPING_SOFTWARE    | SOF_TIMESTAMPING_RAW_HARDWARE |
+                SOF_TIMESTAMPING_OPT_ID      | SOF_TIMESTAMPING_OPT_TSONLY;
+
+    /* Unix domain sockets have no error queue to report transmit timestamps */
+    if (((sock_conn_t *)conn)->addr.ss_family != AF_INET) {
+        vtk_logw("Kernel timestamps are supported for TCP only");
+        return -1;
+    }
+    if (setsockopt(((sock_conn_t *)conn)->fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+        vtk_logw("Can't enable kernel timestamps: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void
+sock_tstamp_cmsg(struct msghdr *msghdr, vtk_tstamp_t *ts, uint32_t *id)
+{
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msghdr); cmsg; cmsg = CMSG_NXTHDR(msghdr, cmsg)) {
+        if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SO_TIMESTAMPING)) {
+            struct scm_timestamping *tss = (struct scm_timestamping *)CMSG_DATA(cmsg);
+            ts->sw = tss->ts[0].tv_sec * 1000000000ull + tss->ts[0].tv_nsec;
+            ts->hw = tss->ts[2].tv_sec * 1000000000ull + tss->ts[2].tv_nsec;
+        } else if (id && (((cmsg->cmsg_level == SOL_IP)   && (cmsg->cmsg_type == IP_RECVERR)) ||
+                          ((cmsg->cmsg_level == SOL_IPV6) && (cmsg->cmsg_type == IPV6_RECVERR)))) {
+            struct sock_extended_err *serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if ((serr->ee_errno == ENOMSG) && (serr->ee_origin == SO_EE_ORIGIN_TIMESTAMPING)) {
+                *id = serr->ee_data;
+            }
+        }
+    }
+}
+
+static ssize_t
+sock_read_ts(void *conn, void *buf, size_t len, vtk_tstamp_t *rx)
+{
+    char          control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+    struct iovec  iov    = { .iov_base = buf, .iov_len = len };
+    struct msghdr msghdr = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = control,
+        .msg_controllen = sizeof(control)
+    };
+    ssize_t rcount = recvmsg(((sock_conn_t *)conn)->fd, &msghdr, 0);
+
+    *rx = (vtk_tstamp_t) {0};
+    if (rcount > 0) {
+        sock_tstamp_cmsg(&msghdr, rx, NULL);
+    }
+    return rcount;
+}
+
+static int
+sock_tx_ts(void *conn, vtk_tstamp_t *tx, uint32_t *id)
+{
+    char          control[CMSG_SPACE(sizeof(struct scm_timestamping)) +
+                          CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_storage))];
+    struct msghdr msghdr = {
+        .msg_control    = control,
+        .msg_controllen = sizeof(control)
+    };
+    if (recvmsg(((sock_conn_t *)conn)->fd, &msghdr, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+        return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1;
+    }
+    if (! (msghdr.msg_flags & MSG_ERRQUEUE)) {
+        return 0;
+    }
+    *tx = (vtk_tstamp_t) {0};
+    *id = 0;
+    sock_tstamp_cmsg(&msghdr, tx, id);
+    return 1;
+}
+
+static int
+tcp_connect(void **conn, int tm, const char *addr, const char *port)
+{
+    return sock_connect(conn, AF_INET, tm, addr, port);
+}
+
+static int
+tcp_listen(void **conn, const char *addr, const char *port)
+{
+    return sock_listen(conn, AF_INET, addr, port);
+}
+
+static int
+unix_connect(void **conn, int tm, const char *addr, const char *port)
+{
+    return sock_connect(conn, AF_UNIX, tm, addr, port);
+}
+
+static int
+unix_listen(void **conn, const char *addr, const char *port)
+{
+    return sock_listen(conn, AF_UNIX, addr, port);
+}
+
+const vtk_transport_t vtk_transport_tcp = {
+    .name    = "tcp",
+    .connect = tcp_connect,
+    .listen  = tcp_listen,
+    .accept  = sock_accept,
+    .read    = sock_read,
+    .writev  = sock_writev,
+    .fd      = sock_fd,
+    .close   = sock_close,
+    .tstamp  = sock_tstamp,
+    .read_ts = sock_read_ts,
+    .tx_ts   = sock_tx_ts,
+    .adopt   = sock_adopt,
+    .detach  = sock_detach
+};
+
+const vtk_transport_t vtk_transport_unix = {
+    .name    = "unix",
+    .connect = unix_connect,
+    .listen  = unix_listen,
+    .accept  = sock_accept,
+    .read    = sock_read,
+    .writev  = sock_writev,
+    .fd      = sock_fd,
+    .close   = sock_close,
+    .tstamp  = sock_tstamp,
+    .read_ts = sock_read_ts,
+    .tx_ts   = sock_tx_ts,
+    .adopt   = sock_adopt,
+    .detach  = sock_detach
+};
+
+/*
+ * Memory pipes
+ *
+ * In-process transport: listeners are registered by name, and a connection is a pair of
+ * one-way byte buffers shared by both ends. Writes never block, buffers grow as needed.
+ * Each buffer owns an eventfd, readable while data or EOF is pending, which is the fd of
+ * the reading end; the listener's eventfd is readable while connections wait for accept.
+ */
+typedef struct mem_pipe_s {
+    pthread_mutex_t      lock;
+    char                *data;
+    size_t               len;
+    size_t               offset;
+    size_t               size;
+    int                  closed;   /* one of the ends is gone */
+    int                  refs;
+    int                  efd;
+} mem_pipe_t;
+
+typedef struct mem_conn_s {
+    mem_pipe_t          *rx;
+    mem_pipe_t          *tx;
+    struct mem_conn_s   *next;     /* in the listener backlog */
+} mem_conn_t;
+
+typedef struct mem_listener_s {
+    mem_conn_t           conn;     /* must be first: listeners are closed as connections */
+    char                *name;
+    mem_conn_t          *backlog;
+    mem_conn_t         **backlog_tail;
+    int                  efd;
+    struct mem_listener_s *next;
+} mem_listener_t;
+
+static pthread_mutex_t  mem_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static mem_listener_t  *mem_registry;
+
+static void
+mem_signal(int efd)
+{
+    uint64_t one = 1;
+    if (write(efd, &one, sizeof(one)) < 0) {
+        vtk_logw("Can't signal memory pipe: %s", strerror(errno));
+    }
+}
+
+static void
+mem_unsignal(int efd)
+{
+    uint64_t cnt;
+    if ((read(efd, &cnt, sizeof(cnt)) < 0) && (errno != EAGAIN)) {
+        vtk_logw("Can't reset memory pipe: %s", strerror(errno));
+    }
+}
+
+static mem_pipe_t *
+mem_pipe_new(void)
+{
+    mem_pipe_t *pipe = vtk_mem_alloc(sizeof(mem_pipe_t));
+    if (! pipe) {
+        return NULL;
+    }
+    *pipe = (mem_pipe_t) {
+        .refs = 2,
+        .efd  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)
+    };
+    if (pipe->efd < 0) {
+        vtk_loge("Can't create eventfd: %s", strerror(errno));
+        vtk_mem_free(pipe);
+        return NULL;
+    }
+    pthread_mutex_init(&pipe->lock, NULL);
+    return pipe;
+}
+
+static void
+mem_pipe_unref(mem_pipe_t *pipe)
+{
+    pthread_mutex_lock(&pipe->lock);
+    size_t avail = pipe->len - pipe->offset;
+    int    refs  = --pipe->refs;
+    if (! pipe->closed) {
+        pipe->closed = 1;
+        if (! avail) {
+            mem_signal(pipe->efd);
+        }
+    }
+    pthread_mutex_unlock(&pipe->lock);
+
+    if (! refs) {
+        pthread_mutex_destroy(&pipe->lock);
+        close(pipe->efd);
+        vtk_mem_free(pipe->data);
+        vtk_mem_free(pipe);
+    }
+}
+
+static mem_listener_t *
+mem_find(const char *name)
+{
+    mem_listener_t *listener = mem_registry;
+    while (listener && strcmp(listener->name, name)) {
+        listener = listener->next;
+    }
+    return listener;
+}
+
+static void
+mem_close(void *conn)
+{
+    mem_conn_t *mconn = conn;
+    if (mconn->rx) {
+        mem_pipe_unref(mconn->rx);
+        mem_pipe_unref(mconn->tx);
+        vtk_mem_free(mconn);
+        return;
+    }
+    mem_listener_t *listener = conn;
+
+    pthread_mutex_lock(&mem_registry_lock);
+    mem_listener_t **plistener = &mem_registry;
+    while (*plistener != listener) {
+        plistener = &(*plistener)->next;
+    }
+    *plistener = listener->next;
+    pthread_mutex_unlock(&mem_registry_lock);
+
+    /* connections never accepted are reset */
+    while (listener->backlog) {
+        mem_conn_t *next = listener->backlog->next;
+        mem_close(listener->backlog);
+        listener->backlog = next;
+    }
+    close(listener->efd);
+    vtk_mem_free(listener->name);
+    vtk_mem_free(listener);
+}
+
+static int
+mem_listen(void **conn, const char *addr, const char *port)
+{
+    if (! addr) {
+        vtk_loge("Memory pipe needs a name to listen on");
+        return -1;
+    }
+    pthread_mutex_lock(&mem_registry_lock);
+    if (mem_find(addr)) {
+        pthread_mutex_unlock(&mem_registry_lock);
+        vtk_loge("%s %s", "Listen socket binding error:", strerror(EADDRINUSE));
+        return -1;
+    }
+    mem_listener_t *listener = vtk_mem_alloc(sizeof(mem_listener_t));
+    if (! listener) {
+        pthread_mutex_unlock(&mem_registry_lock);
+        return -1;
+    }
+    *listener = (mem_listener_t) {
+        .name = vtk_mem_strdup(addr),
+        .efd  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+        .next = mem_registry
+    };
+    listener->backlog_tail = &listener->backlog;
+    if (! listener->name || (listener->efd < 0)) {
+        pthread_mutex_unlock(&mem_registry_lock);
+        if (listener->efd < 0) {
+            vtk_loge("Can't create eventfd: %s", strerror(errno));
+        } else {
+            close(listener->efd);
+        }
+        vtk_mem_free(listener->name);
+        vtk_mem_free(listener);
+        return -1;
+    }
+    mem_registry = listener;
+    pthread_mutex_unlock(&mem_registry_lock);
+
+    *conn = listener;
+    return 0;
+}
+
+static int
+mem_connect(void **conn, int tm, const char *addr, const char *port)
+{
+    pthread_mutex_lock(&mem_registry_lock);
+    mem_listener_t *listener = addr ? mem_find(addr) : NULL;
+    if (! listener) {
+        pthread_mutex_unlock(&mem_registry_lock);
+        vtk_loge("%s %s (%s)", "Can't connect to:", addr ? addr : "(none)", strerror(ECONNREFUSED));
+        return -1;
+    }
+    mem_pipe_t *up   = mem_pipe_new();
+    mem_pipe_t *down = up ? mem_pipe_new() : NULL;
+    if (! down) {
+        pthread_mutex_unlock(&mem_registry_lock);
+        if (up) {
+            mem_pipe_unref(up);
+            mem_pipe_unref(up);
+        }
+        return -1;
+    }
+    mem_conn_t *client = vtk_mem_alloc(sizeof(mem_conn_t));
+    mem_conn_t *server = client ? vtk_mem_alloc(sizeof(mem_conn_t)) : NULL;
+    if (! server) {
+        pthread_mutex_unlock(&mem_registry_lock);
+        vtk_mem_free(client);
+        mem_pipe_unref(up);
+        mem_pipe_unref(up);
+        mem_pipe_unref(down);
+        mem_pipe_unref(down);
+        return -1;
+    }
+    *client = (mem_conn_t) { .rx = down, .tx = up };
+    *server = (mem_conn_t) { .rx = up,   .tx = down };
+
+    if (! listener->backlog) {
+        mem_signal(listener->efd);
+    }
+    *listener->backlog_tail = server;
+    listener->backlog_tail  = &server->next;
+    pthread_mutex_unlock(&mem_registry_lock);
+
+    vtk_logi("Connected to %s", addr);
+    *conn = client;
+    return 0;
+}
+
+static int
+mem_accept(void **conn, void *lconn)
+{
+    mem_listener_t *listener = lconn;
+
+    pthread_mutex_lock(&mem_registry_lock);
+    mem_conn_t *server = listener->backlog;
+    if (server) {
+        listener->backlog = server->next;
+        if (! listener->backlog) {
+            listener->backlog_tail = &listener->backlog;
+            mem_unsignal(listener->efd);
+        }
+        server->next = NULL;
+    }
+    pthread_mutex_unlock(&mem_registry_lock);
+
+    if (! server) {
+        vtk_loge("%s %s", "Can't accept incoming connection:", strerror(EAGAIN));
+        return -1;
+    }
+    vtk_logi("Client connected from %s", listener->name);
+    *conn = server;
+    return 0;
+}
+
+static ssize_t
+mem_read(void *conn, void *buf, size_t len)
+{
+    mem_pipe_t *pipe = ((mem_conn_t *)conn)->rx;
+
+    pthread_mutex_lock(&pipe->lock);
+    size_t avail = pipe->len - pipe->offset;
+    if (! avail) {
+        int closed = pipe->closed;
+        pthread_mutex_unlock(&pipe->lock);
+        errno = EAGAIN;
+        return closed ? 0 : -1;
+    }
+    len = len < avail ? len : avail;
+    memcpy(buf, &pipe->data[pipe->offset], len);
+    pipe->offset += len;
+    if (pipe->offset == pipe->len) {
+        pipe->offset = pipe->len = 0;
+        if (! pipe->closed) {
+            mem_unsignal(pipe->efd);
+        }
+    }
+    pthread_mutex_unlock(&pipe->lock);
+    return len;
+}
+
+static ssize_t
+mem_writev(void *conn, struct iovec *iov, int iovcnt)
+{
+    mem_pipe_t *pipe  = ((mem_conn_t *)conn)->tx;
+    size_t      total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+
+    pthread_mutex_lock(&pipe->lock);
+    if (pipe->closed) {
+        pthread_mutex_unlock(&pipe->lock);
+        errno = EPIPE;
+        return -1;
+    }
+    size_t avail = pipe->len - pipe->offset;
+    if (pipe->offset && (pipe->len + total > pipe->size)) {
+        memmove(pipe->data, &pipe->data[pipe->offset], avail);
+        pipe->len    = avail;
+        pipe->offset = 0;
+    }
+    if (pipe->len + total > pipe->size) {
+        char *data = vtk_mem_realloc(pipe->data, (pipe->len + total) * 2);
+        if (! data) {
+            pthread_mutex_unlock(&pipe->lock);
+            errno = ENOMEM;
+            return -1;
+        }
+        pipe->data = data;
+        pipe->size = (pipe->len + total) * 2;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(&pipe->data[pipe->len], iov[i].iov_base, iov[i].iov_len);
+        pipe->len += iov[i].iov_len;
+    }
+    if (! avail && total) {
+        mem_signal(pipe->efd);
+    }
+    pthread_mutex_unlock(&pipe->lock);
+    return total;
+}
+
+static int
+mem_fd(void *conn)
+{
+    mem_conn_t *mconn = conn;
+    return mconn->rx ? mconn->rx->efd : ((mem_listener_t *)conn)->efd;
+}
+
+const vtk_transport_t vtk_transport_mem = {
+    .name    = "mem",
+    .connect = mem_connect,
+    .listen  = mem_listen,
+    .accept  = mem_accept,
+    .read    = mem_read,
+    .writev  = mem_writev,
+    .fd      = mem_fd,
+    .close   = mem_close
+};
+
+const vtk_transport_t *vtk_transport_find(const char *name)
+{
+    const vtk_transport_t *transports[] = { &vtk_transport_tcp, &vtk_transport_unix, &vtk_transport_mem };
+    for (int i = 0; i < sizeof(transports) / sizeof(transports[0]); i++) {
+        if (! strcmp(transports[i]->name, name)) {
+            return transports[i];
+        }
+    }
+    vtk_loge("Unknown transport: %s", name);
+    return NULL;
+}
@@ -8,6 +8,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "vendotek.h"
@@ -26,15 +30,23 @@ void vtk_logline_default(int flags, const char *logline)
 static int            vtk_loglevel = LOG_DEBUG;
 static vtk_logline_fn vtk_logline  = vtk_logline_default;
 
+static __thread char  vtk_log_error[128];
+
 void vtk_log(int flags, const char *format, ...)
 {
+    va_list vlist;
+
+    if ((flags & VTK_LOG_PRIMASK) <= LOG_ERR) {
+        va_start(vlist, format);
+        vsnprintf(vtk_log_error, sizeof(vtk_log_error), format, vlist);
+        va_end(vlist);
+    }
     if ((flags & VTK_LOG_PRIMASK) > vtk_loglevel) {
         return;
     }
 
     char buffer[4096];
 
-    va_list vlist;
     va_start(vlist, format);
     vsnprintf(buffer, sizeof(buffer), format, vlist);
     va_end(vlist);
@@ -42,38 +54,131 @@ void vtk_log(int flags, const char *format, ...)
     vtk_logline(flags, buffer);
 }
 
+const char *vtk_log_last_error(void)
+{
+    return vtk_log_error;
+}
+
 void vtk_logline_set(vtk_logline_fn logline, int loglevel)
 {
     vtk_loglevel = loglevel;
     vtk_logline  = logline ? logline : vtk_logline_default;
 }
 
+/* hex dump without end of line, formatted by lines instead of by bytes */
+static void
+vtk_loghex(int flags, const void *data, size_t len, int spaced)
+{
+    if ((flags & VTK_LOG_PRIMASK) > vtk_loglevel) {
+        return;
+    }
+    const char    *digits = "0123456789ABCDEF";
+    const uint8_t *bytes  = data;
+    char           line[1024];
+    size_t         pos = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        if (pos + 4 > sizeof(line)) {
+            line[pos] = 0;
+            vtk_log(flags | VTK_LOG_NOEOL, "%s", line);
+            pos = 0;
+        }
+        line[pos++] = digits[bytes[i] >> 4];
+        line[pos++] = digits[bytes[i] & 15];
+        if (spaced) {
+            line[pos++] = ' ';
+        }
+    }
+    line[pos] = 0;
+    vtk_log(flags | VTK_LOG_NOEOL, "%s", line);
+}
+
 /*
  * Main State
  */
-typedef struct vkt_sock_s {
-    struct sockaddr_in addr;
-    int                fd;
-} vtk_sock_t;
+typedef struct vtk_field_sink_s {
+    uint16_t      id;
+    vtk_field_fn  fn;
+    void         *ctx;
+} vtk_field_sink_t;
+
+/*
+ * incremental scan of the frame being received; used only when some fields are streamed
+ */
+typedef struct vtk_rxscan_s {
+    size_t            frame;      /* frame size announced by its header */
+    size_t            scan;       /* buffered frame bytes already scanned */
+    size_t            removed;    /* streamed bytes, dropped from the buffer */
+    vtk_field_sink_t *sink;       /* streamed field in progress */
+    uint16_t          field_len;
+    uint16_t          field_off;
+} vtk_rxscan_t;
+
+/*
+ * send queues, one per traffic class; stream offset is where writing resumes
+ */
+#define VTK_SCHED_QUANTUM  4096  /* bytes per round and share */
+
+typedef struct vtk_sched_s {
+    vtk_stream_t     queue[VTK_CLASS_MAX];
+    unsigned         shares[VTK_CLASS_MAX];
+    int64_t          deficit[VTK_CLASS_MAX];
+    int              turn;        /* background class of the current round robin turn */
+    int              granted;     /* its quantum is granted for this turn */
+    int              current;     /* class of the frame on the wire */
+    size_t           left;        /* bytes of that frame not written yet, 0 if none */
+} vtk_sched_t;
 
 struct vtk_s {
-    vtk_net_t    net_state;
-    vtk_sock_t   sock_conn;
-    vtk_sock_t   sock_list;
-    vtk_sock_t   sock_accept;
-    vtk_stream_t stream_up;
-    vtk_stream_t stream_down;
+    vtk_net_t        net_state;
+    const vtk_transport_t *transport;
+    void            *conn;        /* connected or accepted connection */
+    void            *listener;
+    char             listen_name[128];
+    vtk_stream_t     stream_up;
+    vtk_stream_t     stream_down;
+    uint64_t         sess_bytes;
+    uint64_t         sess_frames;
+    vtk_field_sink_t sinks[VTK_FIELD_SINKS];
+    vtk_rxscan_t     rxscan;
+    size_t           rxstreamed;  /* streamed bytes of the frame being received */
+    uint64_t         rxdropped;   /* bytes dropped to resynchronize the stream */
+    size_t           rxskip;      /* bytes of a refused frame yet to arrive and be discarded */
+    vtk_limits_t     limits;      /* resource limits of the peer's frames */
+    vtk_status_rec_t *status;     /* status board record, if published */
+    int              tstamping;   /* kernel timestamps are requested */
+    int              tstamped;    /* ... and enabled on the session socket */
+    uint64_t         txbytes;     /* bytes sent in the session, transmit timestamps are keyed by them */
+    uint32_t         xchg_txid;   /* key of the last byte of the request in flight */
+    uint64_t         xchg_start;  /* the request in flight was sent at, 0 if none */
+    vtk_exchange_t   xchg;        /* exchange in flight */
+    vtk_exchange_t   xchg_last;   /* the last complete one */
+    int              cancel_fd;   /* eventfd, readable while cancellation is pending */
+    uint64_t         cancel_ns;   /* time of the pending cancellation request */
+    vtk_sched_t      sched;
 };
 
 int vtk_init(vtk_t **vtk)
 {
-    *vtk  = malloc(sizeof(vtk_t));
+    *vtk  = vtk_mem_alloc(sizeof(vtk_t));
+    if (! *vtk) {
+        return -1;
+    }
     **vtk = (vtk_t) {
         .net_state = VTK_NET_DOWN,
-        .sock_conn.fd   = -1,
-        .sock_list.fd   = -1,
-        .sock_accept.fd = -1
+        .transport = &vtk_transport_tcp,
+        .cancel_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+        .sched     = {
+            .shares = { 0, 2, 1 },
+            .turn   = VTK_CLASS_RELAY
+        }
     };
+    if ((*vtk)->cancel_fd < 0) {
+        vtk_loge("Can't create cancellation eventfd: %s", strerror(errno));
+        vtk_mem_free(*vtk);
+        *vtk = NULL;
+        return -1;
+    }
     return 0;
 }
 
@@ -81,18 +186,19 @@ void vtk_free(vtk_t *vtk){
     if (! VTK_NET_IS_DOWN(vtk->net_state)) {
         vtk_net_set(vtk, VTK_NET_DOWN, 0, NULL, NULL);
     }
-    if (vtk->sock_conn.fd >= 0) {
-        close(vtk->sock_conn.fd);
-    }
-    if (vtk->sock_accept.fd >= 0) {
-        close(vtk->sock_accept.fd);
+    close(vtk->cancel_fd);
+    vtk_stream_t *streams[] = { &vtk->stream_up, &vtk->stream_down };
+    for (int i = 0; i < 2; i++) {
+        if (streams[i]->pool && vtk_bufpool_owns(streams[i]->pool, streams[i]->data)) {
+            vtk_bufpool_put(streams[i]->pool, streams[i]->data);
+        } else {
+            vtk_mem_free(streams[i]->data);
+        }
     }
-    if (vtk->sock_list.fd >= 0) {
-        close(vtk->sock_list.fd);
+    for (int i = 0; i < VTK_CLASS_MAX; i++) {
+        vtk_mem_free(vtk->sched.queue[i].data);
     }
-    free(vtk->stream_up.data);
-    free(vtk->stream_down.data);
-    free(vtk);
+    vtk_mem_free(vtk);
 }
 
 /*
@@ -103,8 +209,11 @@ typedef struct msg_arg_s {
     uint16_t   len;
     char      *val;
     size_t     val_sz;
+    int        mapped;    /* val is a read-only file mapping of val_sz bytes, not a heap buffer */
 } msg_arg_t;
 
+#define VTK_MSG_REFS  8   /* mapped arguments passed to the socket by reference */
+
 typedef struct msg_hdr_s {
     uint16_t   len;
     uint16_t   proto;
@@ -155,7 +264,10 @@ char * vtk_msg_stringify(uint16_t id)
 
 int vtk_msg_init(vtk_msg_t **msg, vtk_t *vtk)
 {
-    *msg  = malloc(sizeof(vtk_msg_t));
+    *msg  = vtk_mem_alloc(sizeof(vtk_msg_t));
+    if (! *msg) {
+        return -1;
+    }
     **msg = (vtk_msg_t) {
         .vtk = vtk,
         .header = {
@@ -166,18 +278,33 @@ int vtk_msg_init(vtk_msg_t **msg, vtk_t *vtk)
     return 0;
 }
 
+static void
+vtk_msg_arg_unmap(msg_arg_t *arg)
+{
+    if (arg->mapped) {
+        munmap(arg->val, arg->val_sz);
+        arg->val    = NULL;
+        arg->val_sz = 0;
+        arg->mapped = 0;
+    }
+}
+
 void vtk_msg_free(vtk_msg_t  *msg)
 {
+    if (! msg) {
+        return;
+    }
     for (int iarg = 0; (iarg < msg->args_sz); iarg++) {
-        free(msg->args[iarg].val);
+        vtk_msg_arg_unmap(&msg->args[iarg]);
+        vtk_mem_free(msg->args[iarg].val);
     }
-    free(msg->args);
-    free(msg);
+    vtk_mem_free(msg->args);
+    vtk_mem_free(msg);
 }
 
 int vtk_msg_find_param(vtk_msg_t *msg, uint16_t id, uint16_t *len, char **value)
 {
-    for (int iarg = 0; (iarg < msg->args_sz); iarg++) {
+    for (int iarg = 0; (iarg < msg->args_cnt); iarg++) {
         if (msg->args[iarg].id == id) {
             if (len) {
                 *len   = msg->args[iarg].len;
@@ -202,63 +329,237 @@ int vtk_msg_iter_param(vtk_msg_t *msg, uint16_t iparam, uint16_t *id, uint16_t *
     return 0;
 }
 
-int vtk_msg_mod(vtk_msg_t *msg, vtk_msgmod_t mod, uint16_t id, uint16_t len, char *value)
+/*
+ * Message names: three letters, case-insensitive, hashed into 16 slots. The hash is perfect
+ * for the names of the protocol, which is checked at compile time, so a lookup is one slot
+ * and one integer compare.
+ */
+#define VTK_MSGNAME_HASH(a, b, c)  ((3 * ((a) & 0xDF) + ((b) & 0xDF) + ((c) & 0xDF)) & 15)
+#define VTK_MSGNAME_KEY(a, b, c)   ((((a) & 0xDF) << 16) | (((b) & 0xDF) << 8) | ((c) & 0xDF))
+#define VTK_MSGNAME_BIT(a, b, c)   (1u << VTK_MSGNAME_HASH(a, b, c))
+#define VTK_MSGNAME_SLOT(a, b, c, name) \
+    [VTK_MSGNAME_HASH(a, b, c)] = { VTK_MSGNAME_KEY(a, b, c), name }
+
+static const struct vtk_msgname_slot_s {
+    uint32_t       key;
+    vtk_msgname_t  name;
+} vtk_msgname_slots[16] = {
+    VTK_MSGNAME_SLOT('I', 'D', 'L', VTK_MSGNAME_IDL),
+    VTK_MSGNAME_SLOT('D', 'I', 'S', VTK_MSGNAME_DIS),
+    VTK_MSGNAME_SLOT('S', 'T', 'A', VTK_MSGNAME_STA),
+    VTK_MSGNAME_SLOT('V', 'R', 'P', VTK_MSGNAME_VRP),
+    VTK_MSGNAME_SLOT('F', 'I', 'N', VTK_MSGNAME_FIN),
+    VTK_MSGNAME_SLOT('A', 'B', 'R', VTK_MSGNAME_ABR),
+    VTK_MSGNAME_SLOT('C', 'D', 'P', VTK_MSGNAME_CDP),
+    VTK_MSGNAME_SLOT('M', 'F', 'R', VTK_MSGNAME_MFR),
+    VTK_MSGNAME_SLOT('C', 'O', 'N', VTK_MSGNAME_CON),
+    VTK_MSGNAME_SLOT('D', 'A', 'T', VTK_MSGNAME_DAT),
+    VTK_MSGNAME_SLOT('D', 'S', 'C', VTK_MSGNAME_DSC),
+};
+
+_Static_assert(__builtin_popcount(
+    VTK_MSGNAME_BIT('I', 'D', 'L') | VTK_MSGNAME_BIT('D', 'I', 'S') | VTK_MSGNAME_BIT('S', 'T', 'A') |
+    VTK_MSGNAME_BIT('V', 'R', 'P') | VTK_MSGNAME_BIT('F', 'I', 'N') | VTK_MSGNAME_BIT('A', 'B', 'R') |
+    VTK_MSGNAME_BIT('C', 'D', 'P') | VTK_MSGNAME_BIT('M', 'F', 'R') | VTK_MSGNAME_BIT('C', 'O', 'N') |
+    VTK_MSGNAME_BIT('D', 'A', 'T') | VTK_MSGNAME_BIT('D', 'S', 'C')) == VTK_MSGNAME_MAX - 1,
+    "message name hash isn't perfect");
+
+static const char *vtk_msgname_strs[VTK_MSGNAME_MAX] = {
+    [VTK_MSGNAME_UNKNOWN] = "UNKNOWN",
+    [VTK_MSGNAME_IDL] = "IDL", [VTK_MSGNAME_DIS] = "DIS", [VTK_MSGNAME_STA] = "STA", [VTK_MSGNAME_VRP] = "VRP",
+    [VTK_MSGNAME_FIN] = "FIN", [VTK_MSGNAME_ABR] = "ABR", [VTK_MSGNAME_CDP] = "CDP", [VTK_MSGNAME_MFR] = "MFR",
+    [VTK_MSGNAME_CON] = "CON", [VTK_MSGNAME_DAT] = "DAT", [VTK_MSGNAME_DSC] = "DSC"
+};
+
+vtk_msgname_t vtk_msgname_lookup(const char *name, size_t len)
+{
+    if (! name || (len != 3)) {
+        return VTK_MSGNAME_UNKNOWN;
+    }
+    uint8_t a = name[0], b = name[1], c = name[2];
+    const struct vtk_msgname_slot_s *slot = &vtk_msgname_slots[VTK_MSGNAME_HASH(a, b, c)];
+
+    return (slot->key == VTK_MSGNAME_KEY(a, b, c)) ? slot->name : VTK_MSGNAME_UNKNOWN;
+}
+
+const char *vtk_msgname_str(vtk_msgname_t name)
+{
+    return ((name >= 0) && (name < VTK_MSGNAME_MAX)) ? vtk_msgname_strs[name] : vtk_msgname_strs[0];
+}
+
+vtk_msgname_t vtk_msg_name(vtk_msg_t *msg)
+{
+    char     *name = NULL;
+    uint16_t  len  = 0;
+    vtk_msg_find_param(msg, 0x1, &len, &name);
+    return vtk_msgname_lookup(name, len);
+}
+
+int vtk_msg_dispatch(const vtk_dispatch_t *dispatch, vtk_msg_t *msg, void *ctx)
+{
+    vtk_msgname_t      name = vtk_msg_name(msg);
+    vtk_msg_handler_fn fn   = dispatch->fn[name];
+    if (! fn) {
+        vtk_loge("No handler for %s message", vtk_msgname_str(name));
+        return -1;
+    }
+    return fn(ctx, msg);
+}
+
+/* hex digit values, -1 for the rest */
+static const int8_t vtk_hex_table[256] = {
+    ['0'] = 0,  ['1'] = 1,  ['2'] = 2,  ['3'] = 3,  ['4'] = 4,
+    ['5'] = 5,  ['6'] = 6,  ['7'] = 7,  ['8'] = 8,  ['9'] = 9,
+    ['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+    ['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+    [0 ... '/'] = -1, [':' ... '@'] = -1, ['G' ... '`'] = -1, ['g' ... 0xFF] = -1
+};
+
+static int
+vtk_hex_decode(char *out, const char *hex, size_t outlen)
 {
-    if (VTK_MSG_MODADD(mod)) {
-        size_t newlen = msg->header.len + VTK_MSG_VARLEN(id) + VTK_MSG_VARLEN(len);
-        if (newlen > VTK_MSG_MAXLEN) {
+    const uint8_t *in = (const uint8_t *)hex;
+
+    for (size_t i = 0; i < outlen; i++, in += 2) {
+        int hi = vtk_hex_table[in[0]];
+        int lo = vtk_hex_table[in[1]];
+        if ((hi | lo) < 0) {
             return -1;
         }
-        msg->header.len = newlen;
+        out[i] = (hi << 4) | lo;
+    }
+    return 0;
+}
 
-        if (msg->args_cnt == msg->args_sz) {
-            msg->args_sz = msg->args_sz ? (msg->args_sz * 2) : 1;
-            msg->args = realloc(msg->args, sizeof(msg_arg_t) * msg->args_sz);
-            memset(&msg->args[msg->args_cnt], 0, sizeof(msg_arg_t) * (msg->args_sz - msg->args_cnt));
+/*
+ * ADDSTR - value is a C string; ADDBIN - value is len bytes; ADDHEX - value is a string of hex
+ * digits, len of them, or the whole string if len is 0; ADDFILE - value is a file name, the file
+ * is mapped and goes to the socket straight from the mapping
+ */
+int vtk_msg_mod(vtk_msg_t *msg, vtk_msgmod_t mod, uint16_t id, uint16_t len, char *value)
+{
+    if (mod == VTK_MSG_RESET) {
+        for (int iarg = 0; iarg < msg->args_cnt; iarg++) {
+            vtk_msg_arg_unmap(&msg->args[iarg]);
         }
+        msg->header.proto = id;
+        msg->header.len   = sizeof(msg->header.proto);
+        msg->args_cnt     = 0;
+        return 0;
     }
+    if (! VTK_MSG_MODADD(mod)) {
+        return -1;
+    }
+    /*
+     * argument value length
+     */
+    size_t vallen = 0;
+    int    fd     = -1;
+
     if (mod == VTK_MSG_ADDSTR) {
-        msg_arg_t *arg = &msg->args[msg->args_cnt];
-        arg->id = id;
-        arg->len = strlen(value);
-        if (msg->header.len + arg->len > VTK_MSG_MAXLEN) {
+        vallen = strlen(value);
+    } else if (mod == VTK_MSG_ADDBIN) {
+        vallen = len;
+    } else if (mod == VTK_MSG_ADDHEX) {
+        size_t hexlen = len ? len : strlen(value);
+        if (hexlen % 2) {
+            vtk_loge("Odd number of hex digits in the argument 0x%x", id);
             return -1;
         }
-        msg->header.len += arg->len;
-
-        if (arg->val_sz <= arg->len) {
-            arg->val = realloc(arg->val, arg->len + 1);
-            arg->val_sz = arg->len + 1;
+        vallen = hexlen / 2;
+    } else if (mod == VTK_MSG_ADDFILE) {
+        struct stat st;
+        if (((fd = open(value, O_RDONLY | O_CLOEXEC)) < 0) || (fstat(fd, &st) < 0)) {
+            vtk_loge("Can't open argument 0x%x file %s: %s", id, value, strerror(errno));
+            if (fd >= 0) {
+                close(fd);
+            }
+            return -1;
         }
-        snprintf(arg->val, arg->val_sz, "%s", value);
-        msg->args_cnt++;
+        vallen = st.st_size;
     }
-    if (mod == VTK_MSG_ADDBIN) {
-        msg_arg_t *arg = &msg->args[msg->args_cnt];
-        arg->id = id;
-        arg->len = len;
-        if (msg->header.len + arg->len > VTK_MSG_MAXLEN) {
-            return -1;
+    size_t newlen = msg->header.len + VTK_MSG_VARLEN(id) + VTK_MSG_VARLEN(vallen) + vallen;
+    if ((vallen > VTK_MSG_MAXLEN) || (newlen > VTK_MSG_MAXLEN)) {
+        vtk_loge("Argument 0x%x doesn't fit the message: %lu bytes", id, vallen);
+        if (fd >= 0) {
+            close(fd);
         }
-        msg->header.len += arg->len;
+        return -1;
+    }
 
-        if (arg->val_sz <= arg->len) {
-            arg->val = realloc(arg->val, arg->len + 1);
-            arg->val_sz = arg->len + 1;
+    if (msg->args_cnt == msg->args_sz) {
+        size_t     args_sz = msg->args_sz ? (msg->args_sz * 2) : 1;
+        msg_arg_t *args    = vtk_mem_realloc(msg->args, sizeof(msg_arg_t) * args_sz);
+        if (! args) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            return -1;
         }
-        memcpy(arg->val, value, len);
-        arg->val[len] = 0;
-        msg->args_cnt++;
+        memset(&args[msg->args_cnt], 0, sizeof(msg_arg_t) * (args_sz - msg->args_cnt));
+        msg->args    = args;
+        msg->args_sz = args_sz;
     }
-    if (mod == VTK_MSG_RESET) {
-        msg->header.proto = id;
-        msg->header.len   = sizeof(msg->header.proto);
-        msg->args_cnt     = 0;
+    msg_arg_t *arg = &msg->args[msg->args_cnt];
+    vtk_msg_arg_unmap(arg);
+
+    if ((mod == VTK_MSG_ADDFILE) && vallen) {
+        char *map = mmap(NULL, vallen, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            vtk_loge("Can't map argument 0x%x file %s: %s", id, value, strerror(errno));
+            return -1;
+        }
+        /* advice values are not flags, one call each */
+        madvise(map, vallen, MADV_SEQUENTIAL);
+        madvise(map, vallen, MADV_WILLNEED);
+        vtk_mem_free(arg->val);
+        arg->val    = map;
+        arg->val_sz = vallen;
+        arg->mapped = 1;
+    } else {
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (arg->val_sz <= vallen) {
+            char *val = vtk_mem_realloc(arg->val, vallen + 1);
+            if (! val) {
+                return -1;
+            }
+            arg->val    = val;
+            arg->val_sz = vallen + 1;
+        }
+        if (mod == VTK_MSG_ADDHEX) {
+            if (vtk_hex_decode(arg->val, value, vallen) < 0) {
+                vtk_loge("Bad hex digit in the argument 0x%x", id);
+                return -1;
+            }
+        } else if (mod != VTK_MSG_ADDFILE) {
+            memcpy(arg->val, value, vallen);
+        }
+        arg->val[vallen] = 0;
     }
+    arg->id  = id;
+    arg->len = vallen;
+    msg->header.len = newlen;
+    msg->args_cnt++;
 
     return 0;
 }
 
+#ifdef VTK_USDT
+VTK_PROBE_LIST(VTK_PROBE_DEFINE)
+#endif
+
+/* message name (0x01) and operation number (0x03), as carried by tracepoints */
+void vtk_msg_probe_fields(vtk_msg_t *msg, char **name, long *opnum)
+{
+    char *value = NULL;
+
+    *name  = (vtk_msg_find_param(msg, 0x1, NULL, &value) >= 0) ? value : "";
+    *opnum = (vtk_msg_find_param(msg, 0x3, NULL, &value) >= 0) ? atol(value) : -1;
+}
+
 int vtk_msg_print(vtk_msg_t *msg)
 {
     for (int iarg = 0; iarg < msg->args_cnt; iarg++) {
@@ -273,34 +574,79 @@ int vtk_msg_print(vtk_msg_t *msg)
             }
         }
         if (hexout) {
-            for (int i = 0; i < arg->len; i++) {
-                vtk_logio("%0x ", (uint8_t)arg->val[i]);
-            }
+            vtk_loghex(LOG_INFO, arg->val, arg->len, 1);
             vtk_logi("");
         } else {
-            vtk_logi("%s", arg->val);
+            vtk_logi("%.*s", arg->len, arg->val);
         }
     }
     return 0;
 }
 
+/*
+ * Pooled stream draws a pool buffer for the first byte. A frame outgrowing it, or
+ * an exhausted pool, moves the stream to the heap until the stream is released.
+ */
 static int
-vtk_stream_write(vtk_stream_t *stream, uint16_t len, void *data, int logdump)
+vtk_stream_reserve(vtk_stream_t *stream, size_t need)
 {
-    if (stream->len + len >= stream->size) {
-        if (stream->len + len > stream->size * 2) {
-            stream->size = stream->len + len;
-        } else {
-            stream->size = stream->size * 2;
+    if (stream->pool && ! stream->data && (need <= vtk_bufpool_size(stream->pool))) {
+        stream->data = vtk_bufpool_get(stream->pool);
+        stream->size = stream->data ? vtk_bufpool_size(stream->pool) : 0;
+        if (stream->data) {
+            return 0;
+        }
+    }
+    if (need < stream->size) {
+        return 0;
+    }
+    size_t size = need > stream->size * 2 ? need : stream->size * 2;
+    char  *data;
+    if (stream->pool && (! stream->data || vtk_bufpool_owns(stream->pool, stream->data))) {
+        if (! (data = vtk_mem_alloc(size))) {
+            return -1;
+        }
+        if (stream->data) {
+            memcpy(data, stream->data, stream->len);
+            vtk_bufpool_put(stream->pool, stream->data);
         }
-        stream->data = realloc(stream->data, stream->size);
+        vtk_metrics_count(VTK_COUNTER_BUF_HEAP, 1);
+    } else if (! (data = vtk_mem_realloc(stream->data, size))) {
+        return -1;
     }
-    char *cdata = (char *)data;
-    for (int i = 0; i < len; i++) {
-        stream->data[stream->len + i] = cdata[i];
-        if (logdump) {
-            vtk_logdo("%02X", (uint8_t)cdata[i]);
+    stream->data = data;
+    stream->size = size;
+    return 0;
+}
+
+/*
+ * drained stream: pooled one returns its buffer, heap one keeps it for the next frame
+ */
+static void
+vtk_stream_release(vtk_stream_t *stream)
+{
+    if (stream->pool && stream->data) {
+        if (vtk_bufpool_owns(stream->pool, stream->data)) {
+            vtk_bufpool_put(stream->pool, stream->data);
+        } else {
+            vtk_mem_free(stream->data);
         }
+        stream->data = NULL;
+        stream->size = 0;
+    }
+    stream->len    = 0;
+    stream->offset = 0;
+}
+
+static int
+vtk_stream_write(vtk_stream_t *stream, uint16_t len, void *data, int logdump)
+{
+    if (vtk_stream_reserve(stream, stream->len + len) < 0) {
+        return -1;
+    }
+    memcpy(&stream->data[stream->len], data, len);
+    if (logdump) {
+        vtk_loghex(LOG_DEBUG, data, len, 0);
     }
     stream->len += len;
     return len;
@@ -312,12 +658,9 @@ vtk_stream_read(vtk_stream_t *stream, uint16_t len, void *data, int logdump)
     if (stream->offset + len > stream->len) {
         return -1;
     }
-    char *cdata = (char *)data;
-    for (int i = 0; i < len; i++) {
-        cdata[i] = stream->data[stream->offset + i];
-        if (logdump) {
-            vtk_logdo("%02X", (uint8_t)cdata[i]);
-        }
+    memcpy(data, &stream->data[stream->offset], len);
+    if (logdump) {
+        vtk_loghex(LOG_DEBUG, data, len, 0);
     }
     stream->offset += len;
     return len;
@@ -344,16 +687,20 @@ static int
 vtk_varint_deserialize(vtk_stream_t *stream, uint16_t *value)
 {
     uint8_t varint[3];
-    vtk_stream_read(stream, 1, &varint[0], 1);
-
+    if (vtk_stream_read(stream, 1, &varint[0], 1) < 0) {
+        return -1;
+    }
     if (varint[0] <= 127) {
         *value = varint[0];
     } else if ((varint[0] & 127) == 1) {
-        vtk_stream_read(stream, 1, &varint[1], 1);
-        *value = varint[0];
+        if (vtk_stream_read(stream, 1, &varint[1], 1) < 0) {
+            return -1;
+        }
+        *value = varint[1];
     } else if ((varint[0] & 127) == 2) {
-        vtk_stream_read(stream, 1, &varint[1], 1);
-        vtk_stream_read(stream, 1, &varint[2], 1);
+        if (vtk_stream_read(stream, 2, &varint[1], 1) < 0) {
+            return -1;
+        }
         *value = (varint[1] << 8) + varint[2];
     } else {
         return -1;
@@ -361,60 +708,221 @@ vtk_varint_deserialize(vtk_stream_t *stream, uint16_t *value)
     return 0;
 }
 
-int vtk_msg_serialize(vtk_msg_t *msg, vtk_stream_t *stream)
+/*
+ * with iov, values of mapped arguments are left out of the stream: iov gets the stream
+ * pieces interleaved with references to the mappings, up to VTK_MSG_REFS of them
+ */
+static int
+vtk_msg_serialize_iov(vtk_msg_t *msg, vtk_stream_t *stream, struct iovec *iov, int *iovcnt)
 {
     msg_hdr_t swap = {
         .len   = bswap_16(msg->header.len),
         .proto = bswap_16(msg->header.proto),
     };
     stream->offset = stream->len = 0;
-    vtk_stream_write(stream, sizeof(swap.len), &swap.len, 1);
-    vtk_stream_write(stream, sizeof(swap.proto), &swap.proto, 1);
+    int rc = 0;
+    rc |= vtk_stream_write(stream, sizeof(swap.len), &swap.len, 1);
+    rc |= vtk_stream_write(stream, sizeof(swap.proto), &swap.proto, 1);
     vtk_logio(" ");
 
+    size_t     cuts[VTK_MSG_REFS];
+    msg_arg_t *refs[VTK_MSG_REFS];
+    int        nrefs = 0;
+
     for (int iarg = 0; iarg < msg->args_cnt; iarg++) {
         msg_arg_t *arg = &msg->args[iarg];
-        vtk_varint_serialize(stream, arg->id);
-        vtk_varint_serialize(stream, arg->len);
-        vtk_stream_write(stream, arg->len, arg->val, 1);
+        rc |= vtk_varint_serialize(stream, arg->id);
+        rc |= vtk_varint_serialize(stream, arg->len);
+        if (iov && arg->mapped && (nrefs < VTK_MSG_REFS)) {
+            cuts[nrefs]   = stream->len;
+            refs[nrefs++] = arg;
+            vtk_logio("<%u bytes mapped>", arg->len);
+        } else {
+            rc |= vtk_stream_write(stream, arg->len, arg->val, 1);
+        }
         vtk_logio(" ");
     }
     vtk_logi("");
+    if (rc < 0) {
+        stream->offset = stream->len = 0;
+        return -1;
+    }
+
+    if (iov) {
+        size_t from = 0;
+        *iovcnt = 0;
+        for (int i = 0; i < nrefs; i++) {
+            iov[(*iovcnt)++] = (struct iovec) { &stream->data[from], cuts[i] - from };
+            iov[(*iovcnt)++] = (struct iovec) { refs[i]->val, refs[i]->len };
+            from = cuts[i];
+        }
+        iov[(*iovcnt)++] = (struct iovec) { &stream->data[from], stream->len - from };
+    }
+
+    if (VTK_PROBE_ENABLED(msg_serialize)) {
+        char *name;
+        long  opnum;
+        vtk_msg_probe_fields(msg, &name, &opnum);
+        VTK_PROBE(msg_serialize, name, opnum, stream->len);
+    }
     return 0;
 }
 
+int vtk_msg_serialize(vtk_msg_t *msg, vtk_stream_t *stream)
+{
+    return vtk_msg_serialize_iov(msg, stream, NULL, NULL);
+}
+
+/*
+ * size of the first complete frame after stream offset, 0 if the frame isn't received yet
+ */
+static size_t
+vtk_stream_frame(vtk_stream_t *stream)
+{
+    if (stream->len < stream->offset + sizeof(uint16_t)) {
+        return 0;
+    }
+    uint8_t *head  = (uint8_t *)&stream->data[stream->offset];
+    size_t   frame = sizeof(uint16_t) + ((head[0] << 8) | head[1]);
+
+    return (stream->len - stream->offset >= frame) ? frame : 0;
+}
+
+#define VTK_PARSE_CHECK  16
+
+/*
+ * parse one frame from the beginning of the stream; offset is left at the end of the frame
+ */
 int vtk_msg_deserialize(vtk_msg_t *msg, vtk_stream_t *stream)
 {
     stream->offset = 0;
 
-    if (stream->len < sizeof(msg->header.len)) {
+    size_t frame = vtk_stream_frame(stream);
+    if (frame < sizeof(msg_hdr_t)) {
         return -1;
     }
     msg_hdr_t swap;
     vtk_stream_read(stream, sizeof(swap), &swap, 1);
-    msg->header.len   = bswap_16(msg->header.len);
-    msg->header.proto = bswap_16(msg->header.proto);
+    vtk_msg_mod(msg, VTK_MSG_RESET, bswap_16(swap.proto), 0, NULL);
+
+    vtk_limits_t *limits = msg->vtk ? &msg->vtk->limits : NULL;
+    uint64_t      tstart = (limits && limits->parse_ns) ? vtk_clock_ns() : 0;
 
     vtk_logio(" ");
-    for (int iarg = 0; stream->offset < stream->len; iarg++) {
+    for (int iarg = 0; stream->offset < frame; iarg++) {
+        if (limits && limits->args && (iarg >= limits->args)) {
+            vtk_logi("");
+            vtk_loge("Message has more than %lu arguments", limits->args);
+            vtk_metrics_count(VTK_COUNTER_LIMIT_ARGS, 1);
+            stream->offset = frame;
+            return -1;
+        }
+        /* the clock is polled once per VTK_PARSE_CHECK arguments */
+        if (tstart && ! ((iarg + 1) % VTK_PARSE_CHECK) && (vtk_clock_ns() - tstart > limits->parse_ns)) {
+            vtk_logi("");
+            vtk_loge("Message parsing took more than %llu ns", limits->parse_ns);
+            vtk_metrics_count(VTK_COUNTER_LIMIT_PARSE, 1);
+            stream->offset = frame;
+            return -1;
+        }
         msg_arg_t arg = {0};
-        vtk_varint_deserialize(stream, &arg.id);
-        vtk_varint_deserialize(stream, &arg.len);
-        vtk_msg_mod(msg, VTK_MSG_ADDBIN, arg.id, arg.len, &stream->data[stream->offset]);
-
-        for (int i = 0; i < arg.len; i++) {
-            vtk_logio("%02X", (uint8_t)stream->data[stream->offset]);
-            stream->offset++;
+        if ((vtk_varint_deserialize(stream, &arg.id)  < 0) ||
+            (vtk_varint_deserialize(stream, &arg.len) < 0) ||
+            (stream->offset + arg.len > frame) ||
+            (vtk_msg_mod(msg, VTK_MSG_ADDBIN, arg.id, arg.len, &stream->data[stream->offset]) < 0)) {
+            vtk_logi("");
+            vtk_loge("Malformed message argument #%d at offset %lu", iarg, stream->offset);
+            stream->offset = frame;
+            return -1;
         }
+
+        vtk_loghex(LOG_DEBUG, &stream->data[stream->offset], arg.len, 0);
+        stream->offset += arg.len;
         vtk_logio(" ");
     }
     vtk_logi("");
+
+    if (VTK_PROBE_ENABLED(msg_deserialize)) {
+        char *name;
+        long  opnum;
+        vtk_msg_probe_fields(msg, &name, &opnum);
+        VTK_PROBE(msg_deserialize, name, opnum, frame);
+    }
     return 0;
 }
 
+/*
+ * Exchanges: a request and the first reply to it, split by kernel timestamps into POS think time
+ * and local time. Relayed host traffic goes both ways meanwhile and is no reply.
+ */
+static int
+vtk_xchg_relayed(vtk_msg_t *msg)
+{
+    vtk_msgname_t name = vtk_msg_name(msg);
+    return (name == VTK_MSGNAME_CON) || (name == VTK_MSGNAME_DAT) || (name == VTK_MSGNAME_DSC);
+}
+
+/* transmit timestamps are drained on every send and receive, pending ones make the socket POLLERR */
+static void
+vtk_xchg_tx(vtk_t *vtk)
+{
+    vtk_tstamp_t tx;
+    uint32_t     id;
+    while (vtk->transport->tx_ts(vtk->conn, &tx, &id) > 0) {
+        /*
+         * the first timestamp keyed at or past the last byte of the request: TCP may coalesce
+         * later writes into its segment; software and hardware timestamps come separately
+         */
+        if (vtk->xchg_start && ((int32_t)(id - vtk->xchg_txid) >= 0)) {
+            vtk->xchg.tx.sw = vtk->xchg.tx.sw ? vtk->xchg.tx.sw : tx.sw;
+            vtk->xchg.tx.hw = vtk->xchg.tx.hw ? vtk->xchg.tx.hw : tx.hw;
+        }
+    }
+}
+
+static void
+vtk_xchg_start(vtk_t *vtk, vtk_msg_t *msg, uint64_t tstart)
+{
+    if (! vtk_xchg_relayed(msg)) {
+        vtk->xchg       = (vtk_exchange_t) { .request = vtk_msg_name(msg) };
+        vtk->xchg_last  = (vtk_exchange_t) {0};
+        vtk->xchg_start = tstart;
+        vtk->xchg_txid  = vtk->txbytes - 1;
+    }
+    vtk_xchg_tx(vtk);
+}
+
+static void
+vtk_xchg_done(vtk_t *vtk, vtk_msg_t *msg)
+{
+    vtk_exchange_t *xchg = &vtk->xchg;
+    if (vtk_xchg_relayed(msg)) {
+        xchg->rx = (vtk_tstamp_t) {0};
+        return;
+    }
+    xchg->total     = vtk_clock_ns() - vtk->xchg_start;
+    vtk->xchg_start = 0;
+
+    int hw = xchg->tx.hw && (xchg->rx.hw > xchg->tx.hw);
+    if (! hw && ! (xchg->tx.sw && (xchg->rx.sw > xchg->tx.sw))) {
+        return;
+    }
+    /* kernel and library clocks differ, think time can't exceed the whole exchange though */
+    uint64_t think = hw ? xchg->rx.hw - xchg->tx.hw : xchg->rx.sw - xchg->tx.sw;
+    xchg->think = think < xchg->total ? think : xchg->total;
+    xchg->local = xchg->total - xchg->think;
+
+    int stage = vtk_metrics_stage(vtk_msgname_str(xchg->request)) - VTK_METRIC_STAGE_IDL;
+    vtk_metrics_observe(VTK_METRIC_THINK_IDL + stage, xchg->think, 0);
+    vtk_metrics_observe(VTK_METRIC_LOCAL_IDL + stage, xchg->local, 0);
+    vtk->xchg_last = *xchg;
+}
+
 /*
  * Network State
  */
+#define VTK_NET_WRITE_TM  15000  /* ms to wait for a full socket buffer to drain */
+
 char *vtk_net_stringify(vtk_net_t vtk_net)
 {
     switch(vtk_net) {
@@ -426,44 +934,64 @@ char *vtk_net_stringify(vtk_net_t vtk_net)
     }
 }
 
-int vtk_net_set(vtk_t *vtk, vtk_net_t net_to, int tm, char *addr, char *port)
+static void
+vtk_session_init(vtk_t *vtk)
 {
-    if (VTK_NET_IS_DOWN(vtk->net_state) && VTK_NET_IS_LISTEN(net_to)) {
-        /*
-         * setup listen socket
-         */
-        vtk_sock_t *lsock = &vtk->sock_list;
+    vtk->sess_bytes  = 0;
+    vtk->sess_frames = 0;
+    vtk_metrics_count(VTK_COUNTER_SESSIONS, 1);
+
+    vtk->txbytes    = 0;
+    vtk->xchg_start = 0;
+    vtk->tstamped   = vtk->tstamping && vtk->transport->tstamp && (vtk->transport->tstamp(vtk->conn) >= 0);
+    if (vtk->tstamping && ! vtk->transport->tstamp) {
+        vtk_logw("Transport %s has no kernel timestamps", vtk->transport->name);
+    }
+}
 
-        lsock->fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (lsock->fd < 0) {
-            vtk_loge("%s", "Can't create listen socket");
-            return -1;
+static void
+vtk_session_fini(vtk_t *vtk)
+{
+    vtk_metrics_observe(VTK_METRIC_SESSION_BYTES,  vtk->sess_bytes,  0);
+    vtk_metrics_observe(VTK_METRIC_SESSION_FRAMES, vtk->sess_frames, 0);
+
+    /* bytes left from the closed connection mean nothing to the next one */
+    vtk_stream_release(&vtk->stream_down);
+    vtk->rxscan     = (vtk_rxscan_t) {0};
+    vtk->rxstreamed = 0;
+    vtk->rxskip     = 0;
+
+    vtk_sched_t *sched = &vtk->sched;
+    for (int i = 0; i < VTK_CLASS_MAX; i++) {
+        if (sched->queue[i].len > sched->queue[i].offset) {
+            vtk_logw("%lu queued bytes are dropped with the session", sched->queue[i].len - sched->queue[i].offset);
         }
-        int sockoption = 1;
-        setsockopt(lsock->fd, SOL_SOCKET, SO_REUSEADDR, &sockoption, sizeof(sockoption));
+        sched->queue[i].len = sched->queue[i].offset = 0;
+        sched->deficit[i]   = 0;
+    }
+    sched->left = 0;
+}
 
-        lsock->addr.sin_family = AF_INET;
-        lsock->addr.sin_port   = htons(atoi(port));
-        if (inet_aton(addr, &lsock->addr.sin_addr) == 0) {
-            vtk_loge("%s %s", "Bad listen addr:", addr);
-            close(lsock->fd);
-            lsock->fd = -1;
-            return -1;
-        }
-        if (bind(lsock->fd, (struct sockaddr *)&lsock->addr, sizeof(lsock->addr)) < 0) {
-            vtk_loge("%s %s", "Listen socket binding error:", strerror(errno));
-            close(lsock->fd);
-            lsock->fd = -1;
-            return -1;
-        }
-        if (listen(lsock->fd, INT32_MAX) < 0) {
-            vtk_loge("%s %s", "Listen socket error:", strerror(errno));
-            close(lsock->fd);
-            lsock->fd = -1;
+static void
+vtk_net_close(vtk_t *vtk, void **conn)
+{
+    vtk->transport->close(*conn);
+    *conn = NULL;
+}
+
+static int
+vtk_net_set_run(vtk_t *vtk, vtk_net_t net_to, int tm, char *addr, char *port)
+{
+    if (VTK_NET_IS_DOWN(vtk->net_state) && VTK_NET_IS_LISTEN(net_to)) {
+        /*
+         * setup listener
+         */
+        if (vtk->transport->listen(&vtk->listener, addr, port) < 0) {
             return -1;
         }
+        snprintf(vtk->listen_name, sizeof(vtk->listen_name), port ? "%s:%s" : "%s", addr, port);
         vtk->net_state = net_to;
-        vtk_logi("Start to listen on %s:%s", addr, port);
+        vtk_logi("Start to listen on %s (%s)", vtk->listen_name, vtk->transport->name);
         return 0;
     }
 
@@ -471,53 +999,33 @@ int vtk_net_set(vtk_t *vtk, vtk_net_t net_to, int tm, char *addr, char *port)
         /*
          * accept incoming connection
          */
-        vtk_sock_t *lsock = &vtk->sock_list;
-        vtk_sock_t *asock = &vtk->sock_accept;
-        socklen_t   asize = sizeof(asock->addr);
-
-        asock->fd = accept(lsock->fd, (struct sockaddr *)&asock->addr, &asize);
-        if (asock->fd < 0) {
-            vtk_loge("%s %s", "Can't accept incoming connection:", strerror(errno));
+        if (vtk->transport->accept(&vtk->conn, vtk->listener) < 0) {
             return -1;
         }
-        long fdflags = (fdflags = fcntl(asock->fd, F_GETFL, NULL)) < 0 ? 0 : fdflags;
-        fcntl(asock->fd, F_SETFL, fdflags | O_NONBLOCK);
-
         vtk->net_state = net_to;
-        vtk_logi("Client connected from %s:%u",
-                  inet_ntoa(asock->addr.sin_addr), ntohs(asock->addr.sin_port));
+        vtk_session_init(vtk);
         return 0;
     }
 
     if (VTK_NET_IS_ACCEPTED(vtk->net_state) && VTK_NET_IS_LISTEN(net_to)) {
         /*
-         * close incoming connection; listen socket remains open and should be reused
+         * close incoming connection; listener remains open and should be reused
          */
-        vtk_sock_t *lsock = &vtk->sock_list;
-        vtk_sock_t *asock = &vtk->sock_accept;
-        close(asock->fd);
-        asock->fd = -1;
-        memset(&asock->addr, 0, sizeof(asock->addr));
+        vtk_session_fini(vtk);
+        vtk_net_close(vtk, &vtk->conn);
 
         vtk->net_state = net_to;
-        vtk_logi("Client connected was closed. Continue listen on %s:%u",
-                  inet_ntoa(lsock->addr.sin_addr), ntohs(lsock->addr.sin_port));
+        vtk_logi("Client connected was closed. Continue listen on %s", vtk->listen_name);
         return 0;
     }
 
     if (VTK_NET_IS_ACCEPTED(vtk->net_state) && VTK_NET_IS_DOWN(net_to)) {
         /*
-         * close incoming connection; listen socket should be closed too
+         * close incoming connection; listener should be closed too
          */
-        vtk_sock_t *lsock = &vtk->sock_list;
-        vtk_sock_t *asock = &vtk->sock_accept;
-        close(asock->fd);
-        asock->fd = -1;
-        memset(&asock->addr, 0, sizeof(asock->addr));
-
-        close(lsock->fd);
-        lsock->fd = -1;
-        memset(&lsock->addr, 0, sizeof(lsock->addr));
+        vtk_session_fini(vtk);
+        vtk_net_close(vtk, &vtk->conn);
+        vtk_net_close(vtk, &vtk->listener);
 
         vtk->net_state = net_to;
         vtk_logi("Network state is DOWN");
@@ -527,13 +1035,9 @@ int vtk_net_set(vtk_t *vtk, vtk_net_t net_to, int tm, char *addr, char *port)
 
     if (VTK_NET_IS_LISTEN(vtk->net_state) && VTK_NET_IS_DOWN(net_to)) {
         /*
-         * close listen socket
+         * close listener
          */
-        vtk_sock_t *lsock = &vtk->sock_list;
-
-        close(lsock->fd);
-        lsock->fd = -1;
-        memset(&lsock->addr, 0, sizeof(lsock->addr));
+        vtk_net_close(vtk, &vtk->listener);
 
         vtk->net_state = net_to;
         vtk_logi("Network state is DOWN");
@@ -544,60 +1048,18 @@ int vtk_net_set(vtk_t *vtk, vtk_net_t net_to, int tm, char *addr, char *port)
         /*
          * setup outgoing connection
          */
-        vtk_sock_t *csock = &vtk->sock_conn;
-
-        csock->fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (csock->fd < 0) {
-            vtk_loge("%s", "Can't create connect socket");
-            return -1;
-        }
-        int       sockopt = 1;
-        socklen_t socksize = sizeof(sockopt);
-        setsockopt(csock->fd, SOL_SOCKET, SO_REUSEADDR, &sockopt, socksize);
-
-        long fdflags = (fdflags = fcntl(csock->fd, F_GETFL, NULL)) < 0 ? 0 : fdflags;
-        fcntl(csock->fd, F_SETFL, fdflags | O_NONBLOCK);
-
-        csock->addr.sin_family = AF_INET;
-        csock->addr.sin_port   = htons(atoi(port));
-        if (inet_aton(addr, &csock->addr.sin_addr) == 0) {
-            vtk_loge("%s %s", "Bad connection addr:", addr);
-            close(csock->fd);
-            csock->fd = -1;
-            return -1;
-        }
-        int rconn = connect(csock->fd, (struct sockaddr *)&csock->addr, sizeof(csock->addr));
-        if ((rconn >= 0) || (errno != EINPROGRESS)) {
-            vtk_loge("%s %s:%u (%s)", "Can't connect to: ",
-                      inet_ntoa(csock->addr.sin_addr), ntohs(csock->addr.sin_port), strerror(errno));
-            close(csock->fd);
-            csock->fd = -1;
-            return -1;
-        }
-        struct pollfd pollfd = {
-            .fd     = csock->fd,
-            .events = POLLOUT
-        };
-        int rpoll = poll(&pollfd, 1, tm);
-        if (rpoll == 0) {
-            vtk_loge("%s %s:%u", "Connection timeout. Endpoint:",
-                      inet_ntoa(csock->addr.sin_addr), ntohs(csock->addr.sin_port));
-            close(csock->fd);
-            csock->fd = -1;
-            return -1;
-        } else if ((rpoll < 0) ||
-                   (getsockopt(csock->fd, SOL_SOCKET, SO_ERROR, &sockopt, &socksize) < 0) ||
-                   (sockopt != 0)
-                  ) {
-            vtk_loge("%s %s:%u", "Can't connect to:",
-                      inet_ntoa(csock->addr.sin_addr), ntohs(csock->addr.sin_port));
-            close(csock->fd);
-            csock->fd = -1;
+        uint64_t tstart = vtk_clock_ns();
+        uint64_t tspan  = vtk_trace_now();
+        int      rconn  = vtk->transport->connect(&vtk->conn, tm, addr, port);
+
+        vtk_metrics_observe(VTK_METRIC_CONNECT, vtk_clock_ns() - tstart, rconn < 0);
+        vtk_trace_span("connect", NULL, tspan);
+        VTK_PROBE(net_connect, addr, port, rconn, vtk_clock_ns() - tstart);
+        if (rconn < 0) {
             return -1;
         }
-
         vtk->net_state = net_to;
-        vtk_logi("Connected to %s:%u", inet_ntoa(csock->addr.sin_addr), ntohs(csock->addr.sin_port));
+        vtk_session_init(vtk);
         return 0;
     }
 
@@ -605,11 +1067,8 @@ int vtk_net_set(vtk_t *vtk, vtk_net_t net_to, int tm, char *addr, char *port)
         /*
          * do disconnect
          */
-        vtk_sock_t *csock = &vtk->sock_conn;
-
-        close(csock->fd);
-        csock->fd = -1;
-        memset(&csock->addr, 0, sizeof(csock->addr));
+        vtk_session_fini(vtk);
+        vtk_net_close(vtk, &vtk->conn);
 
         vtk->net_state = net_to;
         vtk_logi("Network state is DOWN");
@@ -621,21 +1080,248 @@ int vtk_net_set(vtk_t *vtk, vtk_net_t net_to, int tm, char *addr, char *port)
     return -1;
 }
 
-vtk_net_t vtk_net_get_state(vtk_t *vtk)
+int vtk_net_set(vtk_t *vtk, vtk_net_t net_to, int tm, char *addr, char *port)
 {
-    return vtk->net_state;
+    VTK_PROBE(net_set, (int)vtk->net_state, (int)net_to);
+
+    int rc = vtk_net_set_run(vtk, net_to, tm, addr, port);
+    if (vtk->status) {
+        rc < 0 ? vtk_status_error(vtk->status, vtk_log_error) : vtk_status_net(vtk->status, vtk->net_state);
+    }
+    return rc;
+}
+
+int vtk_net_set_status(vtk_t *vtk, vtk_status_rec_t *rec)
+{
+    vtk->status = rec;
+    vtk_status_net(rec, vtk->net_state);
+    return 0;
+}
+
+vtk_status_rec_t *vtk_net_get_status(vtk_t *vtk)
+{
+    return vtk->status;
+}
+
+int vtk_net_set_transport(vtk_t *vtk, const vtk_transport_t *transport)
+{
+    if (! VTK_NET_IS_DOWN(vtk->net_state)) {
+        vtk_loge("Transport can be changed in %s network state only", vtk_net_stringify(VTK_NET_DOWN));
+        return -1;
+    }
+    vtk->transport = transport;
+    return 0;
+}
+
+int vtk_net_set_timestamping(vtk_t *vtk, int on)
+{
+    if (! VTK_NET_IS_DOWN(vtk->net_state)) {
+        vtk_loge("Timestamping can be changed in %s network state only", vtk_net_stringify(VTK_NET_DOWN));
+        return -1;
+    }
+    vtk->tstamping = on;
+    return 0;
+}
+
+int vtk_net_get_exchange(vtk_t *vtk, vtk_exchange_t *xchg)
+{
+    if (! vtk->xchg_last.total) {
+        return -1;
+    }
+    *xchg = vtk->xchg_last;
+    return 0;
+}
+
+int vtk_net_set_limits(vtk_t *vtk, const vtk_limits_t *limits)
+{
+    if (limits->frame && (limits->frame < sizeof(msg_hdr_t))) {
+        vtk_loge("Frame limit can't be less than %lu bytes", sizeof(msg_hdr_t));
+        return -1;
+    }
+    if (limits->buffered && (limits->buffered < limits->frame)) {
+        vtk_loge("Buffer limit can't be less than frame limit");
+        return -1;
+    }
+    vtk->limits = *limits;
+    return 0;
+}
+
+int vtk_net_set_bufpool(vtk_t *vtk, vtk_bufpool_t *pool)
+{
+    if (! VTK_NET_IS_DOWN(vtk->net_state)) {
+        vtk_loge("Buffer pool can be changed in %s network state only", vtk_net_stringify(VTK_NET_DOWN));
+        return -1;
+    }
+    vtk_stream_t *streams[] = { &vtk->stream_up, &vtk->stream_down };
+    for (int i = 0; i < 2; i++) {
+        vtk_stream_release(streams[i]);
+        if (! streams[i]->pool) {
+            vtk_mem_free(streams[i]->data);
+        }
+        *streams[i] = (vtk_stream_t) { .pool = pool };
+    }
+    return 0;
+}
+
+void vtk_net_get_limits(vtk_t *vtk, vtk_limits_t *limits)
+{
+    *limits = vtk->limits;
+}
+
+vtk_net_t vtk_net_get_state(vtk_t *vtk)
+{
+    return vtk->net_state;
 }
 
 int vtk_net_get_socket(vtk_t *vtk)
 {
     switch(vtk->net_state) {
-        case VTK_NET_CONNECTED: return vtk->sock_conn.fd;
-        case VTK_NET_LISTENED:  return vtk->sock_list.fd;
-        case VTK_NET_ACCEPTED:  return vtk->sock_accept.fd;
+        case VTK_NET_CONNECTED:
+        case VTK_NET_ACCEPTED:  return vtk->transport->fd(vtk->conn);
+        case VTK_NET_LISTENED:  return vtk->transport->fd(vtk->listener);
         default:                return -1;
     }
 }
 
+/*
+ * Cancellation: the request is a timestamp plus eventfd wakeup, both async-signal-safe
+ */
+int vtk_net_cancel(vtk_t *vtk)
+{
+    uint64_t none = 0, now = vtk_clock_ns();
+    if (__atomic_compare_exchange_n(&vtk->cancel_ns, &none, now ? now : 1, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        uint64_t one = 1;
+        if (write(vtk->cancel_fd, &one, sizeof(one)) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+uint64_t vtk_net_cancelled(vtk_t *vtk)
+{
+    return __atomic_load_n(&vtk->cancel_ns, __ATOMIC_ACQUIRE);
+}
+
+uint64_t vtk_net_cancel_reset(vtk_t *vtk)
+{
+    uint64_t cnt;
+    if ((read(vtk->cancel_fd, &cnt, sizeof(cnt)) < 0) && (errno != EAGAIN)) {
+        vtk_logw("Can't reset cancellation: %s", strerror(errno));
+    }
+    return __atomic_exchange_n(&vtk->cancel_ns, 0, __ATOMIC_ACQ_REL);
+}
+
+int vtk_net_get_cancel_fd(vtk_t *vtk)
+{
+    return vtk->cancel_fd;
+}
+
+/*
+ * write all iovecs to the connection; waits for it to drain in case of EAGAIN
+ */
+static ssize_t
+vtk_net_writev(vtk_t *vtk, struct iovec *iov, int iovcnt)
+{
+    ssize_t bwritten = 0;
+    while (iovcnt) {
+        ssize_t wresult = vtk->transport->writev(vtk->conn, iov, iovcnt);
+        if ((wresult < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+            struct pollfd pollfd = {
+                .fd     = vtk->transport->fd(vtk->conn),
+                .events = POLLOUT
+            };
+            if (vtk_poll(&pollfd, 1, VTK_NET_WRITE_TM) > 0) {
+                continue;
+            }
+            vtk_loge("socket error: send timeout");
+            return -1;
+        } else if (wresult < 0) {
+            vtk_loge("socket error: %s", strerror(errno));
+            return -1;
+        } else if (wresult == 0) {
+            vtk_loge("unexpected socket behavior (buffer overflow?)");
+            return -1;
+        }
+        bwritten += wresult;
+        for (; iovcnt && (wresult >= iov->iov_len); iov++, iovcnt--) {
+            wresult -= iov->iov_len;
+        }
+        if (iovcnt) {
+            iov->iov_base  = (char *)iov->iov_base + wresult;
+            iov->iov_len  -= wresult;
+        }
+    }
+    return bwritten;
+}
+
+static int
+vtk_net_send_iov(vtk_t *vtk, vtk_msg_t *msg, struct iovec *iov, int iovcnt)
+{
+    uint64_t tstart   = vtk_clock_ns();
+    uint64_t tspan    = vtk_trace_now();
+    ssize_t  bwritten = vtk_net_writev(vtk, iov, iovcnt);
+    vtk_stream_release(&vtk->stream_up);
+    if (bwritten < 0) {
+        vtk_metrics_observe(VTK_METRIC_SEND, vtk_clock_ns() - tstart, 1);
+        vtk_status_error(vtk->status, vtk_log_error);
+        return -1;
+    }
+    vtk->sess_bytes  += bwritten;
+    vtk->sess_frames += 1;
+    if (vtk->tstamped) {
+        vtk->txbytes += bwritten;
+        vtk_xchg_start(vtk, msg, tstart);
+    }
+    vtk_metrics_count(VTK_COUNTER_BYTES_TX, bwritten);
+    vtk_metrics_count(VTK_COUNTER_FRAMES_TX, 1);
+    vtk_metrics_observe(VTK_METRIC_SEND, vtk_clock_ns() - tstart, 0);
+    if (tspan) {
+        vtk_trace_span("send", vtk_msgname_str(vtk_msg_name(msg)), tspan);
+    }
+
+    if (VTK_PROBE_ENABLED(net_send) || vtk->status) {
+        char *name;
+        long  opnum;
+        vtk_msg_probe_fields(msg, &name, &opnum);
+        vtk_status_frame(vtk->status, 1, name, opnum);
+        VTK_PROBE(net_send, name, opnum, bwritten, vtk_clock_ns() - tstart);
+    }
+
+    vtk_logi("%lu bytes were sent", bwritten);
+    return 0;
+}
+
+/* frames can't interleave, so the one on the wire is finished first */
+static int
+vtk_sched_finish(vtk_t *vtk)
+{
+    vtk_sched_t *sched = &vtk->sched;
+    if (! sched->left) {
+        return 0;
+    }
+    vtk_stream_t *queue = &sched->queue[sched->current];
+    struct iovec  iov   = {
+        .iov_base = &queue->data[queue->offset],
+        .iov_len  = sched->left
+    };
+    ssize_t bwritten = vtk_net_writev(vtk, &iov, 1);
+    if (bwritten < 0) {
+        vtk_status_error(vtk->status, vtk_log_error);
+        return -1;
+    }
+    queue->offset    += bwritten;
+    queue->len        = queue->offset == queue->len ? 0 : queue->len;
+    queue->offset     = queue->len ? queue->offset : 0;
+    sched->left       = 0;
+    vtk->sess_bytes  += bwritten;
+    vtk->sess_frames += 1;
+    vtk->txbytes     += bwritten;
+    vtk_metrics_count(VTK_COUNTER_BYTES_TX, bwritten);
+    vtk_metrics_count(VTK_COUNTER_FRAMES_TX, 1);
+    return 0;
+}
+
 int vtk_net_send(vtk_t *vtk, vtk_msg_t *msg)
 {
     if (! VTK_NET_IS_ESTABLISHED(vtk->net_state)) {
@@ -644,26 +1330,724 @@ int vtk_net_send(vtk_t *vtk, vtk_msg_t *msg)
                   vtk_net_stringify(VTK_NET_CONNECTED));
         return -1;
     }
-    int sock = vtk_net_get_socket(vtk);
-    vtk_msg_serialize(msg, &vtk->stream_up);
+    struct iovec iov[2 * VTK_MSG_REFS + 1];
+    int          iovcnt;
+    if ((vtk_msg_serialize_iov(msg, &vtk->stream_up, iov, &iovcnt) < 0) || (vtk_sched_finish(vtk) < 0)) {
+        return -1;
+    }
+    return vtk_net_send_iov(vtk, msg, iov, iovcnt);
+}
 
-    ssize_t bwritten = 0;
-    for (; bwritten < vtk->stream_up.len; ) {
-        ssize_t wresult = write(sock, &vtk->stream_up.data[bwritten], vtk->stream_up.len - bwritten);
-        if (wresult < 0) {
-            vtk_loge("socket error: %s", strerror(errno));
+/*
+ * serialize the message as if the argument was its last one; the argument value itself
+ * is passed to the socket straight from the caller buffer
+ */
+static int
+vtk_net_serialize_ref(vtk_t *vtk, vtk_msg_t *msg, uint16_t id, uint16_t len, const char *data, struct iovec *iov)
+{
+    if (! VTK_NET_IS_ESTABLISHED(vtk->net_state)) {
+        vtk_loge("Message can be send in case of %s or %s network state",
+                  vtk_net_stringify(VTK_NET_ACCEPTED),
+                  vtk_net_stringify(VTK_NET_CONNECTED));
+        return -1;
+    }
+    size_t   reflen = VTK_MSG_VARLEN(id) + VTK_MSG_VARLEN(len) + len;
+    uint16_t msglen = msg->header.len;
+    if (msglen + reflen > VTK_MSG_MAXLEN) {
+        vtk_loge("Message is too long: %lu bytes", msglen + reflen);
+        return -1;
+    }
+    msg->header.len += reflen;
+    int rc = vtk_msg_serialize(msg, &vtk->stream_up);
+    msg->header.len  = msglen;
+
+    if ((rc < 0) || (vtk_varint_serialize(&vtk->stream_up, id) < 0) ||
+        (vtk_varint_serialize(&vtk->stream_up, len) < 0)) {
+        return -1;
+    }
+    vtk_logi(" +%u bytes", len);
+
+    iov[0] = (struct iovec) { .iov_base = vtk->stream_up.data, .iov_len = vtk->stream_up.len };
+    iov[1] = (struct iovec) { .iov_base = (char *)data,        .iov_len = len                };
+    return len ? 2 : 1;
+}
+
+int vtk_net_send_ref(vtk_t *vtk, vtk_msg_t *msg, uint16_t id, uint16_t len, const char *data)
+{
+    struct iovec iov[2];
+    int          iovcnt = vtk_net_serialize_ref(vtk, msg, id, len, data, iov);
+
+    if ((iovcnt < 0) || (vtk_sched_finish(vtk) < 0)) {
+        return -1;
+    }
+    return vtk_net_send_iov(vtk, msg, iov, iovcnt);
+}
+
+/*
+ * Send scheduler
+ */
+static int
+vtk_sched_enqueue(vtk_t *vtk, vtk_class_t cls, struct iovec *iov, int iovcnt)
+{
+    vtk_stream_t *queue = &vtk->sched.queue[cls];
+
+    /* drained part of the queue is reclaimed once it outweighs the rest */
+    if (queue->offset && (queue->offset >= queue->len - queue->offset)) {
+        memmove(queue->data, &queue->data[queue->offset], queue->len - queue->offset);
+        queue->len   -= queue->offset;
+        queue->offset = 0;
+    }
+    size_t need = queue->len;
+    for (int i = 0; i < iovcnt; i++) {
+        need += iov[i].iov_len;
+    }
+    if (vtk_stream_reserve(queue, need) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(&queue->data[queue->len], iov[i].iov_base, iov[i].iov_len);
+        queue->len += iov[i].iov_len;
+    }
+    vtk_stream_release(&vtk->stream_up);
+    return vtk_net_flush(vtk) < 0 ? -1 : 0;
+}
+
+int vtk_net_queue(vtk_t *vtk, vtk_msg_t *msg, vtk_class_t cls)
+{
+    if (! VTK_NET_IS_ESTABLISHED(vtk->net_state) || (cls >= VTK_CLASS_MAX)) {
+        vtk_loge("Message can be queued to a valid class in case of %s or %s network state",
+                  vtk_net_stringify(VTK_NET_ACCEPTED),
+                  vtk_net_stringify(VTK_NET_CONNECTED));
+        return -1;
+    }
+    struct iovec iov[2 * VTK_MSG_REFS + 1];
+    int          iovcnt;
+    if (vtk_msg_serialize_iov(msg, &vtk->stream_up, iov, &iovcnt) < 0) {
+        return -1;
+    }
+    return vtk_sched_enqueue(vtk, cls, iov, iovcnt);
+}
+
+int vtk_net_queue_ref(vtk_t *vtk, vtk_msg_t *msg, vtk_class_t cls, uint16_t id, uint16_t len, const char *data)
+{
+    struct iovec iov[2];
+    int          iovcnt = (cls < VTK_CLASS_MAX) ? vtk_net_serialize_ref(vtk, msg, id, len, data, iov) : -1;
+
+    return iovcnt < 0 ? -1 : vtk_sched_enqueue(vtk, cls, iov, iovcnt);
+}
+
+/*
+ * class to start the next frame from: queued payment frames at once, then deficit round robin,
+ * where a class may start frames while its deficit covers them
+ */
+static int
+vtk_sched_pick(vtk_sched_t *sched)
+{
+    int backlog = 0;
+    for (int i = VTK_CLASS_PAYMENT + 1; i < VTK_CLASS_MAX; i++) {
+        backlog |= sched->queue[i].len > sched->queue[i].offset;
+    }
+    if (vtk_stream_frame(&sched->queue[VTK_CLASS_PAYMENT])) {
+        return VTK_CLASS_PAYMENT;
+    }
+    while (backlog) {
+        int    cls   = sched->turn;
+        size_t frame = vtk_stream_frame(&sched->queue[cls]);
+
+        if (frame && ! sched->granted) {
+            sched->deficit[cls] += (int64_t)sched->shares[cls] * VTK_SCHED_QUANTUM;
+            sched->granted       = 1;
+        }
+        if (frame && (frame <= sched->deficit[cls])) {
+            sched->deficit[cls] -= frame;
+            return cls;
+        }
+        /* the class is done for this turn, an idle one keeps no credit */
+        sched->deficit[cls] = frame ? sched->deficit[cls] : 0;
+        sched->turn         = (cls + 1 < VTK_CLASS_MAX) ? cls + 1 : VTK_CLASS_PAYMENT + 1;
+        sched->granted      = 0;
+    }
+    return -1;
+}
+
+/* write queued frames until the socket is full (1) or the queues are empty (0) */
+static int
+vtk_sched_write(vtk_t *vtk)
+{
+    vtk_sched_t *sched = &vtk->sched;
+
+    for (;;) {
+        if (! sched->left) {
+            int cls = vtk_sched_pick(sched);
+            if (cls < 0) {
+                return 0;
+            }
+            sched->current = cls;
+            sched->left    = vtk_stream_frame(&sched->queue[cls]);
+        }
+        vtk_stream_t *queue = &sched->queue[sched->current];
+        struct iovec  iov   = {
+            .iov_base = &queue->data[queue->offset],
+            .iov_len  = sched->left
+        };
+        ssize_t wresult = vtk->transport->writev(vtk->conn, &iov, 1);
+        if ((wresult < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))) {
+            return 1;
+        }
+        if (wresult <= 0) {
+            vtk_loge("socket error: %s", wresult < 0 ? strerror(errno) : "nothing written");
+            vtk_status_error(vtk->status, vtk_log_error);
             return -1;
-        } else if (wresult == 0) {
-            vtk_loge("unexpected socket behavior (buffer overflow?)");
+        }
+        queue->offset    += wresult;
+        sched->left      -= wresult;
+        vtk->sess_bytes  += wresult;
+        vtk->txbytes     += wresult;
+        vtk_metrics_count(VTK_COUNTER_BYTES_TX, wresult);
+
+        if (! sched->left) {
+            vtk->sess_frames += 1;
+            vtk_metrics_count(VTK_COUNTER_FRAMES_TX, 1);
+            if (queue->offset == queue->len) {
+                queue->offset = queue->len = 0;
+            }
+        }
+    }
+}
+
+int vtk_net_flush(vtk_t *vtk)
+{
+    if (! VTK_NET_IS_ESTABLISHED(vtk->net_state)) {
+        return 0;
+    }
+    int rc = vtk_sched_write(vtk);
+    if (vtk->tstamped) {
+        vtk_xchg_tx(vtk);
+    }
+    return rc;
+}
+
+size_t vtk_net_queued(vtk_t *vtk, vtk_class_t cls)
+{
+    size_t queued = 0;
+    for (int i = 0; i < VTK_CLASS_MAX; i++) {
+        if ((cls == i) || (cls == VTK_CLASS_MAX)) {
+            queued += vtk->sched.queue[i].len - vtk->sched.queue[i].offset;
+        }
+    }
+    return queued;
+}
+
+int vtk_net_set_shares(vtk_t *vtk, const unsigned *shares)
+{
+    static const unsigned defaults[VTK_CLASS_MAX] = { 0, 2, 1 };
+    for (int i = VTK_CLASS_PAYMENT + 1; i < VTK_CLASS_MAX; i++) {
+        vtk->sched.shares[i] = shares[i] ? shares[i] : defaults[i];
+    }
+    return 0;
+}
+
+/*
+ * Session export: fixed header followed by the unparsed received bytes and the queues in class order
+ */
+#define VTK_EXPORT_MAGIC  0x564B5333  /* "VKS3", changes with the layout of the state */
+
+typedef struct vtk_export_s {
+    uint32_t   magic;
+    uint32_t   net_state;
+    char       transport[16];
+    char       listen_name[128];
+    uint64_t   sess_bytes;
+    uint64_t   sess_frames;
+    uint64_t   rxdropped;
+    uint64_t   rxskip;
+    uint64_t   txbytes;
+    uint32_t   tstamped;
+    uint32_t   turn;
+    uint32_t   granted;
+    uint32_t   shares[VTK_CLASS_MAX];
+    int64_t    deficit[VTK_CLASS_MAX];
+    uint64_t   down;                   /* received bytes not parsed yet */
+    uint64_t   queued[VTK_CLASS_MAX];
+} vtk_export_t;
+
+static int
+vtk_export_put(vtk_stream_t *state, const void *data, size_t len)
+{
+    if (vtk_stream_reserve(state, state->len + len) < 0) {
+        return -1;
+    }
+    memcpy(&state->data[state->len], data, len);
+    state->len += len;
+    return 0;
+}
+
+int vtk_net_export(vtk_t *vtk, vtk_stream_t *state, int *fds, int *nfds)
+{
+    if (VTK_NET_IS_DOWN(vtk->net_state)) {
+        vtk_loge("Session can't be exported in %s network state", vtk_net_stringify(vtk->net_state));
+        return -1;
+    }
+    if (! vtk->transport->adopt || ! vtk->transport->detach) {
+        vtk_loge("Transport %s can't pass sessions to another process", vtk->transport->name);
+        return -1;
+    }
+    if (vtk->rxscan.frame) {
+        vtk_loge("Session can't be exported while a frame is streamed");
+        return -1;
+    }
+    if (vtk_sched_finish(vtk) < 0) {
+        return -1;
+    }
+    vtk_stream_t *down  = &vtk->stream_down;
+    vtk_sched_t  *sched = &vtk->sched;
+    vtk_export_t  exp   = {
+        .magic       = VTK_EXPORT_MAGIC,
+        .net_state   = vtk->net_state,
+        .sess_bytes  = vtk->sess_bytes,
+        .sess_frames = vtk->sess_frames,
+        .rxdropped   = vtk->rxdropped,
+        .rxskip      = vtk->rxskip,
+        .txbytes     = vtk->txbytes,
+        .tstamped    = vtk->tstamped,
+        .turn        = sched->turn,
+        .granted     = sched->granted,
+        .down        = down->len - down->offset
+    };
+    snprintf(exp.transport, sizeof(exp.transport), "%s", vtk->transport->name);
+    snprintf(exp.listen_name, sizeof(exp.listen_name), "%s", vtk->listen_name);
+    for (int i = 0; i < VTK_CLASS_MAX; i++) {
+        exp.shares[i]  = sched->shares[i];
+        exp.deficit[i] = sched->deficit[i];
+        exp.queued[i]  = sched->queue[i].len - sched->queue[i].offset;
+    }
+    state->len = state->offset = 0;
+    int rc = vtk_export_put(state, &exp, sizeof(exp));
+    rc |= vtk_export_put(state, &down->data[down->offset], exp.down);
+    for (int i = 0; i < VTK_CLASS_MAX; i++) {
+        rc |= vtk_export_put(state, &sched->queue[i].data[sched->queue[i].offset], exp.queued[i]);
+    }
+    if (rc < 0) {
+        return -1;
+    }
+
+    *nfds = 0;
+    if (vtk->conn) {
+        fds[(*nfds)++] = vtk->transport->fd(vtk->conn);
+    }
+    if (vtk->listener) {
+        fds[(*nfds)++] = vtk->transport->fd(vtk->listener);
+    }
+    return 0;
+}
+
+int vtk_net_import(vtk_t *vtk, const char *state, size_t len, const int *fds, int nfds)
+{
+    if (! VTK_NET_IS_DOWN(vtk->net_state)) {
+        vtk_loge("Session can be imported in %s network state only", vtk_net_stringify(VTK_NET_DOWN));
+        return -1;
+    }
+    vtk_export_t exp;
+    if (len < sizeof(exp)) {
+        vtk_loge("Session state is truncated");
+        return -1;
+    }
+    memcpy(&exp, state, sizeof(exp));
+    if (exp.magic != VTK_EXPORT_MAGIC) {
+        vtk_loge("Session state of another library version can't be imported");
+        return -1;
+    }
+    size_t total = sizeof(exp) + exp.down;
+    for (int i = 0; i < VTK_CLASS_MAX; i++) {
+        total += exp.queued[i];
+    }
+    int conns     = VTK_NET_IS_ESTABLISHED(exp.net_state);
+    int listeners = VTK_NET_IS_LISTEN(exp.net_state) || VTK_NET_IS_ACCEPTED(exp.net_state);
+    if ((total != len) || (nfds != conns + listeners)) {
+        vtk_loge("Session state doesn't match its size or descriptors");
+        return -1;
+    }
+    const vtk_transport_t *transport = vtk_transport_find(exp.transport);
+    if (! transport) {
+        return -1;
+    }
+    if (! transport->adopt) {
+        vtk_loge("Transport %s can't take sessions from another process", transport->name);
+        return -1;
+    }
+    /* buffers come first, so running out of memory leaves the descriptors to the caller */
+    if (exp.down && (vtk_stream_reserve(&vtk->stream_down, exp.down) < 0)) {
+        return -1;
+    }
+    for (int i = 0; i < VTK_CLASS_MAX; i++) {
+        if (exp.queued[i] && (vtk_stream_reserve(&vtk->sched.queue[i], exp.queued[i]) < 0)) {
             return -1;
-        } else {
-            bwritten += wresult;
         }
     }
-    vtk_logi("%lu bytes were sent", bwritten);
+    if (conns && (transport->adopt(&vtk->conn, fds[0]) < 0)) {
+        return -1;
+    }
+    if (listeners && (transport->adopt(&vtk->listener, fds[conns]) < 0)) {
+        if (vtk->conn) {
+            transport->detach(vtk->conn);
+            vtk->conn = NULL;
+        }
+        return -1;
+    }
+    vtk->transport   = transport;
+    vtk->net_state   = exp.net_state;
+    vtk->sess_bytes  = exp.sess_bytes;
+    vtk->sess_frames = exp.sess_frames;
+    vtk->rxdropped   = exp.rxdropped;
+    vtk->rxskip      = exp.rxskip;
+    vtk->txbytes     = exp.txbytes;
+    vtk->xchg_start  = 0;
+    /*
+     * socket options came along with the socket, so timestamps the old process turned on stay on
+     * (their error queue has to be read); they are turned on if this vtk_t asks for them
+     */
+    vtk->tstamped    = exp.tstamped ||
+                       (vtk->tstamping && vtk->conn && transport->tstamp && (transport->tstamp(vtk->conn) >= 0));
+    snprintf(vtk->listen_name, sizeof(vtk->listen_name), "%s", exp.listen_name);
+
+    const char   *data  = state + sizeof(exp);
+    vtk_stream_t *down  = &vtk->stream_down;
+    vtk_sched_t  *sched = &vtk->sched;
+    if (exp.down) {
+        memcpy(down->data, data, exp.down);
+        data += exp.down;
+    }
+    down->len    = exp.down;
+    down->offset = 0;
+    sched->turn    = exp.turn;
+    sched->granted = exp.granted;
+    for (int i = 0; i < VTK_CLASS_MAX; i++) {
+        vtk_stream_t *queue = &sched->queue[i];
+        if (exp.queued[i]) {
+            memcpy(queue->data, data, exp.queued[i]);
+            data += exp.queued[i];
+        }
+        queue->len        = exp.queued[i];
+        queue->offset     = 0;
+        sched->shares[i]  = exp.shares[i];
+        sched->deficit[i] = exp.deficit[i];
+    }
+    sched->left = 0;
+
+    if (vtk->status) {
+        vtk_status_net(vtk->status, vtk->net_state);
+    }
+    vtk_logi("Session is taken over in %s network state: %lu bytes received, %lu queued",
+             vtk_net_stringify(vtk->net_state), exp.down, total - sizeof(exp) - exp.down);
+    return 0;
+}
+
+void vtk_net_detach(vtk_t *vtk)
+{
+    if (VTK_NET_IS_DOWN(vtk->net_state)) {
+        return;
+    }
+    vtk_stream_release(&vtk->stream_down);
+    vtk->rxscan     = (vtk_rxscan_t) {0};
+    vtk->rxstreamed = 0;
+    vtk->rxskip     = 0;
+    for (int i = 0; i < VTK_CLASS_MAX; i++) {
+        vtk->sched.queue[i].len = vtk->sched.queue[i].offset = 0;
+        vtk->sched.deficit[i]   = 0;
+    }
+    vtk->sched.left = 0;
+
+    if (vtk->conn) {
+        vtk->transport->detach(vtk->conn);
+        vtk->conn = NULL;
+    }
+    if (vtk->listener) {
+        vtk->transport->detach(vtk->listener);
+        vtk->listener = NULL;
+    }
+    vtk->net_state = VTK_NET_DOWN;
+    if (vtk->status) {
+        vtk_status_net(vtk->status, vtk->net_state);
+    }
+    vtk_logi("Session is handed off, network state is DOWN");
+}
+
+int vtk_net_set_field_fn(vtk_t *vtk, uint16_t id, vtk_field_fn fn, void *ctx)
+{
+    vtk_field_sink_t *free_sink = NULL;
+    for (int i = 0; i < VTK_FIELD_SINKS; i++) {
+        vtk_field_sink_t *sink = &vtk->sinks[i];
+        if (sink->fn && (sink->id == id)) {
+            free_sink = sink;
+            break;
+        }
+        if (! sink->fn && ! free_sink) {
+            free_sink = sink;
+        }
+    }
+    if (! free_sink) {
+        vtk_loge("Too many streamed fields, %d is maximum", VTK_FIELD_SINKS);
+        return -1;
+    }
+    *free_sink = (vtk_field_sink_t) {
+        .id  = fn ? id : 0,
+        .fn  = fn,
+        .ctx = ctx
+    };
     return 0;
 }
 
+static vtk_field_sink_t *
+vtk_field_sink(vtk_t *vtk, uint16_t id)
+{
+    for (int i = 0; i < VTK_FIELD_SINKS; i++) {
+        if (vtk->sinks[i].fn && (vtk->sinks[i].id == id)) {
+            return &vtk->sinks[i];
+        }
+    }
+    return NULL;
+}
+
+/* decode varint from raw bytes: size of varint, 0 if more bytes needed, -1 if malformed */
+static int
+vtk_varint_peek(const uint8_t *data, size_t avail, uint16_t *value)
+{
+    if (avail < 1) {
+        return 0;
+    }
+    if (data[0] <= 127) {
+        *value = data[0];
+        return 1;
+    }
+    int size = 1 + (data[0] & 127);
+    if (size > 3) {
+        return -1;
+    }
+    if (avail < size) {
+        return 0;
+    }
+    *value = (size == 2) ? data[1] : ((data[1] << 8) | data[2]);
+    return size;
+}
+
+static void
+vtk_stream_cut(vtk_stream_t *stream, size_t offset, size_t len)
+{
+    memmove(&stream->data[offset], &stream->data[offset + len], stream->len - offset - len);
+    stream->len -= len;
+}
+
+/*
+ * Pass streamed fields of the first buffered frame to their consumers as soon as bytes arrive
+ * and drop them from the buffer. The field stays in the frame with empty value, and frame
+ * length is patched when the whole frame is scanned, so the frame is parsed as usual then.
+ */
+static void
+vtk_stream_scan(vtk_t *vtk)
+{
+    vtk_stream_t *down = &vtk->stream_down;
+    vtk_rxscan_t *rx   = &vtk->rxscan;
+    uint8_t      *data = (uint8_t *)down->data;
+
+    if (! rx->frame) {
+        if (down->len < sizeof(msg_hdr_t)) {
+            return;
+        }
+        rx->frame = sizeof(uint16_t) + ((data[0] << 8) | data[1]);
+        rx->scan  = sizeof(msg_hdr_t);
+    }
+    while (rx->scan < rx->frame - rx->removed) {
+        if (rx->sink) {
+            size_t avail = down->len - rx->scan;
+            avail = avail < rx->field_len - rx->field_off ? avail : rx->field_len - rx->field_off;
+            if (! avail) {
+                return;
+            }
+            rx->sink->fn(rx->sink->ctx, rx->sink->id, down->data + rx->scan, avail, rx->field_off, rx->field_len);
+            vtk_stream_cut(down, rx->scan, avail);
+            vtk->rxstreamed += avail;
+            rx->removed     += avail;
+            rx->field_off += avail;
+            if (rx->field_off == rx->field_len) {
+                rx->sink = NULL;
+            }
+            continue;
+        }
+        uint16_t id, len;
+        int      idsize  = vtk_varint_peek(&data[rx->scan], down->len - rx->scan, &id);
+        int      lensize = (idsize > 0) ? vtk_varint_peek(&data[rx->scan + idsize], down->len - rx->scan - idsize, &len) : idsize;
+        if (! idsize || ! lensize) {
+            return;
+        }
+        if ((idsize < 0) || (lensize < 0)) {
+            /* leave the rest to the parser, it will refuse the frame */
+            break;
+        }
+        vtk_field_sink_t *sink = vtk_field_sink(vtk, id);
+        if (sink && len) {
+            /* keep the field header with zero length */
+            data[rx->scan + idsize] = 0;
+            vtk_stream_cut(down, rx->scan + idsize + 1, lensize - 1);
+            vtk->rxstreamed += lensize - 1;
+            rx->removed     += lensize - 1;
+            rx->scan     += idsize + 1;
+            rx->sink      = sink;
+            rx->field_len = len;
+            rx->field_off = 0;
+            continue;
+        }
+        if (rx->scan + idsize + lensize + len > down->len) {
+            return;
+        }
+        rx->scan += idsize + lensize + len;
+    }
+    size_t patched = rx->frame - rx->removed - sizeof(uint16_t);
+    data[0] = patched >> 8;
+    data[1] = patched & 255;
+    *rx = (vtk_rxscan_t) {0};
+}
+
+/*
+ * Resynchronization: a frame starts with the length and the VMC / POS protocol base. A header
+ * that doesn't look so means the stream is out of sync (line noise, a half-written frame of
+ * the previous connection), and bytes are dropped up to the next plausible header. Both bases
+ * end with 0xFB, so candidates are found with memchr(), which is vectorized by libc.
+ */
+static int
+vtk_frame_plausible(const uint8_t *head)
+{
+    uint16_t len   = (head[0] << 8) | head[1];
+    uint16_t proto = (head[2] << 8) | head[3];
+    return (len >= sizeof(uint16_t)) && ((proto == VTK_BASE_VMC) || (proto == VTK_BASE_POS));
+}
+
+static void
+vtk_stream_resync(vtk_t *vtk)
+{
+    vtk_stream_t *down = &vtk->stream_down;
+    uint8_t      *data = (uint8_t *)down->data;
+    size_t        drop = 0;
+
+    /* the frame being scanned has been checked already */
+    if (vtk->rxscan.frame) {
+        return;
+    }
+    while ((down->len - drop >= sizeof(msg_hdr_t)) && ! vtk_frame_plausible(&data[drop])) {
+        uint8_t *base = memchr(&data[drop + sizeof(msg_hdr_t)], 0xFB, down->len - drop - sizeof(msg_hdr_t));
+        /* keep the tail which may be the beginning of a header */
+        drop = base ? (size_t)(base - data) - (sizeof(msg_hdr_t) - 1) : down->len - (sizeof(msg_hdr_t) - 1);
+    }
+    if (drop) {
+        memmove(data, &data[drop], down->len - drop);
+        down->len -= drop;
+        vtk->rxdropped += drop;
+        vtk_metrics_count(VTK_COUNTER_RESYNCS, 1);
+        vtk_metrics_count(VTK_COUNTER_BYTES_DROPPED, drop);
+        vtk_logw("%lu bytes were dropped to resynchronize the stream", drop);
+    }
+}
+
+/*
+ * Bytes of a refused frame are discarded as they arrive, exactly as many as its header
+ * announced, so parsing resumes at the next frame; its payload is never taken for a header.
+ */
+static void
+vtk_stream_skip(vtk_t *vtk)
+{
+    vtk_stream_t *down = &vtk->stream_down;
+    size_t        skip = vtk->rxskip < down->len ? vtk->rxskip : down->len;
+
+    if (! skip) {
+        return;
+    }
+    memmove(down->data, &down->data[skip], down->len - skip);
+    down->len      -= skip;
+    vtk->rxskip    -= skip;
+    vtk->rxdropped += skip;
+    vtk_metrics_count(VTK_COUNTER_BYTES_DROPPED, skip);
+}
+
+/*
+ * Limits of frame size and buffered bytes are checked as soon as the header / bytes arrive,
+ * so an oversized frame is refused before it is read. Its buffered bytes are discarded and
+ * the rest of it is skipped by vtk_stream_skip(); the frames after it are kept. The buffer
+ * limit applies while the frame at the head is incomplete: complete frames waiting behind
+ * each other are delivered one by one, each call checks the buffer again.
+ */
+static int
+vtk_stream_limit(vtk_t *vtk)
+{
+    vtk_stream_t *down  = &vtk->stream_down;
+    uint8_t      *data  = (uint8_t *)down->data;
+    size_t        frame = vtk->rxscan.frame;
+    size_t        have  = vtk->rxscan.removed + down->len;
+
+    if (! frame && (down->len >= sizeof(uint16_t))) {
+        frame = sizeof(uint16_t) + ((data[0] << 8) | data[1]);
+    }
+    if (vtk->limits.frame && (frame > vtk->limits.frame)) {
+        vtk_loge("Frame of %lu bytes exceeds the limit of %lu bytes", frame, vtk->limits.frame);
+        vtk_metrics_count(VTK_COUNTER_LIMIT_FRAME, 1);
+    } else if (vtk->limits.buffered && (down->len > vtk->limits.buffered) && (have < frame)) {
+        vtk_loge("%lu buffered bytes exceed the limit of %lu bytes", down->len, vtk->limits.buffered);
+        vtk_metrics_count(VTK_COUNTER_LIMIT_BUFFER, 1);
+    } else {
+        return 0;
+    }
+    vtk_status_error(vtk->status, vtk_log_error);
+
+    /* without a header the frame size is unknown, resynchronization takes over */
+    size_t drop = (frame && (have > frame)) ? frame - vtk->rxscan.removed : down->len;
+    vtk->rxskip     = (frame > have) ? frame - have : 0;
+    vtk_metrics_count(VTK_COUNTER_BYTES_DROPPED, drop);
+    vtk->rxdropped += drop;
+    vtk->rxscan     = (vtk_rxscan_t) {0};
+    vtk->rxstreamed = 0;
+    if (drop < down->len) {
+        memmove(data, &data[drop], down->len - drop);
+        down->len -= drop;
+    } else {
+        vtk_stream_release(down);
+    }
+    return -1;
+}
+
+/*
+ * Pooled stream reads no further than the end of the current frame, so it holds one frame
+ * at most; the following ones wait in the socket, and the peer is throttled by TCP window.
+ */
+static size_t
+vtk_stream_want(vtk_t *vtk, size_t room)
+{
+    vtk_stream_t *down = &vtk->stream_down;
+    uint8_t      *data = (uint8_t *)down->data;
+    size_t        want = room;
+
+    if (! down->pool) {
+        return room;
+    }
+    if (vtk->rxskip) {
+        want = vtk->rxskip;
+    } else if (vtk->rxscan.frame) {
+        want = vtk->rxscan.frame - vtk->rxscan.removed - down->len;
+    } else if (down->len < sizeof(uint16_t)) {
+        want = sizeof(msg_hdr_t) - down->len;
+    } else {
+        want = sizeof(uint16_t) + ((data[0] << 8) | data[1]) - down->len;
+    }
+    return (want && (want < room)) ? want : room;
+}
+
+uint64_t vtk_net_get_dropped(vtk_t *vtk)
+{
+    return vtk->rxdropped;
+}
+
+int vtk_net_pending(vtk_t *vtk)
+{
+    return vtk_stream_frame(&vtk->stream_down) > 0;
+}
+
 int vtk_net_recv(vtk_t *vtk, vtk_msg_t *msg, int *eof)
 {
     if (! VTK_NET_IS_ESTABLISHED(vtk->net_state)) {
@@ -672,30 +2056,101 @@ int vtk_net_recv(vtk_t *vtk, vtk_msg_t *msg, int *eof)
                   vtk_net_stringify(VTK_NET_CONNECTED));
         return -1;
     }
-    int     sock = vtk_net_get_socket(vtk);
-    ssize_t rcount = 0;
-    char    buffer[0xff];
+    uint64_t      tstart = vtk_clock_ns();
+    uint64_t      tspan  = vtk_trace_now();
+    ssize_t       rcount = 0;
+    char          buffer[0x4000];
+    vtk_stream_t *down   = &vtk->stream_down;
+
+    /* drop the frame returned by the previous call, keep the following ones */
+    if (down->offset) {
+        memmove(down->data, &down->data[down->offset], down->len - down->offset);
+        down->len   -= down->offset;
+        down->offset = 0;
+    }
+    int streamed = vtk->rxscan.frame;
+    for (int i = 0; i < VTK_FIELD_SINKS; i++) {
+        streamed |= vtk->sinks[i].fn != NULL;
+    }
+    vtk_stream_skip(vtk);
+    vtk_stream_resync(vtk);
+    if (streamed) {
+        vtk_stream_scan(vtk);
+    }
+    if (vtk->tstamped) {
+        vtk_xchg_tx(vtk);
+    }
+    *eof = 0;
+    while (vtk->rxscan.frame || ! vtk_stream_frame(down)) {
+        if (vtk_stream_limit(vtk) < 0) {
+            return -1;
+        }
+        vtk_tstamp_t rx;
+        size_t       want = vtk_stream_want(vtk, sizeof(buffer));
 
-    vtk->stream_down.len = 0;
-    for (;;) {
-        rcount = read(sock, buffer, sizeof(buffer));
+        rcount = vtk->tstamped ? vtk->transport->read_ts(vtk->conn, buffer, want, &rx) :
+                                 vtk->transport->read(vtk->conn, buffer, want);
+        if ((rcount > 0) && vtk->tstamped && vtk->xchg_start && ! vtk->xchg.rx.sw && ! vtk->xchg.rx.hw) {
+            vtk->xchg.rx = rx;
+        }
         if (rcount > 0) {
-            vtk_stream_write(&vtk->stream_down, rcount, buffer, 0);
+            if (vtk_stream_write(down, rcount, buffer, 0) < 0) {
+                return -1;
+            }
+            vtk_stream_skip(vtk);
+            vtk_stream_resync(vtk);
+            if (streamed) {
+                vtk_stream_scan(vtk);
+            }
+        } else if ((rcount < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+            /* broken connection is reported as EOF, it won't deliver anything anymore */
+            vtk_loge("socket error: %s", strerror(errno));
+            *eof = 1;
+            break;
         } else {
             *eof = (rcount == 0);
             break;
         }
     }
-    if (vtk->stream_down.len) {
-        vtk_logi("%lu bytes were read", vtk->stream_down.len);
+    if (vtk_stream_limit(vtk) < 0) {
+        return -1;
+    }
+    size_t frame = vtk_stream_frame(down);
+    if (! frame) {
+        return 0;
+    }
+    size_t wire = frame + vtk->rxstreamed;
+    vtk->rxstreamed = 0;
+    vtk_logi("%lu bytes were read", wire);
+
+    uint64_t tparse = vtk_trace_now();
+    int      rparse = vtk_msg_deserialize(msg, down);
+    if (tparse) {
+        vtk_trace_span("deserialize", vtk_msgname_str(vtk_msg_name(msg)), tparse);
+    }
+    if (down->offset == down->len) {
+        vtk_stream_release(down);
+    }
 
-        vtk_msg_mod(msg, VTK_MSG_RESET, VTK_BASE_FROM_STATE(vtk->net_state), 0, NULL);
+    vtk->sess_bytes  += wire;
+    vtk->sess_frames += 1;
+    vtk_metrics_count(VTK_COUNTER_BYTES_RX, wire);
+    vtk_metrics_count(VTK_COUNTER_FRAMES_RX, 1);
+    vtk_metrics_observe(VTK_METRIC_RECV, vtk_clock_ns() - tstart, rparse < 0);
+    if (vtk->xchg_start && (rparse >= 0)) {
+        vtk_xchg_done(vtk, msg);
+    }
+    if (tspan) {
+        vtk_trace_span("recv", vtk_msgname_str(vtk_msg_name(msg)), tspan);
+    }
 
-        if (vtk_msg_deserialize(msg, &vtk->stream_down) >= 0) {
-            return vtk->stream_down.len;
-        } else {
-            return -1;
-        }
+    if (VTK_PROBE_ENABLED(net_recv) || vtk->status) {
+        char *name;
+        long  opnum;
+        vtk_msg_probe_fields(msg, &name, &opnum);
+        rparse < 0 ? vtk_status_error(vtk->status, vtk_log_error) : vtk_status_frame(vtk->status, 0, name, opnum);
+        VTK_PROBE(net_recv, name, opnum, wire, vtk_clock_ns() - tstart);
     }
-    return 0;
+
+    return rparse >= 0 ? wire : -1;
 }
@@ -4,6 +4,11 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <syslog.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 /*
  * Logging
@@ -26,6 +31,88 @@ typedef void  (*vtk_logline_fn)(int flags, const char *logline);
 
 void vtk_logline_set(vtk_logline_fn logline, int loglevel);
 
+/* the last error logged by the calling thread, regardless of log level */
+const char *vtk_log_last_error(void);
+
+/*
+ * Memory allocation: every library allocation goes through the allocator, libc malloc
+ * by default. vtk_set_allocator() must be called before any other vtk_* call; NULL restores
+ * malloc. vtk_pool_allocator() makes a ready-made allocator over a static buffer, blocks above
+ * its largest class (128 KB) come from the heap. Out of memory is logged and vtk_mem_alloc()
+ * returns NULL (vtk_mem_realloc() leaves the block as it is), library calls fail with -1.
+ * Allocation counters are per thread, so a transaction's count is the difference of
+ * two snapshots taken around it.
+ */
+typedef struct vtk_allocator_s {
+    void *(*alloc)  (void *ctx, size_t size);
+    void *(*realloc)(void *ctx, void *ptr, size_t size);
+    void  (*free)   (void *ctx, void *ptr);
+    void   *ctx;
+} vtk_allocator_t;
+
+typedef struct vtk_alloc_stat_s {
+    uint64_t   allocs;
+    uint64_t   reallocs;
+    uint64_t   frees;
+    uint64_t   bytes;      /* requested by allocs and reallocs */
+} vtk_alloc_stat_t;
+
+int   vtk_set_allocator (const vtk_allocator_t *allocator);
+int   vtk_pool_allocator(vtk_allocator_t *allocator, void *mem, size_t size);
+void  vtk_alloc_stat    (vtk_alloc_stat_t *stat);
+void *vtk_mem_alloc     (size_t size);
+void *vtk_mem_realloc   (void *ptr, size_t size);
+void  vtk_mem_free      (void *ptr);
+char *vtk_mem_strdup    (const char *str);
+
+/*
+ * Buffer pool: fixed number of fixed-size buffers shared by many connections. Streams of
+ * vtk_t with a pool (vtk_net_set_bufpool) draw a buffer when a frame is sent or received and
+ * return it as soon as the frame is done, so idle connections hold no buffers. Frames that
+ * don't fit, or an exhausted pool, fall back to the heap (vtk_bufpool_heap_total counter). vtk_bufpool_get()
+ * returns NULL when the pool is exhausted; vtk_bufpool_pressure() is nonzero when less than
+ * 1/8 of the buffers are left, a signal for producers to hold off new work.
+ */
+typedef struct vtk_bufpool_s vtk_bufpool_t;
+
+typedef struct vtk_bufpool_stat_s {
+    size_t     size;       /* buffer size */
+    size_t     count;
+    size_t     avail;
+    size_t     min_avail;  /* low watermark */
+    uint64_t   gets;
+    uint64_t   exhausted;  /* gets refused for lack of buffers */
+} vtk_bufpool_stat_t;
+
+int    vtk_bufpool_init    (vtk_bufpool_t **pool, size_t size, size_t count);
+void   vtk_bufpool_free    (vtk_bufpool_t  *pool);
+void  *vtk_bufpool_get     (vtk_bufpool_t  *pool);
+void   vtk_bufpool_put     (vtk_bufpool_t  *pool, void *buf);
+int    vtk_bufpool_owns    (vtk_bufpool_t  *pool, void *buf);
+size_t vtk_bufpool_size    (vtk_bufpool_t  *pool);
+int    vtk_bufpool_pressure(vtk_bufpool_t  *pool);
+void   vtk_bufpool_stat    (vtk_bufpool_t  *pool, vtk_bufpool_stat_t *stat);
+
+/*
+ * Clock: the library reads time with vtk_clock_ns() and waits with vtk_poll() (poll(2)
+ * semantics), both served by the clock set with vtk_set_clock(); NULL restores the real one.
+ * vtk_virtual_clock() makes a clock over a caller-owned nanosecond counter: waits with
+ * nothing ready return at once and advance the counter by their timeout, so simulations
+ * run timeout and retry scenarios in no real time. Endless waits (-1) stay real.
+ */
+struct pollfd;
+
+typedef struct vtk_clock_s {
+    uint64_t (*now) (void *ctx);
+    int      (*poll)(void *ctx, struct pollfd *fds, int nfds, int tm);
+    void      *ctx;
+} vtk_clock_t;
+
+int      vtk_set_clock    (const vtk_clock_t *clock);
+void     vtk_virtual_clock(vtk_clock_t *clock, uint64_t *now);
+uint64_t vtk_clock_ns     (void);
+int      vtk_poll         (struct pollfd *fds, int nfds, int tm);
+
 /*
  * Main state structure
  */
@@ -64,11 +151,45 @@ int     vtk_msg_iter_param(vtk_msg_t *msg, uint16_t iparam, uint16_t *id, uint16
 int     vtk_msg_mod  (vtk_msg_t *msg, vtk_msgmod_t mod, uint16_t id, uint16_t len, char *value);
 int     vtk_msg_print(vtk_msg_t *msg);
 
+/*
+ * Message names and dispatch: vtk_msg_name() maps field 0x01 to vtk_msgname_t through a perfect
+ * hash, checked at compile time, so routing a message costs a table lookup and no string compares.
+ * vtk_msg_dispatch() calls the handler indexed by the name of the message, fn[VTK_MSGNAME_UNKNOWN]
+ * for names out of the protocol; it returns the handler result, -1 if there is no handler.
+ */
+typedef enum vtk_msgname_e {
+    VTK_MSGNAME_UNKNOWN,
+    VTK_MSGNAME_IDL,
+    VTK_MSGNAME_DIS,
+    VTK_MSGNAME_STA,
+    VTK_MSGNAME_VRP,
+    VTK_MSGNAME_FIN,
+    VTK_MSGNAME_ABR,
+    VTK_MSGNAME_CDP,
+    VTK_MSGNAME_MFR,
+    VTK_MSGNAME_CON,
+    VTK_MSGNAME_DAT,
+    VTK_MSGNAME_DSC,
+    VTK_MSGNAME_MAX
+} vtk_msgname_t;
+
+typedef int (*vtk_msg_handler_fn)(void *ctx, vtk_msg_t *msg);
+
+typedef struct vtk_dispatch_s {
+    vtk_msg_handler_fn  fn[VTK_MSGNAME_MAX];
+} vtk_dispatch_t;
+
+vtk_msgname_t vtk_msgname_lookup(const char *name, size_t len);
+const char   *vtk_msgname_str   (vtk_msgname_t name);
+vtk_msgname_t vtk_msg_name      (vtk_msg_t *msg);
+int           vtk_msg_dispatch  (const vtk_dispatch_t *dispatch, vtk_msg_t *msg, void *ctx);
+
 typedef struct vtk_stream_s {
-    char      *data;
-    size_t     len;
-    size_t     size;
-    size_t     offset;
+    char          *data;
+    size_t         len;
+    size_t         size;
+    size_t         offset;
+    vtk_bufpool_t *pool;     /* buffers are drawn from the pool and returned when drained */
 } vtk_stream_t;
 
 int vtk_msg_serialize  (vtk_msg_t *msg, vtk_stream_t *stream/*, int verbose*/);
@@ -94,6 +215,425 @@ int       vtk_net_set(vtk_t *vtk, vtk_net_t net_to, int tm, char *addr, char *po
 vtk_net_t vtk_net_get_state(vtk_t *vtk);
 int       vtk_net_get_socket(vtk_t *vtk);
 int       vtk_net_send(vtk_t *vtk, vtk_msg_t *msg);
+int       vtk_net_send_ref(vtk_t *vtk, vtk_msg_t *msg, uint16_t id, uint16_t len, const char *data);
 int       vtk_net_recv(vtk_t *vtk, vtk_msg_t *msg, int *eof);
+int       vtk_net_pending(vtk_t *vtk);
+
+/*
+ * Frames are checked for plausible header (length and protocol base) before parsing; on garbage
+ * the receiver drops bytes up to the next plausible header. vtk_net_get_dropped() returns
+ * the number of bytes dropped since vtk_init().
+ */
+uint64_t  vtk_net_get_dropped(vtk_t *vtk);
+
+/*
+ * Resource limits of the peer's frames, per vtk_t; zero disables a limit, all are disabled
+ * by default. A violating frame is refused at once with -1 from vtk_net_recv(), before it is
+ * read or parsed completely, so a misbehaving peer can't make the process allocate or spin.
+ */
+typedef struct vtk_limits_s {
+    size_t     frame;      /* frame size in bytes, including length and protocol base */
+    size_t     args;       /* arguments per message */
+    size_t     buffered;   /* bytes received from the peer and not parsed yet */
+    uint64_t   parse_ns;   /* time to parse one frame */
+} vtk_limits_t;
+
+int       vtk_net_set_limits(vtk_t *vtk, const vtk_limits_t *limits);
+void      vtk_net_get_limits(vtk_t *vtk, vtk_limits_t *limits);
+
+int       vtk_net_set_bufpool(vtk_t *vtk, vtk_bufpool_t *pool);
+
+/*
+ * Send scheduler: background frames are queued per traffic class with vtk_net_queue() and written
+ * by vtk_net_flush() without blocking, a whole frame at a time. Queued payment frames go first,
+ * relay and telemetry frames share the bandwidth by deficit round robin in proportion to their shares,
+ * 2:1 by default (vtk_net_set_shares, zero keeps the default). vtk_net_send() doesn't queue: the frame
+ * goes out right after the one already on the wire, ahead of the queued ones. vtk_net_flush()
+ * returns 1 while frames are left (poll the socket for POLLOUT), 0 when it's done; vtk_net_queued()
+ * is the number of bytes queued in a class, in all of them for VTK_CLASS_MAX. Queues are dropped
+ * when the session is closed.
+ */
+typedef enum vtk_class_e {
+    VTK_CLASS_PAYMENT,
+    VTK_CLASS_RELAY,
+    VTK_CLASS_TELEMETRY,
+    VTK_CLASS_MAX
+} vtk_class_t;
+
+int       vtk_net_queue     (vtk_t *vtk, vtk_msg_t *msg, vtk_class_t cls);
+int       vtk_net_queue_ref (vtk_t *vtk, vtk_msg_t *msg, vtk_class_t cls, uint16_t id, uint16_t len, const char *data);
+int       vtk_net_flush     (vtk_t *vtk);
+size_t    vtk_net_queued    (vtk_t *vtk, vtk_class_t cls);
+int       vtk_net_set_shares(vtk_t *vtk, const unsigned *shares);
+
+/*
+ * Cancellation of the operation in flight, e.g. by the customer's cancel button. vtk_net_cancel()
+ * may be called from any thread or from a signal handler (with the default clock): it records
+ * the request time and makes vtk_net_get_cancel_fd() readable, so the application waiting for
+ * POS response wakes up at once and aborts the operation. vtk_net_cancelled() returns the request
+ * time (vtk_clock_ns), 0 if there is no request; vtk_net_cancel_reset() consumes the request.
+ */
+int       vtk_net_cancel       (vtk_t *vtk);
+uint64_t  vtk_net_cancelled    (vtk_t *vtk);
+uint64_t  vtk_net_cancel_reset (vtk_t *vtk);
+int       vtk_net_get_cancel_fd(vtk_t *vtk);
+
+/*
+ * Transports: byte streams the library talks over, TCP by default. Unix domain sockets take
+ * the socket path for addr; in-process memory pipes take any name for addr and connect two
+ * vtk_t of one process at memory speed, e.g. a client and a simulated POS in own threads.
+ * Every connection exposes a file descriptor, readable while data or EOF is pending, to poll.
+ * Custom transports must be nonblocking: read() and writev() fail with EAGAIN if they would
+ * block, read() returns 0 on EOF. The transport may be changed in DOWN network state only.
+ * Kernel timestamping is optional: tstamp() turns it on, read_ts() is read() which also reports
+ * the receive timestamp, tx_ts() pops one transmit timestamp with its byte id (SOF_TIMESTAMPING_OPT_ID)
+ * and returns 0 when there are no more. Only TCP sockets support them, the memory transport leaves them NULL.
+ * Sockets may change hands between processes (hot restart): adopt() wraps a descriptor received from
+ * another process, detach() drops the connection without closing it, as it lives on in the other one.
+ */
+struct iovec;
+
+typedef struct vtk_tstamp_s {
+    uint64_t   sw;    /* software timestamp, CLOCK_REALTIME ns, 0 if none */
+    uint64_t   hw;    /* hardware timestamp, NIC clock ns, 0 if none */
+} vtk_tstamp_t;
+
+typedef struct vtk_transport_s {
+    const char  *name;
+    int        (*connect)(void **conn, int tm, const char *addr, const char *port);
+    int        (*listen) (void **conn, const char *addr, const char *port);
+    int        (*accept) (void **conn, void *lconn);
+    ssize_t    (*read)   (void *conn, void *buf, size_t len);
+    ssize_t    (*writev) (void *conn, struct iovec *iov, int iovcnt);
+    int        (*fd)     (void *conn);
+    void       (*close)  (void *conn);
+    int        (*tstamp) (void *conn);
+    ssize_t    (*read_ts)(void *conn, void *buf, size_t len, vtk_tstamp_t *rx);
+    int        (*tx_ts)  (void *conn, vtk_tstamp_t *tx, uint32_t *id);
+    int        (*adopt)  (void **conn, int fd);
+    void       (*detach) (void *conn);
+} vtk_transport_t;
+
+extern const vtk_transport_t vtk_transport_tcp;
+extern const vtk_transport_t vtk_transport_unix;
+extern const vtk_transport_t vtk_transport_mem;
+
+const vtk_transport_t *vtk_transport_find(const char *name);
+int                    vtk_net_set_transport(vtk_t *vtk, const vtk_transport_t *transport);
+
+/*
+ * Kernel timestamps (SO_TIMESTAMPING): with vtk_net_set_timestamping() on, sessions record when a
+ * request left the host and when the reply to it reached the host, software timestamps and also
+ * hardware ones if the NIC is set up for them (SIOCSHWTSTAMP, e.g. hwstamp_ctl). A request and the
+ * first reply to it (relayed host traffic aside) make an exchange, and its time is split into POS
+ * think time (request on the wire to reply on the wire) and local time (the rest: our scheduling,
+ * serialization and parsing), observed per stage in vtk_pos_think_*_seconds / vtk_local_*_seconds.
+ * Timestamping may be changed in DOWN network state only. vtk_net_get_exchange() returns the last
+ * exchange, -1 while the next one is in flight or if it had no timestamps.
+ */
+typedef struct vtk_exchange_s {
+    vtk_msgname_t  request;   /* name of the request */
+    vtk_tstamp_t   tx;        /* the request left the host */
+    vtk_tstamp_t   rx;        /* the reply reached the host */
+    uint64_t       total;     /* from the send call to the parsed reply, ns */
+    uint64_t       think;     /* POS think time, ns, from hardware timestamps if both are there */
+    uint64_t       local;     /* total less think */
+} vtk_exchange_t;
+
+int vtk_net_set_timestamping(vtk_t *vtk, int on);
+int vtk_net_get_exchange    (vtk_t *vtk, vtk_exchange_t *xchg);
+
+/*
+ * Session export for hot restart: the session goes on in another process, and the peer doesn't
+ * notice. vtk_net_export() finishes the frame on the wire and serializes what the session holds:
+ * received bytes not parsed yet, queued background frames, counters and timestamp keys; its
+ * descriptors (connection, then listener) are to be passed along with SCM_RIGHTS. The session is
+ * intact until vtk_net_detach(), which drops it without closing the connection. vtk_net_import()
+ * adopts state and descriptors in DOWN network state. A frame streamed to a field callback can't be
+ * exported, nor can sessions of transports without adopt() / detach(). The state is freed with vtk_mem_free().
+ */
+#define VTK_NET_EXPORT_FDS  2
+
+int  vtk_net_export(vtk_t *vtk, vtk_stream_t *state, int *fds, int *nfds);
+int  vtk_net_import(vtk_t *vtk, const char *state, size_t len, const int *fds, int nfds);
+void vtk_net_detach(vtk_t *vtk);
+
+/*
+ * Streamed fields: value of the field is passed to the callback chunk by chunk as bytes arrive
+ * from the network, and is never buffered as a whole; the received message holds the field with
+ * empty value. Intended for large fields, e.g. banking receipt (0x13). NULL callback cancels.
+ */
+#define VTK_FIELD_SINKS  4
+
+typedef void (*vtk_field_fn)(void *ctx, uint16_t id, const char *chunk, uint16_t len, uint16_t offset, uint16_t total);
+
+int       vtk_net_set_field_fn(vtk_t *vtk, uint16_t id, vtk_field_fn fn, void *ctx);
+
+/*
+ * TCP/IP relay of POS host traffic (CON / DAT / DSC messages)
+ */
+typedef struct vtk_relay_s vtk_relay_t;
+
+#define VTK_RELAY_MAXCONN           0x20
+
+/* last connection status, reported to POS within TCP/IP destination (0x0B) */
+#define VTK_RELAY_ST_NOSERVICE      0x00
+#define VTK_RELAY_ST_ESTABLISHED    0x01
+#define VTK_RELAY_ST_NEVER          0x02
+#define VTK_RELAY_ST_INACTIVE       0x03
+#define VTK_RELAY_ST_TIMEOUT        0x04
+#define VTK_RELAY_ST_LOCAL          0x05
+#define VTK_RELAY_ST_REMOTE         0x06
+
+typedef struct vtk_relay_stat_s {
+    uint64_t   connects;
+    uint64_t   tx_bytes;      /* to remote hosts */
+    uint64_t   rx_bytes;      /* from remote hosts */
+    uint64_t   blocks_up;     /* data blocks from POS */
+    uint64_t   blocks_down;   /* data blocks to POS */
+} vtk_relay_stat_t;
+
+int  vtk_relay_init   (vtk_relay_t **relay, vtk_t *vtk, int maxconn);
+void vtk_relay_free   (vtk_relay_t  *relay);
+int  vtk_relay_match  (vtk_msg_t *msg);
+int  vtk_relay_handle (vtk_relay_t *relay, vtk_msg_t *msg);
+int  vtk_relay_pollfds(vtk_relay_t *relay, struct pollfd *fds, int nfds);
+int  vtk_relay_timeout(vtk_relay_t *relay);
+int  vtk_relay_process(vtk_relay_t *relay, struct pollfd *fds, int nfds);
+void vtk_relay_stat   (vtk_relay_t *relay, vtk_relay_stat_t *stat);
+
+/*
+ * Metrics
+ */
+typedef enum vtk_metric_e {
+    VTK_METRIC_CONNECT,
+    VTK_METRIC_SEND,
+    VTK_METRIC_RECV,
+    VTK_METRIC_STAGE_IDL,
+    VTK_METRIC_STAGE_VRP,
+    VTK_METRIC_STAGE_FIN,
+    VTK_METRIC_STAGE_OTHER,
+    VTK_METRIC_SESSION_BYTES,
+    VTK_METRIC_SESSION_FRAMES,
+    VTK_METRIC_CANCEL,
+    VTK_METRIC_RESUME,
+    VTK_METRIC_THINK_IDL,
+    VTK_METRIC_THINK_VRP,
+    VTK_METRIC_THINK_FIN,
+    VTK_METRIC_THINK_OTHER,
+    VTK_METRIC_LOCAL_IDL,
+    VTK_METRIC_LOCAL_VRP,
+    VTK_METRIC_LOCAL_FIN,
+    VTK_METRIC_LOCAL_OTHER,
+    VTK_METRIC_MAX
+} vtk_metric_t;
+
+typedef enum vtk_counter_e {
+    VTK_COUNTER_BYTES_TX,
+    VTK_COUNTER_BYTES_RX,
+    VTK_COUNTER_FRAMES_TX,
+    VTK_COUNTER_FRAMES_RX,
+    VTK_COUNTER_SESSIONS,
+    VTK_COUNTER_RESYNCS,
+    VTK_COUNTER_BYTES_DROPPED,
+    VTK_COUNTER_LIMIT_FRAME,
+    VTK_COUNTER_LIMIT_ARGS,
+    VTK_COUNTER_LIMIT_BUFFER,
+    VTK_COUNTER_LIMIT_PARSE,
+    VTK_COUNTER_BUF_HEAP,
+    VTK_COUNTER_MAX
+} vtk_counter_t;
+
+void         vtk_metrics_observe(vtk_metric_t metric, uint64_t value, int failed);
+void         vtk_metrics_count(vtk_counter_t counter, uint64_t value);
+vtk_metric_t vtk_metrics_stage(const char *msgname);
+uint64_t     vtk_metrics_quantile(vtk_metric_t metric, double quantile);
+int          vtk_metrics_export(int fd);
+int          vtk_metrics_export_file(const char *path);
+int          vtk_metrics_listen(const char *path);
+int          vtk_metrics_serve(int lfd);
+
+/*
+ * Tracing: spans of a transaction are recorded into a per-thread ring of the last VTK_TRACE_SPANS
+ * and exported in Chrome trace-event JSON (chrome://tracing, Perfetto). Nothing is recorded until
+ * vtk_trace_enable(1) and vtk_trace_begin(), which gives the calling thread a new trace id; spans
+ * are attributed to it until vtk_trace_end(). vtk_trace_now() is the span start (0 when the thread
+ * isn't traced, then vtk_trace_span() is a no-op). The library records connect, send, recv and
+ * deserialize spans, named with the message name (e.g. "send VRP").
+ */
+#define VTK_TRACE_SPANS  2048
+
+void     vtk_trace_enable     (int on);
+uint64_t vtk_trace_begin      (void);
+void     vtk_trace_end        (void);
+uint64_t vtk_trace_now        (void);
+void     vtk_trace_span       (const char *name, const char *arg, uint64_t tstart);
+int      vtk_trace_export     (int fd);
+int      vtk_trace_export_file(const char *path);
+
+/*
+ * Status board: per-terminal status records in POSIX shared memory (shm_open name, e.g. "/vendotek"),
+ * published by the library as the connection state changes and frames are sent / received.
+ * Records are seqlock-protected, so readers poll them with no syscalls and no locking.
+ * vtk_status_open() with zero slots opens an existing board read-only.
+ */
+typedef struct vtk_status_s vtk_status_t;
+
+#define VTK_STATUS_SLOTS  64
+
+typedef struct vtk_status_rec_s {
+    uint32_t   seq;              /* seqlock sequence, odd while the record is being updated */
+    int32_t    pid;              /* owner process, 0 for a free slot */
+    char       terminal[32];
+    int32_t    net_state;        /* vtk_net_t */
+    char       stage[4];         /* name of the last message sent, e.g. "VRP" */
+    char       reply[4];         /* name of the last message received */
+    uint32_t   errors;
+    int64_t    opnum;            /* last operation number seen, -1 if none */
+    uint64_t   frames_tx;
+    uint64_t   frames_rx;
+    uint64_t   time_net;         /* CLOCK_REALTIME ns of the last net state change */
+    uint64_t   time_sent;
+    uint64_t   time_recv;
+    uint64_t   time_error;
+    char       error[128];       /* last error */
+} vtk_status_rec_t;
+
+int               vtk_status_open   (vtk_status_t **board, const char *name, int slots);
+void              vtk_status_close  (vtk_status_t  *board);
+int               vtk_status_slots  (vtk_status_t *board);
+int               vtk_status_read   (vtk_status_t *board, int islot, vtk_status_rec_t *rec);
+vtk_status_rec_t *vtk_status_claim  (vtk_status_t *board, const char *terminal);
+void              vtk_status_release(vtk_status_rec_t *rec);
+void              vtk_status_net    (vtk_status_rec_t *rec, vtk_net_t state);
+void              vtk_status_frame  (vtk_status_rec_t *rec, int sent, const char *name, long opnum);
+void              vtk_status_error  (vtk_status_rec_t *rec, const char *error);
+int               vtk_net_set_status(vtk_t *vtk, vtk_status_rec_t *rec);
+vtk_status_rec_t *vtk_net_get_status(vtk_t *vtk);
+
+/*
+ * Payment journal: durable log of payment state transitions, vtk_journal_append()
+ * returns when the record is on disk. Transactions left without final state
+ * (DONE / FAILED / UNRESOLVED) by a crash are reported by vtk_journal_pending() after open.
+ * UNRESOLVED ones are left to the operator and survive compaction.
+ */
+typedef struct vtk_journal_s vtk_journal_t;
+
+typedef enum vtk_jstate_e {
+    VTK_JOURNAL_VRP = 1,     /* vend request is about to be sent */
+    VTK_JOURNAL_APPROVED,    /* vend request is approved by POS */
+    VTK_JOURNAL_FIN,         /* finalization is about to be sent */
+    VTK_JOURNAL_DONE,        /* finalization is confirmed by POS */
+    VTK_JOURNAL_FAILED,      /* payment failed before approval */
+    VTK_JOURNAL_UNRESOLVED   /* outcome can't be learned from POS, left to the operator */
+} vtk_jstate_t;
+
+typedef struct vtk_jrec_s {
+    uint64_t   txid;
+    uint64_t   time;         /* unix time, filled on append if zero */
+    int64_t    opnum;
+    int64_t    price;        /* price for VRP, finalized amount for FIN */
+    int64_t    prodid;
+    uint32_t   state;        /* vtk_jstate_t */
+    uint32_t   attempts;     /* failed reconciliation attempts */
+} vtk_jrec_t;
+
+int      vtk_journal_open     (vtk_journal_t **journal, const char *path);
+void     vtk_journal_close    (vtk_journal_t  *journal);
+uint64_t vtk_journal_txid     (vtk_journal_t *journal);
+int      vtk_journal_append   (vtk_journal_t *journal, vtk_jrec_t *rec);
+int      vtk_journal_pending  (vtk_journal_t *journal, vtk_jrec_t **recs, size_t *cnt);
+uint64_t vtk_journal_fsyncs   (vtk_journal_t *journal);
+char    *vtk_journal_stringify(vtk_jstate_t state);
+
+/*
+ * Telemetry table: the last POS management data (0x10), local time (0x11) and system information (0x12)
+ * of every terminal, with clock drift and poll counters, in a file of fixed-size records, one per terminal.
+ * vtk_telemetry_update() changes the record in memory; vtk_telemetry_flush() writes the records whose
+ * management data, system information or clock drift (by the second) changed in place and syncs the file
+ * once, so a round over a quiet fleet costs no writes. Records changed by poll counters and timestamps only
+ * are written with the first flush after 10 minutes and by vtk_telemetry_close(). time_changed follows
+ * changes of management data and system information only.
+ */
+typedef struct vtk_telemetry_s vtk_telemetry_t;
+
+#define VTK_DRIFT_UNKNOWN  INT64_MIN
+
+typedef struct vtk_trec_s {
+    char       terminal[32];
+    uint64_t   time_seen;      /* unix time ns of the last answer, 0 if none */
+    uint64_t   time_changed;   /* unix time ns of the last change of the fields */
+    int64_t    drift_ms;       /* POS local time less ours, VTK_DRIFT_UNKNOWN if not reported */
+    uint32_t   rtt_us;
+    uint32_t   polls;
+    uint32_t   failures;       /* polls without answer */
+    uint32_t   reserved;
+    char       mgmt[32];       /* 0x10 */
+    char       localtime[32];  /* 0x11, as reported */
+    char       sysinfo[96];    /* 0x12 */
+} vtk_trec_t;
+
+int    vtk_telemetry_open  (vtk_telemetry_t **table, const char *path);
+void   vtk_telemetry_close (vtk_telemetry_t  *table);
+int    vtk_telemetry_lookup(vtk_telemetry_t *table, const char *terminal, vtk_trec_t *rec);
+int    vtk_telemetry_update(vtk_telemetry_t *table, const vtk_trec_t *rec);
+int    vtk_telemetry_flush (vtk_telemetry_t *table);
+size_t vtk_telemetry_count (vtk_telemetry_t *table);
+int    vtk_telemetry_read  (vtk_telemetry_t *table, size_t i, vtk_trec_t *rec);
+
+/*
+ * Hot restart handoff over a unix socket: the running process listens on the path and, when no
+ * operation is in flight, accepts the new process and sends it the session with vtk_handoff_send();
+ * the new one connects and receives it with vtk_handoff_recv(). Up to VTK_HANDOFF_FDS descriptors
+ * and an opaque state of the application go along (the state is freed with vtk_mem_free()). The
+ * session changes hands only when both sides confirm it: on failure the old process keeps it and
+ * goes on, and the new one closes what it got. Peers running as another user are refused.
+ */
+#define VTK_HANDOFF_FDS  8
+#define VTK_HANDOFF_TM   5000  /* ms to wait for the other side */
+
+int vtk_handoff_listen (const char *path);
+int vtk_handoff_accept (int lsock);
+int vtk_handoff_connect(const char *path);
+int vtk_handoff_send   (int usock, vtk_t *vtk, const int *fds, int nfds, const void *app, size_t len);
+int vtk_handoff_recv   (int usock, vtk_t *vtk, int *fds, int *nfds, void **app, size_t *len);
+
+/*
+ * Static tracepoints (USDT), compiled in with -DVTK_USDT (make USDT=1).
+ * Every probe is guarded by own semaphore, so probe arguments are not even
+ * computed until bpftrace / perf attaches to it:
+ *   bpftrace -e 'usdt:./vendotek-cli:vendotek:net_send { printf("%s %d\n", str(arg0), arg2); }'
+ */
+#define VTK_PROBE_LIST(X) \
+    X(net_set)            \
+    X(net_connect)        \
+    X(net_send)           \
+    X(net_recv)           \
+    X(msg_serialize)      \
+    X(msg_deserialize)    \
+    X(stage_start)        \
+    X(stage_done)
+
+#ifdef VTK_USDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define VTK_PROBE_SEMAPHORE(name)  vendotek_##name##_semaphore
+#define VTK_PROBE_DECLARE(name)    extern unsigned short VTK_PROBE_SEMAPHORE(name);
+#define VTK_PROBE_DEFINE(name)     unsigned short VTK_PROBE_SEMAPHORE(name) __attribute__((section(".probes")));
+#define VTK_PROBE_ENABLED(name)    __builtin_expect(VTK_PROBE_SEMAPHORE(name), 0)
+#define VTK_PROBE(name, ...)       do { if (VTK_PROBE_ENABLED(name)) STAP_PROBEV(vendotek, name, ##__VA_ARGS__); } while (0)
+
+VTK_PROBE_LIST(VTK_PROBE_DECLARE)
+#else
+#define VTK_PROBE_ENABLED(name)    0
+#define VTK_PROBE(name, ...)       do { } while (0)
+#endif
+
+void vtk_msg_probe_fields(vtk_msg_t *msg, char **name, long *opnum);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
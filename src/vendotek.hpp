@@ -0,0 +1,512 @@
+#ifndef VENDOTEK_HPP__
+#define VENDOTEK_HPP__
+
+#include <cerrno>
+#include <charconv>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <poll.h>
+
+#include "vendotek.h"
+
+/*
+ * C++20 layer over the C library, header-only
+ *
+ * vtk::session and vtk::message own vtk_t / vtk_msg_t and are move-only. Message arguments
+ * are read through string_view / span right over the message, nothing is copied. Library
+ * errors, logged and returned as -1 by the C API, are thrown as vtk::error with the text of
+ * the last logged error. Async operations are coroutines (vtk::task) run by vtk::loop, one
+ * poll() over every waiting session, so any number of payments share one thread:
+ *
+ *     vtk::loop    loop;
+ *     vtk::session session(loop);
+ *     session.connect("10.0.0.5", "62801");
+ *     loop.spawn([&]() -> vtk::task<> {
+ *         vtk::payment_result res = co_await session.payment(100);
+ *     }());
+ *     loop.run();
+ *
+ * Connection is established synchronously, bounded by its timeout; waits for POS responses,
+ * which take up to the operation timeout, suspend the coroutine.
+ */
+namespace vtk {
+
+struct error : std::runtime_error {
+    explicit error(const char *what) : std::runtime_error(what && *what ? what : "vendotek error") {}
+    static error last() { return error(vtk_log_last_error()); }
+};
+
+/*
+ * Coroutine task: lazy, started by co_await or loop::spawn(), resumes its awaiter when done
+ */
+template <typename T = void> class task;
+
+namespace detail {
+
+template <typename T>
+struct task_promise_base {
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+    std::exception_ptr      exception;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    struct final_awaiter {
+        bool await_ready() noexcept { return false; }
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+        {
+            return h.promise().continuation;
+        }
+        void await_resume() noexcept {}
+    };
+    final_awaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { exception = std::current_exception(); }
+};
+
+template <typename T>
+struct task_promise : task_promise_base<T> {
+    std::optional<T> value;
+
+    task<T> get_return_object();
+    template <typename U>
+    void return_value(U &&v) { value.emplace(std::forward<U>(v)); }
+    T result()
+    {
+        if (this->exception) {
+            std::rethrow_exception(this->exception);
+        }
+        return std::move(*value);
+    }
+};
+
+template <>
+struct task_promise<void> : task_promise_base<void> {
+    task<void> get_return_object();
+    void return_void() {}
+    void result()
+    {
+        if (exception) {
+            std::rethrow_exception(exception);
+        }
+    }
+};
+
+} /* namespace detail */
+
+template <typename T>
+class task {
+public:
+    using promise_type = detail::task_promise<T>;
+
+    explicit task(std::coroutine_handle<promise_type> h) : coro_(h) {}
+    task(task &&other) noexcept : coro_(std::exchange(other.coro_, nullptr)) {}
+    task &operator=(task &&other) noexcept
+    {
+        if (this != &other) {
+            if (coro_) {
+                coro_.destroy();
+            }
+            coro_ = std::exchange(other.coro_, nullptr);
+        }
+        return *this;
+    }
+    task(const task &) = delete;
+    task &operator=(const task &) = delete;
+    ~task()
+    {
+        if (coro_) {
+            coro_.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return ! coro_ || coro_.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
+    {
+        coro_.promise().continuation = awaiter;
+        return coro_;
+    }
+    T await_resume() { return coro_.promise().result(); }
+
+private:
+    std::coroutine_handle<promise_type> coro_;
+};
+
+namespace detail {
+
+template <typename T>
+task<T> task_promise<T>::get_return_object()
+{
+    return task<T>(std::coroutine_handle<task_promise<T>>::from_promise(*this));
+}
+
+inline task<void> task_promise<void>::get_return_object()
+{
+    return task<void>(std::coroutine_handle<task_promise<void>>::from_promise(*this));
+}
+
+} /* namespace detail */
+
+/*
+ * Event loop: coroutines wait for a descriptor with a deadline; run() polls all of them with
+ * vtk_poll(), so the loop follows the clock set by vtk_set_clock(), virtual one included
+ */
+class loop {
+public:
+    loop() = default;
+    loop(const loop &) = delete;
+    loop &operator=(const loop &) = delete;
+
+    /* co_await loop.readable(fd, ms) is true when fd is readable, false on timeout */
+    struct wait_op {
+        loop                   *owner;
+        int                     fd;
+        short                   events;
+        uint64_t                deadline;
+        short                   revents = 0;
+        std::coroutine_handle<> handle;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            handle = h;
+            owner->waiters_.push_back(this);
+        }
+        bool await_resume() const noexcept { return revents != 0; }
+    };
+
+    wait_op readable(int fd, int timeout_ms)
+    {
+        return wait_op { this, fd, POLLIN, vtk_clock_ns() + (uint64_t)timeout_ms * 1000000, 0, {} };
+    }
+
+    /* start the task, the loop keeps it until it completes */
+    void spawn(task<> t) { run_detached(this, std::move(t)); }
+
+    /* run until every spawned task completes */
+    void run()
+    {
+        std::vector<struct pollfd> pollfds;
+        std::vector<wait_op *>     ready;
+
+        while (live_ && ! waiters_.empty()) {
+            uint64_t now      = vtk_clock_ns();
+            uint64_t deadline = UINT64_MAX;
+            pollfds.clear();
+            for (wait_op *w : waiters_) {
+                pollfds.push_back({ w->fd, w->events, 0 });
+                deadline = w->deadline < deadline ? w->deadline : deadline;
+            }
+            int tm = deadline > now ? (int)((deadline - now + 999999) / 1000000) : 0;
+            if (vtk_poll(pollfds.data(), pollfds.size(), tm) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw error("event loop poll failed");
+            }
+            now = vtk_clock_ns();
+            ready.clear();
+            for (size_t i = waiters_.size(); i-- > 0;) {
+                wait_op *w = waiters_[i];
+                w->revents = pollfds[i].revents;
+                if (w->revents || (now >= w->deadline)) {
+                    ready.push_back(w);
+                    waiters_[i] = waiters_.back();
+                    waiters_.pop_back();
+                }
+            }
+            /* resumed coroutines may add waiters, so they are resumed after the scan */
+            for (wait_op *w : ready) {
+                w->handle.resume();
+            }
+        }
+    }
+
+private:
+    struct detached {
+        struct promise_type {
+            detached get_return_object() noexcept { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() noexcept {}
+            void unhandled_exception() noexcept { std::terminate(); }
+        };
+    };
+
+    static detached run_detached(loop *owner, task<> t)
+    {
+        owner->live_++;
+        try {
+            co_await std::move(t);
+        } catch (const std::exception &e) {
+            vtk_loge("Task failed: %s", e.what());
+        }
+        owner->live_--;
+    }
+
+    std::vector<wait_op *> waiters_;
+    size_t                 live_ = 0;
+};
+
+/*
+ * Message: arguments are added by id, read back as views into the message
+ */
+class message {
+public:
+    explicit message(vtk_t *vtk)
+    {
+        if (vtk_msg_init(&msg_, vtk) < 0) {
+            throw error::last();
+        }
+    }
+    message(message &&other) noexcept : msg_(std::exchange(other.msg_, nullptr)) {}
+    message &operator=(message &&other) noexcept
+    {
+        if (this != &other) {
+            if (msg_) {
+                vtk_msg_free(msg_);
+            }
+            msg_ = std::exchange(other.msg_, nullptr);
+        }
+        return *this;
+    }
+    message(const message &) = delete;
+    message &operator=(const message &) = delete;
+    ~message()
+    {
+        if (msg_) {
+            vtk_msg_free(msg_);
+        }
+    }
+
+    message &reset(uint16_t proto = VTK_BASE_VMC)
+    {
+        vtk_msg_mod(msg_, VTK_MSG_RESET, proto, 0, nullptr);
+        return *this;
+    }
+    message &add(uint16_t id, std::string_view value)
+    {
+        if (vtk_msg_mod(msg_, VTK_MSG_ADDBIN, id, value.size(), const_cast<char *>(value.data())) < 0) {
+            throw error::last();
+        }
+        return *this;
+    }
+    message &add(uint16_t id, std::span<const std::byte> value)
+    {
+        return add(id, std::string_view(reinterpret_cast<const char *>(value.data()), value.size()));
+    }
+    message &add(uint16_t id, long long value)
+    {
+        char buf[24];
+        auto res = std::to_chars(buf, buf + sizeof(buf), value);
+        return add(id, std::string_view(buf, res.ptr - buf));
+    }
+
+    std::optional<std::string_view> get(uint16_t id) const
+    {
+        char     *value = nullptr;
+        uint16_t  len   = 0;
+        if (vtk_msg_find_param(msg_, id, &len, &value) < 0) {
+            return std::nullopt;
+        }
+        return std::string_view(value, len);
+    }
+    std::optional<std::span<const std::byte>> bytes(uint16_t id) const
+    {
+        auto value = get(id);
+        if (! value) {
+            return std::nullopt;
+        }
+        return std::span<const std::byte>(reinterpret_cast<const std::byte *>(value->data()), value->size());
+    }
+    std::optional<long long> number(uint16_t id) const
+    {
+        auto      value = get(id);
+        long long num   = 0;
+        if (! value || (std::from_chars(value->data(), value->data() + value->size(), num).ec != std::errc())) {
+            return std::nullopt;
+        }
+        return num;
+    }
+    vtk_msgname_t name() const { return vtk_msg_name(msg_); }
+
+    /* for (auto [id, value] : msg.params()) */
+    struct param {
+        uint16_t          id;
+        std::string_view  value;
+    };
+    class param_iterator {
+    public:
+        param_iterator(vtk_msg_t *msg, uint16_t i) : msg_(msg), i_(i) { load(); }
+        param operator*() const { return cur_; }
+        param_iterator &operator++() { i_++; load(); return *this; }
+        bool operator==(const param_iterator &other) const { return end_ == other.end_ && (end_ || i_ == other.i_); }
+    private:
+        void load()
+        {
+            uint16_t len;
+            char    *value;
+            end_ = vtk_msg_iter_param(msg_, i_, &cur_.id, &len, &value) < 0;
+            cur_.value = end_ ? std::string_view() : std::string_view(value, len);
+        }
+        vtk_msg_t *msg_;
+        uint16_t   i_;
+        param      cur_ {};
+        bool       end_ = true;
+    };
+    struct param_range {
+        vtk_msg_t *msg;
+        param_iterator begin() const { return param_iterator(msg, 0); }
+        param_iterator end() const { return param_iterator(msg, UINT16_MAX); }
+    };
+    param_range params() const { return param_range { msg_ }; }
+
+    vtk_msg_t *native() const { return msg_; }
+
+private:
+    vtk_msg_t *msg_ = nullptr;
+};
+
+struct payment_result {
+    bool       approved;
+    long long  opnum;
+    long long  amount;       /* approved and finalized amount, 0 if declined */
+};
+
+/*
+ * Session: connection with one POS terminal
+ */
+class session {
+public:
+    explicit session(loop &owner) : loop_(&owner)
+    {
+        if (vtk_init(&vtk_) < 0) {
+            throw error::last();
+        }
+    }
+    session(session &&other) noexcept : loop_(other.loop_), vtk_(std::exchange(other.vtk_, nullptr)) {}
+    session &operator=(session &&other) noexcept
+    {
+        if (this != &other) {
+            if (vtk_) {
+                vtk_free(vtk_);
+            }
+            loop_ = other.loop_;
+            vtk_  = std::exchange(other.vtk_, nullptr);
+        }
+        return *this;
+    }
+    session(const session &) = delete;
+    session &operator=(const session &) = delete;
+    ~session()
+    {
+        if (vtk_) {
+            vtk_free(vtk_);
+        }
+    }
+
+    void connect(std::string host, std::string port, int timeout_ms = 5000)
+    {
+        if (vtk_net_set(vtk_, VTK_NET_CONNECTED, timeout_ms, host.data(), port.data()) < 0) {
+            throw error::last();
+        }
+    }
+    void close() { vtk_net_set(vtk_, VTK_NET_DOWN, 0, nullptr, nullptr); }
+
+    message make_message() const { return message(vtk_); }
+
+    void send(const message &msg)
+    {
+        if (vtk_net_send(vtk_, msg.native()) < 0) {
+            throw error::last();
+        }
+    }
+
+    /* next message from POS, suspends the caller until it arrives */
+    task<> recv(message &msg, int timeout_ms)
+    {
+        uint64_t deadline = vtk_clock_ns() + (uint64_t)timeout_ms * 1000000;
+        for (;;) {
+            if (! vtk_net_pending(vtk_)) {
+                uint64_t now = vtk_clock_ns();
+                if ((now >= deadline) ||
+                    ! co_await loop_->readable(vtk_net_get_socket(vtk_), (deadline - now + 999999) / 1000000)) {
+                    throw error("POS response timeout");
+                }
+            }
+            int eof    = 0;
+            int rrecv  = vtk_net_recv(vtk_, msg.native(), &eof);
+            if (rrecv < 0) {
+                throw error::last();
+            }
+            if (rrecv > 0) {
+                co_return;
+            }
+            if (eof) {
+                throw error("Connection with POS was closed unexpectedly");
+            }
+        }
+    }
+
+    /* request and its response, which must have the expected name */
+    task<> exchange(const message &req, message &resp, vtk_msgname_t expect, int timeout_ms)
+    {
+        send(req);
+        co_await recv(resp, timeout_ms);
+        if (resp.name() != expect) {
+            vtk_loge("%s response is expected, %s is received", vtk_msgname_str(expect), vtk_msgname_str(resp.name()));
+            throw error::last();
+        }
+    }
+
+    /*
+     * Payment: IDL, VRP, FIN if approved, and IDL to return POS to idle state in any case.
+     * Vend is finalized with the full price, as vendotek-cli does.
+     */
+    task<payment_result> payment(long long price, int timeout_ms = 60000)
+    {
+        payment_result     res { false, 0, 0 };
+        message            req  = make_message();
+        message            resp = make_message();
+        std::exception_ptr failure;
+
+        try {
+            co_await exchange(req.reset().add(0x1, "IDL").add(0x4, price), resp, VTK_MSGNAME_IDL, timeout_ms);
+            res.opnum = resp.number(0x3).value_or(0) + 1;
+            int optm  = resp.number(0x6) ? (int)*resp.number(0x6) * 1000 : timeout_ms;
+
+            co_await exchange(req.reset().add(0x1, "VRP").add(0x3, res.opnum).add(0x4, price), resp, VTK_MSGNAME_VRP, optm);
+            res.approved = (resp.number(0x3) == res.opnum) && (resp.number(0x4) == price);
+
+            if (res.approved) {
+                co_await exchange(req.reset().add(0x1, "FIN").add(0x3, res.opnum).add(0x4, price), resp, VTK_MSGNAME_FIN, timeout_ms);
+                res.amount = price;
+            }
+        } catch (...) {
+            failure = std::current_exception();
+        }
+        /* co_await isn't allowed in a handler, so the final IDL goes after it */
+        co_await exchange(req.reset().add(0x1, "IDL"), resp, VTK_MSGNAME_IDL, timeout_ms);
+        if (failure) {
+            std::rethrow_exception(failure);
+        }
+        co_return res;
+    }
+
+    vtk_t *native() const { return vtk_; }
+
+private:
+    loop  *loop_;
+    vtk_t *vtk_ = nullptr;
+};
+
+} /* namespace vtk */
+
+#endif
@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vendotek.h"
+
+/*
+ * Journal recovery: the newest transaction is left open (approved, FIN never sent) behind
+ * enough closed ones to compact the journal at open; it must be reported on every open,
+ * compacted or not, and transaction ids must never be reused
+ */
+#define CLOSED_TXS  4200
+#define REOPENS     3
+
+static int
+check(int cond, const char *what)
+{
+    if (! cond) {
+        fprintf(stderr, "FAIL: %s\n", what);
+    }
+    return cond ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+    char path[] = "/tmp/vtk-journal-XXXXXX";
+    int  fd     = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+    vtk_logline_set(NULL, 3);
+
+    vtk_journal_t *journal;
+    int            fails = 0;
+    if (vtk_journal_open(&journal, path) < 0) {
+        return 1;
+    }
+    for (int i = 0; i < CLOSED_TXS; i++) {
+        vtk_jrec_t rec = { .txid = vtk_journal_txid(journal), .opnum = i, .state = VTK_JOURNAL_DONE };
+        fails += check(vtk_journal_append(journal, &rec) >= 0, "append closed transaction");
+    }
+    uint64_t   open_txid = vtk_journal_txid(journal);
+    vtk_jrec_t approved  = { .txid = open_txid, .opnum = CLOSED_TXS, .price = 100, .state = VTK_JOURNAL_APPROVED };
+    fails += check(vtk_journal_append(journal, &approved) >= 0, "append approved transaction");
+    vtk_journal_close(journal);
+
+    /* no reconciliation in between, e.g. POS is unreachable */
+    for (int i = 0; i < REOPENS; i++) {
+        vtk_jrec_t *recs;
+        size_t      cnt;
+        if (vtk_journal_open(&journal, path) < 0) {
+            fails++;
+            break;
+        }
+        vtk_journal_pending(journal, &recs, &cnt);
+        fails += check(cnt == 1, "one open transaction after reopen");
+        fails += check(cnt && (recs[0].txid == open_txid) && (recs[0].state == VTK_JOURNAL_APPROVED),
+                       "open transaction is the approved one");
+        fails += check(vtk_journal_txid(journal) > open_txid, "transaction ids are not reused");
+        vtk_journal_close(journal);
+    }
+    unlink(path);
+    printf("%s: journal-recovery\n", fails ? "FAIL" : "PASS");
+    return fails ? 1 : 0;
+}